@@ -2,9 +2,13 @@
 #define SAP_MANAGER_H
 
 #include "SAP_internal.h"
+#include "SAPWorkerPool.h"
+#include "SAPTrace.h"
 #include "types/containers/Array.h"
 #include "types/Path.h"
 #include <vector>
+#include <atomic>
+#include <memory>
 #ifdef USE_SDL2
 #   include "assets/Image.h"
 #endif
@@ -22,7 +26,7 @@ namespace grynca {
         bool containsBox(Index box_id)const;
         Box& accBox(Index box_id);
         const Box& getBox(Index box_id)const;
-        u32 getGroupId(u32 box_id)const;
+        const SAP::CollisionFilter& getCollisionFilter(Index box_id)const;
         u32 getBoxesCount()const;
         Segment* getRootSegment()const;
 
@@ -31,7 +35,75 @@ namespace grynca {
         void getOverlapWithData(u32 overlap_id, Index& b1_id_out, Index& b2_id_out, OverlapDataT*& coll_data_ptr_out);
         OverlapDataT* findOverlap(Index b1_id, Index b2_id);
         OverlapDataT* findOverlap(Box& b1, Box& b2);
+        // overlaps of single box, cb(Index other_box_id, OverlapDataT& data), must not add/remove boxes or overlaps
+        template <typename Cb>
+        void forEachOverlapOf(Index box_id, const Cb& cb);
+        u32 getOverlapsCount(Index box_id)const;
+        // const queries (queryAABB(), SAPRaycaster::raycast() & sweepBox() with own scratch) may run from many threads
+        // at once while nothing modifies manager (debug build asserts it)
         Raycaster getRayCaster()const;
+        // boxes (incl. sleeping) whose bounds intersect given bounds, each reported once, tree & pairs are not changed
+        // void cb(Index box_id)
+        template <typename Cb>
+        void queryAABB(const f32* bounds, const Cb& cb)const;
+        // copies current tree & box bounds to read-only view (e.g. at frame end), readers that got view with
+        // getReadView() query it without locks from any thread while manager is modified,
+        // buffer of previous view is reused when no reader holds it anymore
+        void publishReadView();
+        // last published view (NULL before first publish), reader keeps it alive while holding pointer
+        std::shared_ptr<const ReadView> getReadView()const;
+
+        // overlap events (disabled by default) are accumulated until clearOverlapEvents(),
+        // pairs that began and ended in between are dropped,
+        // pair that ended and began again is in both (its overlap data was recreated)
+        void setOverlapEventsEnabled(bool enabled);
+        SAP::Span<SAP::OverlapPair> getBeganOverlaps();
+        SAP::Span<SAP::OverlapPair> getEndedOverlaps();
+        void clearOverlapEvents();
+
+        // endpoints are stored enlarged by margin, moves & updates that stay inside fat bounds don't touch segments
+        // (new margin is used for boxes added or leaving their fat bounds afterwards)
+        void setFatMargin(f32 margin);
+        f32 getFatMargin()const;
+        // reported overlaps are between fat boxes (cheaper, pairs don't change while boxes move inside their fat bounds)
+        // or between tight boxes (default), see SAPManagerC::setReportFatOverlaps()
+        bool getReportFatOverlaps()const;
+
+        // when enabled, over-full and under-full leafs are only queued and restructured in maintainTree()
+        // (split/merge cost is spread over frames), disabling restructures all queued leafs
+        void setDeferredTreeMaintenance(bool enabled);
+        bool getDeferredTreeMaintenance()const;
+        // restructures queued leafs until one of budgets is spent (0 = unlimited), call once per frame,
+        // returns number of leafs still queued
+        u32 maintainTree(u32 max_nodes, u32 max_micros = 0);
+        u32 getQueuedMaintenanceCount()const;
+
+        // counters since resetStats() (call once per frame) and current tree gauges (walks segments)
+        SAP::Stats getStats()const;
+        void resetStats();
+
+        // streams following operations (ids & bounds) to binary trace for offline replay (see SAPTraceReader),
+        // boxes already in manager are recorded as added first
+        bool startRecording(const char* path);
+        // false when some write failed
+        bool stopRecording();
+        bool isRecording()const;
+        // call once per frame while recording (replay reports per-frame timings)
+        void recordFrameEnd();
+
+        // whole state (tree with endpoints, boxes, filters, pairs) in versioned binary format,
+        // client & overlap data are stored only when trivially copyable
+        bool saveSnapshot(const char* path)const;
+        // replaces content without sorting endpoints or splitting segments, fails without changes for missing file
+        // or incompatible header (manager is left empty when content is corrupted),
+        // box_ids_out (optional) is indexed by box inner ids at save time (unused ones are default constructed)
+        bool loadSnapshot(const char* path, fast_vector<Index>* box_ids_out = NULL);
+        // e.g. from mmapped file
+        bool loadSnapshot(const void* data, size_t size, fast_vector<Index>* box_ids_out = NULL);
+
+        // > 1 enables parallel batch updates (moveBoxes, updateBoxes) on given number of threads (including calling thread)
+        void setWorkersCount(u32 workers_count);
+        u32 getWorkersCount()const;
 
         void calcBounds(f32* bounds);
         // for debug
@@ -46,38 +118,185 @@ namespace grynca {
     protected:
         friend Segment;
         friend Raycaster;
+        friend ReadView;
 
         template <typename Derived>
-        Box& addBoxInner_(Index& box_id_out, f32* bounds, const BoxDataT& box_data);
+        Box& addBoxInner_(Index& box_id_out, const f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter);
+        template <typename Derived>
+        void addBoxesInner_(const f32* bounds, const BoxDataT* boxes_data, u32 boxes_count, Index* box_ids_out, const SAP::CollisionFilter* filters);
+        template <typename Derived>
+        Box& addStaticBoxInner_(Index& box_id_out, const f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter);
+        template <typename Derived>
+        void sleepBoxInner_(Index box_id);
+        template <typename Derived>
+        void wakeBoxInner_(Index box_id);
+        template <typename Derived>
+        void setCollisionFilterInner_(Index box_id, const SAP::CollisionFilter& filter);
+        template <typename Derived>
+        void setReportFatOverlapsInner_(bool fat);
         template <typename Derived>
         void updateBoxInner_(Index box_id, f32* bounds);
         template <typename Derived>
         void moveBoxInner_(Index box_id, f32* move_vec);
         template <typename Derived>
+        void updateBoxesInner_(const Index* box_ids, const f32* bounds, u32 boxes_count);
+        template <typename Derived>
+        void moveBoxesInner_(const Index* box_ids, const f32* move_vecs, u32 boxes_count);
+        // leafs are distributed among workers, out of segment removals, crossings and overlaps are resolved serially afterwards
+        template <typename Derived>
+        void updateBoxesParallel_(const Index* box_ids, const f32* bounds_or_move_vecs, u32 boxes_count, bool is_move);
+        // updates endpoints in box segments, overlaps & tree changes are left for afterUpdate_
+        Box& updateBoxPoints_(Index box_id, const f32* bounds);
+        Box& moveBoxPoints_(Index box_id, const f32* move_vec);
+        // sets fat bounds around box's tight bounds & updates its endpoints
+        void refattenBoxPoints_(Box& box, Index box_id);
+        bool fitsFatBounds_(Box& box)const;
+        void fattenBounds_(Box& box);
+        template <typename Derived>
         void removeBoxInner_(Index box_id);
 
         template <typename Derived>
         void afterUpdate_(Box& box, Index box_id, const f32* bounds);
+        // stores box's candidates & crossing for resolving after whole batch is updated
+        void deferBatchUpdate_(Index box_id);
+        template <typename Derived>
+        void afterBatchUpdate_();
+        void addCrossingBox_(Box& box, Index box_id, const f32* bounds);
+        void doMerges_();
+        // freed segments are kept with their endpoint buffers for reuse
+        Segment* newSegment_(Segment* parent);
+        void freeSegment_(Segment* s);
+        void scheduleMaintenance_(Segment* s);
+        // all pairs are added/removed through these (hooks, events)
+        template <typename Derived>
+        void addOverlap_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id);
+        template <typename Derived>
+        void removeOverlap_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id);
+        // pairs kept by endpoint swaps (fat pairs when keepsFatPairs_(), reported ones otherwise)
+        //  candidates must be tested with keptPairOverlaps_() before adding
+        template <typename Derived>
+        void addPair_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id);
+        template <typename Derived>
+        void removePair_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id);
+        void addFatPair_(u32 b1_inner_id, u32 b2_inner_id);
+        template <typename Cb>
+        void forEachKeptPairOf_(u32 box_inner_id, const Cb& cb)const;
+        // tight reporting with fat boxes keeps fat pairs, reported pairs are rechecked from them
+        bool keepsFatPairs_()const;
+        // searches fat pairs from scratch (after fat boxes appear or snapshot is loaded)
+        void findFatPairs_();
         template <typename Derived>
         void addOverlaps_(Box& box, Index box_id);
         template <typename Derived>
         void removeOverlaps_(Box& box, Index box_id);
+        // with SAP_LAZY_ENDPOINT_IDS endpoint ids in occurences must be resolved before box bounds are changed
+        void resolveEndPointIds_(Box& box, Index box_id);
+        // rechecks box's pairs and searches for new ones in its segments
+        template <typename Derived>
+        void refreshOverlaps_(Box& box, Index box_id);
+        // rechecks tight overlaps of box's fat pairs
+        template <typename Derived>
+        void refreshTightOverlaps_(Box& box, Index box_id);
+        // same only for pairs with sleeping boxes (awake box does not swap endpoints with them)
+        template <typename Derived>
+        void refreshSleepingOverlaps_(Box& box, Index box_id);
+        // after box's points were updated
+        template <typename Derived>
+        void refreshUpdatedBox_(Box& box, Index box_id);
+        bool needsRefresh_()const;
+        // counting of const queries in flight (debug build only)
+        void beginRead_()const;
+        void endRead_()const;
+        void assertNoReads_()const;
+        template <typename Derived>
+        void findAllOverlaps_();
+        // cb(b1_inner_id, b2_inner_id) for awake pairs owned by each leaf (tested with keptPairOverlaps_())
+        template <typename Cb>
+        void sweepLeaves_(const Cb& cb);
+        // adds overlapping & removes not overlapping candidate pairs
+        template <typename Derived>
+        void reconcileCandidatePairs_();
+
+        // writes fat margin & boxes as added to trace
+        void recordState_();
+        bool readSnapshot_(SAP::SnapshotReader& r, u32 boxes_count, u32 segments_count, u32 pairs_count, fast_vector<Index>* box_ids_out);
 
         template <typename Derived>
         Derived& getAs_() { return (*(Derived*)this); }
 
         struct DeferredAfterUpdate {
+            DeferredAfterUpdate() : crossing_(false) {}
+
+            void scheduleMerge(Segment* s);
+
             bool crossing_;
             fast_vector<Segment*> merges_;
+            fast_vector<Index> crossed_boxes_;      // boxes crossing segment border during batch update
+            fast_vector<Index> refreshed_boxes_;    // overlaps rechecked after batch update (with fat or sleeping boxes)
         };
 
         bool boxesOverlap_(Box& b1, Box& b2);
+        bool keptPairOverlaps_(Box& b1, Box& b2);
+        bool canCollide_(u32 b1_inner_id, u32 b2_inner_id)const;
+        // removes ids from position from that can't collide with box
+        void filterCandidates_(u32 box_inner_id, fast_vector<u32>& ids, u32 from)const;
+        void setFilter_(u32 box_inner_id, const SAP::CollisionFilter& filter);
         void debugPrintSegmentRec_(const std::string& name, std::vector<bool>& path, Segment* s, std::ostream& os, u32& segs_cnt, u32* splits_count);
 
+        struct ParallelBatch {
+            struct LeafTask {
+                Segment* seg;
+                u32 first;
+                u32 count;
+            };
+
+            struct BoxTask {
+                u32 batch_id;
+                Box* box;
+                SAP::MinMax* min_max_ids;
+            };
+
+            struct WorkerScratch {
+                SAP::Candidates cands;
+                fast_vector<SAP::CollPair> pairs;
+                fast_vector<u32> crossed;       // batch ids
+                fast_vector<u32> oos_tasks;
+            };
+
+            fast_vector<LeafTask> leaves;
+            fast_vector<u32> updated;           // batch ids of boxes with updated points
+            fast_vector<BoxTask> tasks;
+            fast_vector<u32> task_leaves;
+            fast_vector<WorkerScratch> workers;
+            fast_vector<f32> old_bounds;        // for resolving endpoint ids (SAP_LAZY_ENDPOINT_IDS)
+        };
+
         Segment* root_;
         TightArray<Box> boxes_;
+        fast_vector<SAP::CollisionFilter> filters_;     // indexed by box inner id (checked during sweeps)
+        SAPWorkerPool* workers_;
+        f32 fat_margin_;
+        bool has_fat_boxes_;        // fat bounds may differ from tight ones
+        bool report_fat_overlaps_;
+        u32 sleeping_boxes_count_;
+        ParallelBatch parallel_batch_;
+        fast_vector<Segment*> free_segments_;
+        fast_vector<u8> split_flags_[AXES_COUNT];     // scratch for Segment::split_()
+        fast_vector<f32> split_sleeping_[2];          // same (sorted mins & maxes of sleeping boxes on tested axis)
+        bool deferred_maintenance_;
+        u32 queued_maintenance_count_;
+        fast_vector<Segment*> maintenance_queue_;       // may contain stale entries (freed or already restructured segments)
+        SAPTraceWriter* trace_;         // NULL when not recording
+        // double buffered read views, read_view_ is accessed atomically
+        std::shared_ptr<const ReadView> read_view_;
+        std::shared_ptr<ReadView> published_view_, spare_view_;
+        u64 read_view_version_;
+#ifdef DEBUG_BUILD
+        mutable std::atomic<u32> reads_count_;
+#endif
 
-        SAP::Overlaps<OverlapDataT> overlaps_;
+        SAP::Overlaps<OverlapDataT, Policy> overlaps_;
+        SAP::OverlapEvents overlap_events_;
         DeferredAfterUpdate deferred_after_update_;
     };
 
@@ -89,10 +308,29 @@ namespace grynca {
         SAP_DOMAIN_TYPES(SAPDomain);
 
         // bounds is f32 coords array [LTx, LTy, ... , RBx, RBy, ...] (LeftTop, RightBot)
-        Box& addBox(Index& box_id_out, f32* bounds, const BoxDataT& box_data);
+        Box& addBox(Index& box_id_out, f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter = SAP::CollisionFilter());
+        // bounds: boxes_count*2*AXES_COUNT coords, box_ids_out: boxes_count ids, filters: boxes_count filters or NULL for default
+        // when manager is empty tree is built top-down from sorted endpoints (much faster than adding one by one)
+        void addBoxes(const f32* bounds, const BoxDataT* boxes_data, u32 boxes_count, Index* box_ids_out, const SAP::CollisionFilter* filters = NULL);
+        // static box is added already sleeping
+        Box& addStaticBox(Index& box_id_out, f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter = SAP::CollisionFilter());
+        // sleeping boxes are kept aside from endpoints of awake ones (moving boxes don't swap with them),
+        // pairs among sleeping boxes are not reported, updating or moving sleeping box wakes it
+        void sleepBox(Index box_id);
+        void wakeBox(Index box_id);
+        // pairs filtered out are removed, newly allowed are added
+        void setCollisionFilter(Index box_id, const SAP::CollisionFilter& filter);
+        // overlaps between fat or tight boxes (see SAPManagerBase::setFatMargin()), pairs that differ between
+        // them are added/removed when switched with boxes inside
+        void setReportFatOverlaps(bool fat);
         void updateBox(Index box_id, f32* bounds);
         void moveBox(Index box_id, f32* move_vec);
         void removeBox(Index box_id);
+        // batch versions, endpoints of all boxes are updated first and then
+        // crossings, merges and overlaps are resolved at once
+        // bounds: boxes_count*2*AXES_COUNT coords, move_vecs: boxes_count*AXES_COUNT coords
+        void updateBoxes(const Index* box_ids, const f32* bounds, u32 boxes_count);
+        void moveBoxes(const Index* box_ids, const f32* move_vecs, u32 boxes_count);
     protected:
         friend Manager;
 
@@ -1,10 +1,14 @@
 #include "SAPManagerC.h"
 #include "SAPSegment.h"
 #include "SAPRaycaster.h"
+#include "SAPReadView.h"
 #include "base.h"
 #include <algorithm>
 #include <cassert>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
 
 #define SMB_TPL template <typename SAPDomain>
 #define SMB_TYPE SAPManagerBase<SAPDomain>
@@ -17,18 +21,38 @@ namespace grynca {
 
     SMB_TPL
     inline SMB_TYPE::SAPManagerBase()
-     : root_(new Segment(*this, NULL))
+     : root_(new Segment(*this, NULL)), workers_(NULL), fat_margin_(0.0f), has_fat_boxes_(false), report_fat_overlaps_(false), sleeping_boxes_count_(0),
+       deferred_maintenance_(false), queued_maintenance_count_(0), trace_(NULL),
+       read_view_version_(0)
     {
         root_->setDebugName_();
         root_->calcBorders_();
+#ifdef DEBUG_BUILD
+        reads_count_ = 0;
+#endif
     }
 
     SMB_TPL
     inline SMB_TYPE::~SAPManagerBase() {
+        delete trace_;
+        delete workers_;
         delete root_;
+        for (u32 i=0; i<free_segments_.size(); ++i) {
+            delete free_segments_[i];
+        }
         boxes_.clear();
     }
 
+    SMB_TPL
+    inline void SMB_TYPE::DeferredAfterUpdate::scheduleMerge(Segment* s) {
+        // during batch update segment may get scheduled multiple times
+        for (u32 i=0; i<merges_.size(); ++i) {
+            if (merges_[i] == s)
+                return;
+        }
+        merges_.push_back(s);
+    }
+
     SMB_TPL
     inline bool SMB_TYPE::containsBox(Index box_id)const {
         return boxes_.isValidIndex(box_id);
@@ -81,6 +105,13 @@ namespace grynca {
                 Segment* seg = box.getOccurence(i).segment_;
 
                 ASSERT(!seg->isSplit());
+                if (box.sleeping_) {
+                    ASSERT(seg->findSleepingPointId_(box_id.getIndex(), box.getMinValue(0)) < seg->sleeping_points_.size());
+                    continue;
+                }
+#ifdef SAP_LAZY_ENDPOINT_IDS
+                seg->resolveEndPointIds_(box.bounds_, box_id.getIndex(), box.getOccurence(i).min_max_ids_);
+#endif
 
                 for (u32 a=0; a<AXES_COUNT; ++a) {
                     u32 min_id = box.getOccurence(i).min_max_ids_[a].v[0];
@@ -88,15 +119,22 @@ namespace grynca {
                     ASSERT(min_id < max_id);
                     ASSERT(min_id < seg->points_[a].size());
                     ASSERT(max_id < seg->points_[a].size());
-                    ASSERT(seg->points_[a][min_id].getBoxId() == box_id.getIndex());
-                    ASSERT(seg->points_[a][max_id].getBoxId() == box_id.getIndex());
+                    ASSERT(seg->points_[a].getBoxId(min_id) == box_id.getIndex());
+                    ASSERT(seg->points_[a].getBoxId(max_id) == box_id.getIndex());
 
                     f32 border_val;
-                    ASSERT(!seg->getHighBorder(a, border_val) || seg->points_[a][min_id].getValue() < border_val);
-                    ASSERT(!seg->getLowBorder(a, border_val) || seg->points_[a][max_id].getValue() > border_val);
+                    // box touching border is inside (same as in addBoxTree_())
+                    ASSERT(!seg->getHighBorder(a, border_val) || seg->points_[a].getValue(min_id) <= border_val);
+                    ASSERT(!seg->getLowBorder(a, border_val) || seg->points_[a].getValue(max_id) >= border_val);
                 }
             }
         }
+        if (keepsFatPairs_()) {
+            // reported pairs are subset of fat ones
+            for (u32 i=0; i<overlaps_.pm.getItemsCount(); ++i) {
+                ASSERT(overlaps_.fat_pm.findItem(overlaps_.pm.getKey(i)));
+            }
+        }
 #ifdef SAP_VALIDATE_OVERLAPS
         for (u32 b1_pos=0; b1_pos<boxes_.size(); ++b1_pos) {
             Box& b1 = boxes_.accItemAtPos2(b1_pos);
@@ -104,12 +142,10 @@ namespace grynca {
             for (u32 b2_pos=b1_pos+1; b2_pos<boxes_.size(); ++b2_pos) {
                 Box& b2 = boxes_.accItemAtPos2(b2_pos);
                 Index b2_id = boxes_.getIndexForPos(b2_pos);
-                bool overlaps_in_sap = bool(overlaps_.pm.findItem(SAP::CollPair(b1_id.getIndex(), b2_id.getIndex())));
-                bool overlaps_ground_truth = boxesOverlap_(b1, b2);
-                if (overlaps_in_sap != overlaps_ground_truth) {
-                    overlaps_ground_truth = boxesOverlap_(b1, b2);
-                }
-                ASSERT(overlaps_in_sap == overlaps_ground_truth);
+                SAP::CollPair cp(b1_id.getIndex(), b2_id.getIndex());
+                bool can_overlap = canCollide_(b1_id.getIndex(), b2_id.getIndex()) && !(b1.sleeping_ && b2.sleeping_);
+                ASSERT(bool(overlaps_.pm.findItem(cp)) == (can_overlap && boxesOverlap_(b1, b2)));
+                ASSERT(!keepsFatPairs_() || bool(overlaps_.fat_pm.findItem(cp)) == (can_overlap && keptPairOverlaps_(b1, b2)));
             }
         }
 #endif
@@ -132,12 +168,13 @@ namespace grynca {
         const SAP::CollPair& p = overlaps_.pm.getKey(overlap_id);
         b1_id_out = boxes_.getFullIndex(p.id1);
         b2_id_out = boxes_.getFullIndex(p.id2);
-        coll_data_ptr_out = &overlaps_.pm.accItem(overlap_id);
+        coll_data_ptr_out = &overlaps_.adjacency.accNode(overlaps_.pm.accItem(overlap_id)).data;
     }
 
     SMB_TPL
     inline typename SMB_TYPE::OverlapDataT* SMB_TYPE::findOverlap(Index b1_id, Index b2_id) {
-        return overlaps_.pm.findItem(SAP::CollPair(b1_id.getIndex(), b2_id.getIndex()));
+        u32* node_id = overlaps_.pm.findItem(SAP::CollPair(b1_id.getIndex(), b2_id.getIndex()));
+        return node_id ? &overlaps_.adjacency.accNode(*node_id).data : NULL;
     }
 
     SMB_TPL
@@ -146,7 +183,49 @@ namespace grynca {
         u32 b2_pos = boxes_.getItemPos(&b2);
         u32 b1_inner_id = boxes_.getPool().getInnerIndexForPos(b1_pos);
         u32 b2_inner_id = boxes_.getPool().getInnerIndexForPos(b2_pos);
-        return overlaps_.pm.findItem(SAP::CollPair(b1_inner_id, b2_inner_id));
+        u32* node_id = overlaps_.pm.findItem(SAP::CollPair(b1_inner_id, b2_inner_id));
+        return node_id ? &overlaps_.adjacency.accNode(*node_id).data : NULL;
+    }
+
+    SMB_TPL
+    template <typename Cb>
+    inline void SMB_TYPE::forEachOverlapOf(Index box_id, const Cb& cb) {
+        ASSERT(boxes_.isValidIndex(box_id));
+        u32 inner_id = box_id.getIndex();
+        SAP::Adjacency<OverlapDataT>& adj = overlaps_.adjacency;
+        for (u32 n=adj.getFirst(inner_id); n!=InvalidId(); n=adj.getNext(n, inner_id)) {
+            cb(boxes_.getFullIndex(adj.getOther(n, inner_id)), adj.accNode(n).data);
+        }
+    }
+
+    SMB_TPL
+    inline u32 SMB_TYPE::getOverlapsCount(Index box_id)const {
+        ASSERT(boxes_.isValidIndex(box_id));
+        return overlaps_.adjacency.getCount(box_id.getIndex());
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::setOverlapEventsEnabled(bool enabled) {
+        overlap_events_.enabled_ = enabled;
+        if (!enabled)
+            overlap_events_.clear();
+    }
+
+    SMB_TPL
+    inline SAP::Span<SAP::OverlapPair> SMB_TYPE::getBeganOverlaps() {
+        overlap_events_.resolve();
+        return SAP::Span<SAP::OverlapPair>(overlap_events_.began_.empty()?NULL:&overlap_events_.began_[0], u32(overlap_events_.began_.size()));
+    }
+
+    SMB_TPL
+    inline SAP::Span<SAP::OverlapPair> SMB_TYPE::getEndedOverlaps() {
+        overlap_events_.resolve();
+        return SAP::Span<SAP::OverlapPair>(overlap_events_.ended_.empty()?NULL:&overlap_events_.ended_[0], u32(overlap_events_.ended_.size()));
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::clearOverlapEvents() {
+        overlap_events_.clear();
     }
 
     SMB_TPL
@@ -154,6 +233,505 @@ namespace grynca {
         return Raycaster(*this);
     }
 
+    SMB_TPL
+    template <typename Cb>
+    inline void SMB_TYPE::queryAABB(const f32* bounds, const Cb& cb)const {
+        beginRead_();
+        // descends as when adding box with these bounds
+        root_->addBoxTree_(bounds, [this, bounds, &cb](Segment* leaf) {
+            leaf->queryLeaf_(bounds, [this, &cb](u32 box_inner_id) {
+                cb(boxes_.getFullIndex(box_inner_id));
+            });
+        });
+        endRead_();
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::publishReadView() {
+        assertNoReads_();
+        std::shared_ptr<ReadView> view;
+        if (spare_view_ && spare_view_.use_count() == 1) {
+            // use_count() is relaxed load, fence syncs with last reader's release of view (its reads happen before rebuild)
+            std::atomic_thread_fence(std::memory_order_acquire);
+            view.swap(spare_view_);
+        }
+        else
+            view = std::make_shared<ReadView>();
+        view->build_(*this, ++read_view_version_);
+        std::atomic_store(&read_view_, std::shared_ptr<const ReadView>(view));
+        spare_view_.swap(published_view_);
+        published_view_ = view;
+    }
+
+    SMB_TPL
+    inline std::shared_ptr<const typename SMB_TYPE::ReadView> SMB_TYPE::getReadView()const {
+        return std::atomic_load(&read_view_);
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::setWorkersCount(u32 workers_count) {
+        if (workers_count == getWorkersCount())
+            return;
+        delete workers_;
+        workers_ = (workers_count > 1) ? new SAPWorkerPool(workers_count) : NULL;
+        parallel_batch_.workers.resize(workers_count?workers_count:1);
+    }
+
+    SMB_TPL
+    inline u32 SMB_TYPE::getWorkersCount()const {
+        return workers_ ? workers_->getWorkersCount() : 1;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::setFatMargin(f32 margin) {
+        ASSERT(margin >= 0.0f);
+        assertNoReads_();
+        if (trace_)
+            trace_->writeSetFatMargin(margin);
+        fat_margin_ = margin;
+        if (margin > 0.0f && !has_fat_boxes_) {
+            has_fat_boxes_ = true;
+            findFatPairs_();
+        }
+    }
+
+    SMB_TPL
+    inline f32 SMB_TYPE::getFatMargin()const {
+        return fat_margin_;
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::getReportFatOverlaps()const {
+        return report_fat_overlaps_;
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::setReportFatOverlapsInner_(bool fat) {
+        if (fat == report_fat_overlaps_)
+            return;
+        bool kept_fat_pairs = keepsFatPairs_();
+        report_fat_overlaps_ = fat;
+        if (fat) {
+            // kept fat pairs become reported ones
+            if (kept_fat_pairs) {
+                for (u32 i=0; i<overlaps_.fat_pm.getItemsCount(); ++i) {
+                    const SAP::CollPair& p = overlaps_.fat_pm.getKey(i);
+                    addOverlap_<Derived>(boxes_.accItemWithInnerIndex(p.id1), boxes_.accItemWithInnerIndex(p.id2), p.id1, p.id2);
+                }
+            }
+            overlaps_.fat_pm.clear();
+            overlaps_.fat_adjacency.clear();
+            return;
+        }
+        if (!keepsFatPairs_())
+            return;
+        // reported fat pairs are kept, those not overlapping tightly are removed
+        findFatPairs_();
+        fast_vector<SAP::CollPair> removed;
+        for (u32 i=0; i<overlaps_.pm.getItemsCount(); ++i) {
+            const SAP::CollPair& p = overlaps_.pm.getKey(i);
+            if (!boxesOverlap_(boxes_.accItemWithInnerIndex(p.id1), boxes_.accItemWithInnerIndex(p.id2)))
+                removed.push_back(p);
+        }
+        for (u32 i=0; i<removed.size(); ++i) {
+            const SAP::CollPair& p = removed[i];
+            removeOverlap_<Derived>(boxes_.accItemWithInnerIndex(p.id1), boxes_.accItemWithInnerIndex(p.id2), p.id1, p.id2);
+        }
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::setDeferredTreeMaintenance(bool enabled) {
+        assertNoReads_();
+        deferred_maintenance_ = enabled;
+        if (!enabled)
+            maintainTree(0);
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::getDeferredTreeMaintenance()const {
+        return deferred_maintenance_;
+    }
+
+    SMB_TPL
+    inline u32 SMB_TYPE::maintainTree(u32 max_nodes, u32 max_micros) {
+        PROFILE_BLOCK("maintainTree");
+        assertNoReads_();
+
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+        fast_vector<Segment*>& q = maintenance_queue_;
+        u32 nodes = 0;
+        u32 i = 0;
+        // queue may grow while looping (merged leaf can be under-full again)
+        for (; i<q.size() && queued_maintenance_count_; ++i) {
+            if (max_nodes && nodes >= max_nodes)
+                break;
+            if (max_micros && std::chrono::duration_cast<std::chrono::microseconds>(Clock::now()-start).count() >= max_micros)
+                break;
+
+            Segment* s = q[i];
+            // freed segments have flag cleared (and reused ones are queued again)
+            if (!s->maintenance_queued_)
+                continue;
+            s->maintenance_queued_ = false;
+            --queued_maintenance_count_;
+
+            if (s->needsSplit_()) {
+                s->split_();
+                ++nodes;
+            }
+            else if (s->needsMerge_()) {
+                Segment* parent = s->parent_;
+                parent->merge_(s);
+                ++nodes;
+                if (parent->needsMerge_())
+                    scheduleMaintenance_(parent);
+            }
+        }
+        if (!queued_maintenance_count_)
+            q.clear();
+        else
+            q.erase(q.begin(), q.begin()+i);
+        return queued_maintenance_count_;
+    }
+
+    SMB_TPL
+    inline u32 SMB_TYPE::getQueuedMaintenanceCount()const {
+        return queued_maintenance_count_;
+    }
+
+    SMB_TPL
+    inline SAP::Stats SMB_TYPE::getStats()const {
+        SAP::Stats stats;
+#ifndef SAP_NO_STATS
+        stats = overlaps_.stats_;
+#endif
+        stats.bytes_allocated = sizeof(*this) + u64(boxes_.size())*sizeof(Box) + filters_.capacity()*sizeof(SAP::CollisionFilter)
+                                + u64(overlaps_.pm.getItemsCount())*(sizeof(u32) + sizeof(SAP::CollPair))
+                                + overlaps_.adjacency.getMemoryUsage();
+        for (u32 i=0; i<free_segments_.size(); ++i) {
+            stats.bytes_allocated += free_segments_[i]->getMemoryUsage();
+        }
+
+        fast_vector<std::pair<Segment*, u32> > segs{{root_, 1}};     // with depth
+        while (!segs.empty()) {
+            Segment* s = segs.back().first;
+            u32 depth = segs.back().second;
+            segs.pop_back();
+
+            ++stats.segments_count;
+            stats.bytes_allocated += s->getMemoryUsage();
+            stats.tree_depth = std::max(stats.tree_depth, depth);
+            if (s->isSplit()) {
+                segs.push_back({s->children_[0], depth+1});
+                segs.push_back({s->children_[1], depth+1});
+            }
+            else {
+                ++stats.leafs_count;
+                stats.max_leaf_boxes = std::max(stats.max_leaf_boxes, s->getBoxesCount() + s->getSleepingBoxesCount());
+            }
+        }
+        return stats;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::resetStats() {
+#ifndef SAP_NO_STATS
+        overlaps_.stats_.reset();
+#endif
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::startRecording(const char* path) {
+        stopRecording();
+        trace_ = new SAPTraceWriter(AXES_COUNT);
+        if (!trace_->open(path)) {
+            delete trace_;
+            trace_ = NULL;
+            return false;
+        }
+        recordState_();
+        return trace_->isGood();
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::stopRecording() {
+        if (!trace_)
+            return true;
+        bool good = trace_->isGood();
+        delete trace_;
+        trace_ = NULL;
+        return good;
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::isRecording()const {
+        return trace_ != NULL;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::recordFrameEnd() {
+        if (trace_)
+            trace_->writeOp(SAP::toFrameEnd);
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::saveSnapshot(const char* path)const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            return false;
+        SAP::SnapshotWriter w(file);
+
+        // segments in pre-order (occurences refer to them by position)
+        fast_vector<Segment*> segs;
+        std::unordered_map<Segment*, u32> seg_ids;
+        fast_vector<Segment*> stack{root_};
+        while (!stack.empty()) {
+            Segment* s = stack.back();
+            stack.pop_back();
+            seg_ids[s] = u32(segs.size());
+            segs.push_back(s);
+            if (s->isSplit()) {
+                stack.push_back(s->children_[1]);
+                stack.push_back(s->children_[0]);
+            }
+        }
+
+        // sorted by inner ids, so they are kept when loaded to empty manager
+        fast_vector<u32> box_inner_ids(boxes_.size());
+        for (u32 box_pos=0; box_pos<boxes_.size(); ++box_pos) {
+            box_inner_ids[box_pos] = boxes_.getIndexForPos(box_pos).getIndex();
+        }
+        std::sort(box_inner_ids.begin(), box_inner_ids.end());
+
+        w.write(SAP::SNAPSHOT_MAGIC, sizeof(SAP::SNAPSHOT_MAGIC));
+        w.write(SAP::SNAPSHOT_VERSION);
+        w.write(u32(AXES_COUNT));
+        w.write(u32(Policy::MAX_BOX_OCCURENCES));
+        w.write(SAP::SnapshotData<BoxDataT>::getSize());
+        w.write(SAP::SnapshotData<OverlapDataT>::getSize());
+        w.write(fat_margin_);
+        w.write(u8(has_fat_boxes_));
+        w.write(u8(report_fat_overlaps_));
+        w.write(u32(box_inner_ids.size()));
+        w.write(u32(segs.size()));
+        w.write(u32(overlaps_.pm.getItemsCount()));
+
+        for (u32 i=0; i<box_inner_ids.size(); ++i) {
+            u32 inner_id = box_inner_ids[i];
+            const Box& b = boxes_.getItemWithInnerIndex(inner_id);
+            w.write(inner_id);
+            w.write(b.bounds_, sizeof(b.bounds_));
+            w.write(b.tight_bounds_, sizeof(b.tight_bounds_));
+            w.write(u8(b.sleeping_));
+            w.write(b.occurences_count_);
+            for (u32 j=0; j<b.occurences_count_; ++j) {
+                w.write(seg_ids[b.occurences_[j].segment_]);
+            }
+            w.write(filters_[inner_id]);
+            SAP::SnapshotData<BoxDataT>::write(w, b.client_data_);
+        }
+
+        for (u32 i=0; i<segs.size(); ++i) {
+            segs[i]->writeSnapshot_(w);
+        }
+
+        for (u32 i=0; i<overlaps_.pm.getItemsCount(); ++i) {
+            const SAP::CollPair& p = overlaps_.pm.getKey(i);
+            w.write(p.id1);
+            w.write(p.id2);
+            SAP::SnapshotData<OverlapDataT>::write(w, overlaps_.adjacency.getNode(overlaps_.pm.getItem(i)).data);
+        }
+        return w.isGood();
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::loadSnapshot(const char* path, fast_vector<Index>* box_ids_out) {
+        // single bulk read
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open())
+            return false;
+        std::streamoff size = file.tellg();
+        if (size < 0)
+            return false;
+        fast_vector<u8> content;
+        content.resize(size_t(size));
+        file.seekg(0);
+        if (size && !file.read((char*)content.data(), size))
+            return false;
+        return loadSnapshot(content.data(), content.size(), box_ids_out);
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::loadSnapshot(const void* data, size_t size, fast_vector<Index>* box_ids_out) {
+        assertNoReads_();
+        SAP::SnapshotReader r(data, size);
+        char magic[sizeof(SAP::SNAPSHOT_MAGIC)];
+        u32 version, axes_count, max_occurences, box_data_size, overlap_data_size, boxes_count, segments_count, pairs_count;
+        f32 fat_margin;
+        u8 has_fat_boxes, report_fat_overlaps;
+        if (!r.read(magic, sizeof(magic)) || memcmp(magic, SAP::SNAPSHOT_MAGIC, sizeof(magic)) != 0
+            || !r.read(version) || version != SAP::SNAPSHOT_VERSION
+            || !r.read(axes_count) || axes_count != AXES_COUNT
+            || !r.read(max_occurences) || max_occurences > Policy::MAX_BOX_OCCURENCES
+            || !r.read(box_data_size) || box_data_size != SAP::SnapshotData<BoxDataT>::getSize()
+            || !r.read(overlap_data_size) || overlap_data_size != SAP::SnapshotData<OverlapDataT>::getSize()
+            || !r.read(fat_margin) || !r.read(has_fat_boxes) || !r.read(report_fat_overlaps)
+            || !r.read(boxes_count) || !r.read(segments_count) || !r.read(pairs_count))
+            return false;
+
+        clear();
+        fat_margin_ = fat_margin;
+        has_fat_boxes_ = (has_fat_boxes != 0);
+        report_fat_overlaps_ = (report_fat_overlaps != 0);
+        if (!readSnapshot_(r, boxes_count, segments_count, pairs_count, box_ids_out)) {
+            clear();
+            return false;
+        }
+        if (trace_)
+            recordState_();
+
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
+        return true;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::recordState_() {
+        trace_->writeSetFatMargin(fat_margin_);
+        trace_->writeSetReportFatOverlaps(report_fat_overlaps_);
+        // awake boxes with single bulk add (as when replay manager is empty)
+        fast_vector<Index> ids;
+        fast_vector<f32> bounds;
+        fast_vector<SAP::CollisionFilter> filters;
+        for (u32 box_pos=0; box_pos<boxes_.size(); ++box_pos) {
+            Box& b = boxes_.accItemAtPos2(box_pos);
+            Index box_id = boxes_.getIndexForPos(box_pos);
+            if (b.isSleeping()) {
+                trace_->writeAdd(SAP::toAddStatic, box_id.getIndex(), b.tight_bounds_, filters_[box_id.getIndex()]);
+                continue;
+            }
+            ids.push_back(box_id);
+            bounds.insert(bounds.end(), b.tight_bounds_, b.tight_bounds_+2*AXES_COUNT);
+            filters.push_back(filters_[box_id.getIndex()]);
+        }
+        if (!ids.empty())
+            trace_->writeAddBoxes(ids.data(), bounds.data(), filters.data(), u32(ids.size()));
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::readSnapshot_(SAP::SnapshotReader& r, u32 boxes_count, u32 segments_count, u32 pairs_count, fast_vector<Index>* box_ids_out) {
+        fast_vector<u32> box_ids_map;       // saved inner id -> inner id
+        fast_vector<u32> loaded_ids;        // inner ids in order of loading
+        fast_vector<u32> occurences_segs;   // segment positions of loaded boxes' occurences
+        loaded_ids.reserve(boxes_count);
+        for (u32 i=0; i<boxes_count; ++i) {
+            u32 saved_id, occurences_count;
+            u8 sleeping;
+            Index box_id;
+            Box& b = boxes_.add2(box_id);
+            if (!r.read(saved_id) || saved_id >= (1u<<31)
+                || !r.read(b.bounds_, sizeof(b.bounds_)) || !r.read(b.tight_bounds_, sizeof(b.tight_bounds_))
+                || !r.read(sleeping) || !r.read(occurences_count) || occurences_count > Policy::MAX_BOX_OCCURENCES)
+                return false;
+            if (saved_id >= box_ids_map.size())
+                box_ids_map.resize(saved_id+1, u32(InvalidId()));
+            if (box_ids_map[saved_id] != InvalidId())
+                return false;
+            box_ids_map[saved_id] = box_id.getIndex();
+            loaded_ids.push_back(box_id.getIndex());
+
+            b.sleeping_ = (sleeping != 0);
+            if (b.sleeping_)
+                ++sleeping_boxes_count_;
+            b.occurences_count_ = occurences_count;
+            for (u32 j=0; j<occurences_count; ++j) {
+                u32 seg_pos;
+                if (!r.read(seg_pos) || seg_pos >= segments_count)
+                    return false;
+                occurences_segs.push_back(seg_pos);
+            }
+            SAP::CollisionFilter filter;
+            if (!r.read(filter) || !SAP::SnapshotData<BoxDataT>::read(r, b.client_data_))
+                return false;
+            setFilter_(box_id.getIndex(), filter);
+        }
+
+        // pre-order, children are created as records of split segments are read
+        fast_vector<Segment*> segs;
+        segs.reserve(segments_count);
+        fast_vector<Segment*> stack{root_};
+        while (!stack.empty()) {
+            Segment* s = stack.back();
+            stack.pop_back();
+            if (segs.size() == segments_count || !s->readSnapshot_(r, box_ids_map))
+                return false;
+            segs.push_back(s);
+            if (s->maintenance_queued_) {
+                ++queued_maintenance_count_;
+                maintenance_queue_.push_back(s);
+            }
+            if (s->isSplit()) {
+                for (u32 c=0; c<2; ++c) {
+                    s->children_[c] = newSegment_(s);
+                    s->children_[c]->setDebugName_();
+                }
+                stack.push_back(s->children_[1]);
+                stack.push_back(s->children_[0]);
+            }
+        }
+        if (segs.size() != segments_count)
+            return false;
+        root_->calcBordersRec_();
+
+        u32 occ_pos = 0;
+        for (u32 i=0; i<loaded_ids.size(); ++i) {
+            Box& b = boxes_.accItemWithInnerIndex(loaded_ids[i]);
+            for (u32 j=0; j<b.occurences_count_; ++j) {
+                Segment* s = segs[occurences_segs[occ_pos++]];
+                if (s->isSplit())
+                    return false;
+                b.occurences_[j].segment_ = s;
+            }
+        }
+        // endpoint ids in occurences are not stored
+        for (u32 i=0; i<segs.size(); ++i) {
+            if (!segs[i]->isSplit())
+                segs[i]->refreshEndPointIds_();
+        }
+
+        for (u32 i=0; i<pairs_count; ++i) {
+            u32 saved_ids[2], ids[2];
+            if (!r.read(saved_ids[0]) || !r.read(saved_ids[1]))
+                return false;
+            for (u32 j=0; j<2; ++j) {
+                if (saved_ids[j] >= box_ids_map.size() || box_ids_map[saved_ids[j]] == InvalidId())
+                    return false;
+                ids[j] = box_ids_map[saved_ids[j]];
+            }
+            bool was_added;
+            u32* node_id = overlaps_.pm.findOrAddItem(SAP::CollPair(ids[0], ids[1]), was_added);
+            if (!was_added || ids[0] == ids[1])
+                return false;
+            *node_id = overlaps_.adjacency.addPair(ids[0], ids[1]);
+            if (!SAP::SnapshotData<OverlapDataT>::read(r, overlaps_.adjacency.accNode(*node_id).data))
+                return false;
+        }
+        findFatPairs_();
+
+        if (box_ids_out) {
+            box_ids_out->clear();
+            box_ids_out->resize(box_ids_map.size());
+            for (u32 i=0; i<box_ids_map.size(); ++i) {
+                if (box_ids_map[i] != InvalidId())
+                    (*box_ids_out)[i] = boxes_.getFullIndex(box_ids_map[i]);
+            }
+        }
+        return true;
+    }
+
     SMB_TPL
     inline void SMB_TYPE::calcBounds(f32* bounds) {
         ASSERT(getBoxesCount());
@@ -164,27 +742,46 @@ namespace grynca {
     }
 
     SMB_TPL
-    inline u32 SMB_TYPE::getGroupId(u32 box_id)const {
-        return boxes_.getItem(box_id).getCollisionGroup();
+    inline const SAP::CollisionFilter& SMB_TYPE::getCollisionFilter(Index box_id)const {
+        ASSERT(boxes_.isValidIndex(box_id));
+        return filters_[box_id.getIndex()];
     }
 
     SMB_TPL
     inline bool SMB_TYPE::boxesOverlap_(Box& b1, Box& b2) {
+        SAP_STAT(++overlaps_.stats_.overlap_tests);
+        const f32* bounds1 = report_fat_overlaps_?b1.getFatBounds():b1.getBounds();
+        const f32* bounds2 = report_fat_overlaps_?b2.getFatBounds():b2.getBounds();
         for (u32 a=0; a<AXES_COUNT; ++a) {
-            u32 axis = u32(a);
+            if (GET_MIN(bounds2, a) > GET_MAX(bounds1, a))
+                return false;
+            if (GET_MAX(bounds2, a) < GET_MIN(bounds1, a))
+                return false;
+        }
+        SAP_STAT(++overlaps_.stats_.overlap_hits);
+        return true;
+    }
 
-            f32 b2_min = b2.getMinValue(axis);
-            f32 b1_max = b1.getMaxValue(axis);
-            if (b2_min > b1_max)
+    SMB_TPL
+    inline bool SMB_TYPE::keptPairOverlaps_(Box& b1, Box& b2) {
+        if (!keepsFatPairs_())
+            return boxesOverlap_(b1, b2);
+        const f32* bounds1 = b1.getFatBounds();
+        const f32* bounds2 = b2.getFatBounds();
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            if (GET_MIN(bounds2, a) > GET_MAX(bounds1, a))
                 return false;
-            f32 b1_min = b1.getMinValue(axis);
-            f32 b2_max = b2.getMaxValue(axis);
-            if (b2_max < b1_min)
+            if (GET_MAX(bounds2, a) < GET_MIN(bounds1, a))
                 return false;
         }
         return true;
     }
 
+    SMB_TPL
+    inline bool SMB_TYPE::keepsFatPairs_()const {
+        return has_fat_boxes_ && !report_fat_overlaps_;
+    }
+
     SMB_TPL
     inline std::string SMB_TYPE::debugPrint() {
         u32 boxes_cnt = boxes_.size();
@@ -387,9 +984,21 @@ namespace grynca {
 
     SMB_TPL
     inline void SMB_TYPE::clear() {
+        assertNoReads_();
+        if (trace_)
+            trace_->writeOp(SAP::toClear);
         delete root_;
         boxes_.clear();
+        filters_.clear();
+        has_fat_boxes_ = fat_margin_ > 0.0f;
+        sleeping_boxes_count_ = 0;
         overlaps_.pm.clear();
+        overlaps_.adjacency.clear();
+        overlaps_.fat_pm.clear();
+        overlaps_.fat_adjacency.clear();
+        overlap_events_.clear();
+        maintenance_queue_.clear();
+        queued_maintenance_count_ = 0;
         root_ = new Segment(*this, NULL);
         root_->setDebugName_();
         root_->calcBorders_();
@@ -397,20 +1006,28 @@ namespace grynca {
 
     SMB_TPL
     template <typename Derived>
-    inline typename SMB_TYPE::Box& SMB_TYPE::addBoxInner_(Index& box_id_out, f32* bounds, const BoxDataT& box_data) {
+    inline typename SMB_TYPE::Box& SMB_TYPE::addBoxInner_(Index& box_id_out, const f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter) {
 #ifdef DEBUG_BUILD
         for (u32 a=0; a<AXES_COUNT; ++a) {
             ASSERT(GET_MIN(bounds, a) <= GET_MAX(bounds, a));
         }
 #endif
         Box& new_box  = boxes_.add2(box_id_out);
-        memcpy(new_box.bounds_, bounds, AXES_COUNT*2*sizeof(f32));
+        memcpy(new_box.tight_bounds_, bounds, AXES_COUNT*2*sizeof(f32));
+        fattenBounds_(new_box);
         new_box.setClientData(box_data);
+        setFilter_(box_id_out.getIndex(), filter);
 
 
-        root_->addBoxTree_(bounds, [box_id_out, &new_box] (Segment* seg) {
+        root_->addBoxTree_(new_box.bounds_, [box_id_out, &new_box] (Segment* seg) {
             seg->addBox(new_box, box_id_out);
         });
+        if (sleeping_boxes_count_) {
+            // after splits
+            for (u32 i=0; i<new_box.getOccurencesCount(); ++i) {
+                new_box.getOccurence(i).segment_->findSleepingOverlaps_(new_box, box_id_out.getIndex());
+            }
+        }
 
         addOverlaps_<Derived>(new_box, box_id_out);
         ASSERT(overlaps_.removed_.empty());
@@ -423,57 +1040,137 @@ namespace grynca {
 
     SMB_TPL
     template <typename Derived>
-    inline void SMB_TYPE::updateBoxInner_(Index box_id, f32* bounds) {
+    inline void SMB_TYPE::addBoxesInner_(const f32* bounds, const BoxDataT* boxes_data, u32 boxes_count, Index* box_ids_out, const SAP::CollisionFilter* filters) {
+        if (!boxes_count)
+            return;
+
+        if (getBoxesCount() || root_->isSplit()) {
+            // tree already built, insert incrementally
+            for (u32 i=0; i<boxes_count; ++i) {
+                addBoxInner_<Derived>(box_ids_out[i], &bounds[i*AXES_COUNT*2], boxes_data[i], filters?filters[i]:SAP::CollisionFilter());
+            }
+            return;
+        }
+
+        for (u32 i=0; i<boxes_count; ++i) {
+            const f32* box_bounds = &bounds[i*AXES_COUNT*2];
+#ifdef DEBUG_BUILD
+            for (u32 a=0; a<AXES_COUNT; ++a) {
+                ASSERT(GET_MIN(box_bounds, a) <= GET_MAX(box_bounds, a));
+            }
+#endif
+            Box& new_box = boxes_.add2(box_ids_out[i]);
+            memcpy(new_box.tight_bounds_, box_bounds, AXES_COUNT*2*sizeof(f32));
+            fattenBounds_(new_box);
+            new_box.setClientData(boxes_data[i]);
+            setFilter_(box_ids_out[i].getIndex(), filters?filters[i]:SAP::CollisionFilter());
+        }
+
+        ASSERT(!root_->isSplit());
+        root_->bulkLoad_(box_ids_out, boxes_count);
+        findAllOverlaps_<Derived>();
+
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline typename SMB_TYPE::Box& SMB_TYPE::addStaticBoxInner_(Index& box_id_out, const f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter) {
 #ifdef DEBUG_BUILD
         for (u32 a=0; a<AXES_COUNT; ++a) {
             ASSERT(GET_MIN(bounds, a) <= GET_MAX(bounds, a));
         }
 #endif
-        Box& b = boxes_.accItem(box_id);
-        memcpy(b.bounds_, bounds, AXES_COUNT*2*sizeof(f32));
+        Box& new_box  = boxes_.add2(box_id_out);
+        memcpy(new_box.tight_bounds_, bounds, AXES_COUNT*2*sizeof(f32));
+        fattenBounds_(new_box);
+        new_box.setClientData(box_data);
+        setFilter_(box_id_out.getIndex(), filter);
+        new_box.sleeping_ = true;
+        ++sleeping_boxes_count_;
+
+        u32 inner_id = box_id_out.getIndex();
+        root_->addBoxTree_(new_box.bounds_, [inner_id, &new_box] (Segment* seg) {
+            seg->addSleepingBox_(new_box, inner_id);
+            seg->findAwakeOverlaps_(new_box, inner_id);
+            // sleeping boxes count in split criteria too
+            seg->splitIfNeeded_();
+        });
 
-        for (u32 i=0; i<b.getOccurencesCount(); ++i) {
-            bool oos = b.getOccurence(i).segment_->updateBox(b, box_id, b.getOccurence(i).min_max_ids_, deferred_after_update_);
-            if (oos)
-                --i;
-        }
+        addOverlaps_<Derived>(new_box, box_id_out);
 
-        afterUpdate_<Derived>(b, box_id, bounds);
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
+        return new_box;
     }
 
     SMB_TPL
     template <typename Derived>
-    inline void SMB_TYPE::moveBoxInner_(Index box_id, f32* move_vec) {
+    inline void SMB_TYPE::sleepBoxInner_(Index box_id) {
         Box& b = boxes_.accItem(box_id);
+        if (b.sleeping_)
+            return;
+#ifdef SAP_LAZY_ENDPOINT_IDS
+        resolveEndPointIds_(b, box_id);
+#endif
+        // pairs with awake boxes are kept
+        u32 inner_id = box_id.getIndex();
+        forEachKeptPairOf_(inner_id, [this](u32 other_id) {
+            if (boxes_.accItemWithInnerIndex(other_id).sleeping_)
+                overlaps_.removed_.push_back(other_id);
+        });
+        removeOverlaps_<Derived>(b, box_id);
 
-        for (u32 a=0; a<AXES_COUNT; ++a) {
-            GET_MIN(b.bounds_, a) += move_vec[a];
-            GET_MAX(b.bounds_, a) += move_vec[a];
+        // occurences get reordered while moving points
+        Segment* segs[Policy::MAX_BOX_OCCURENCES];
+        u32 segs_count = b.getOccurencesCount();
+        for (u32 i=0; i<segs_count; ++i) {
+            segs[i] = b.getOccurence(i).segment_;
+        }
+        b.sleeping_ = true;
+        ++sleeping_boxes_count_;
+        for (u32 i=0; i<segs_count; ++i) {
+            u32 occ_id = b.findOccurence(segs[i]);
+            segs[i]->removeOutOfSegmentBox_(b, box_id, b.getOccurence(occ_id).min_max_ids_, deferred_after_update_);
+            segs[i]->addSleepingBox_(b, inner_id);
         }
 
-        ASSERT(b.getOccurencesCount());
-        for (u32 i=0; i<b.getOccurencesCount(); ++i) {
-            bool oos = b.getOccurence(i).segment_->moveBox(b, box_id, b.getOccurence(i).min_max_ids_, move_vec, deferred_after_update_);
-            if (oos)
-                --i;
+        if (!deferred_after_update_.merges_.empty()) {
+            doMerges_();
         }
-        afterUpdate_<Derived>(b, box_id, b.getBounds());
+
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
     }
 
     SMB_TPL
     template <typename Derived>
-    inline void SMB_TYPE::removeBoxInner_(Index box_id) {
+    inline void SMB_TYPE::wakeBoxInner_(Index box_id) {
         Box& b = boxes_.accItem(box_id);
+        if (!b.sleeping_)
+            return;
 
-        for (i32 i = b.getOccurencesCount()-1; i>=0; --i) {
-            Segment* seg = b.getOccurence(i).segment_;
-            seg->removeBox(b, box_id, b.getOccurence(i).min_max_ids_);
+        Segment* segs[Policy::MAX_BOX_OCCURENCES];
+        u32 segs_count = b.getOccurencesCount();
+        for (u32 i=0; i<segs_count; ++i) {
+            segs[i] = b.getOccurence(i).segment_;
+        }
+        b.sleeping_ = false;
+        --sleeping_boxes_count_;
+        for (u32 i=0; i<segs_count; ++i) {
+            segs[i]->wakeBox_(b, box_id.getIndex());
         }
 
-        removeOverlaps_<Derived>(b, box_id);
-        ASSERT(overlaps_.possibly_added_.empty());
+        // pairs with awake boxes are already known
+        for (u32 i=0; i<b.getOccurencesCount(); ++i) {
+            b.getOccurence(i).segment_->findSleepingOverlaps_(b, box_id.getIndex());
+        }
+        addOverlaps_<Derived>(b, box_id);
 
-        boxes_.removeItem(box_id);
 #ifdef SAP_VALIDATE_ALL_THE_TIME
         validate();
 #endif
@@ -481,43 +1178,418 @@ namespace grynca {
 
     SMB_TPL
     template <typename Derived>
-    inline void SMB_TYPE::afterUpdate_(Box& box, Index box_id, const f32* bounds) {
-        PROFILE_BLOCK("afterUpdate");
+    inline void SMB_TYPE::setCollisionFilterInner_(Index box_id, const SAP::CollisionFilter& filter) {
+        filters_[box_id.getIndex()] = filter;
+        refreshOverlaps_<Derived>(boxes_.accItem(box_id), box_id);
 
-        if (deferred_after_update_.crossing_) {
-            PROFILE_BLOCK("crossing");
-            root_->addBoxTree_(bounds, [&box, box_id, bounds] (Segment* seg) {
-                if (box.findOccurence(seg) == InvalidId()) {
-                    seg->addBox(box, box_id);
-                }
-            });
-            deferred_after_update_.crossing_ = false;
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::updateBoxInner_(Index box_id, f32* bounds) {
+        wakeBoxInner_<Derived>(box_id);
+        Box& b = updateBoxPoints_(box_id, bounds);
+        afterUpdate_<Derived>(b, box_id, b.bounds_);
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::moveBoxInner_(Index box_id, f32* move_vec) {
+        wakeBoxInner_<Derived>(box_id);
+        Box& b = moveBoxPoints_(box_id, move_vec);
+        afterUpdate_<Derived>(b, box_id, b.bounds_);
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::updateBoxesInner_(const Index* box_ids, const f32* bounds, u32 boxes_count) {
+        PROFILE_BLOCK("updateBoxes");
+
+        if (sleeping_boxes_count_) {
+            for (u32 i=0; i<boxes_count; ++i) {
+                wakeBoxInner_<Derived>(box_ids[i]);
+            }
         }
 
-        if (!deferred_after_update_.merges_.empty()) {
-            PROFILE_BLOCK("merging");
-            for (u32 i=0; i<deferred_after_update_.merges_.size(); ++i) {
-                Segment* s = deferred_after_update_.merges_[i];
-                // merge will destroy this and neighboring segment -> remove neighboring segment from looped occurences if it is also scheduled for merge
-                Segment* sn = s->getSplitNeighbor();
-                for (u32 j=i+1; j<deferred_after_update_.merges_.size(); ++j) {
-                    if (deferred_after_update_.merges_[j] == sn) {
-                        deferred_after_update_.merges_[j] = deferred_after_update_.merges_.back();
-                        deferred_after_update_.merges_.pop_back();
+        if (workers_) {
+            updateBoxesParallel_<Derived>(box_ids, bounds, boxes_count, false);
+            return;
+        }
+
+        for (u32 i=0; i<boxes_count; ++i) {
+            updateBoxPoints_(box_ids[i], &bounds[i*AXES_COUNT*2]);
+            deferBatchUpdate_(box_ids[i]);
+        }
+        afterBatchUpdate_<Derived>();
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::moveBoxesInner_(const Index* box_ids, const f32* move_vecs, u32 boxes_count) {
+        PROFILE_BLOCK("moveBoxes");
+
+        if (sleeping_boxes_count_) {
+            for (u32 i=0; i<boxes_count; ++i) {
+                wakeBoxInner_<Derived>(box_ids[i]);
+            }
+        }
+
+        if (workers_) {
+            updateBoxesParallel_<Derived>(box_ids, move_vecs, boxes_count, true);
+            return;
+        }
+
+        for (u32 i=0; i<boxes_count; ++i) {
+            moveBoxPoints_(box_ids[i], &move_vecs[i*AXES_COUNT]);
+            deferBatchUpdate_(box_ids[i]);
+        }
+        afterBatchUpdate_<Derived>();
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::updateBoxesParallel_(const Index* box_ids, const f32* bounds_or_move_vecs, u32 boxes_count, bool is_move) {
+        typedef typename ParallelBatch::LeafTask LeafTask;
+        typedef typename ParallelBatch::BoxTask BoxTask;
+        typedef typename ParallelBatch::WorkerScratch WorkerScratch;
+
+        ParallelBatch& pb = parallel_batch_;
+        const u32 vec_size = is_move?AXES_COUNT:AXES_COUNT*2;
+
+        // fat bounds are recentered around tight ones -> points are updated instead of moved
+        const bool move_points = is_move && fat_margin_ == 0.0f;
+
+        // set new bounds & group box occurences by leafs (leafs in order of first occurence -> deterministic)
+        for (u32 i=0; i<boxes_count; ++i) {
+            Box& b = boxes_.accItem(box_ids[i]);
+            const f32* v = &bounds_or_move_vecs[i*vec_size];
+#ifdef SAP_LAZY_ENDPOINT_IDS
+            // ids are resolved by workers right before moving box (after previous moves in its leaf)
+            pb.old_bounds.insert(pb.old_bounds.end(), b.bounds_, b.bounds_+AXES_COUNT*2);
+#endif
+            if (is_move) {
+                for (u32 a=0; a<AXES_COUNT; ++a) {
+                    GET_MIN(b.tight_bounds_, a) += v[a];
+                    GET_MAX(b.tight_bounds_, a) += v[a];
+                }
+            }
+            else {
+#ifdef DEBUG_BUILD
+                for (u32 a=0; a<AXES_COUNT; ++a) {
+                    ASSERT(GET_MIN(v, a) <= GET_MAX(v, a));
+                }
+#endif
+                memcpy(b.tight_bounds_, v, AXES_COUNT*2*sizeof(f32));
+            }
+
+            if (move_points) {
+                for (u32 a=0; a<AXES_COUNT; ++a) {
+                    GET_MIN(b.bounds_, a) += v[a];
+                    GET_MAX(b.bounds_, a) += v[a];
+                }
+            }
+            else if (fitsFatBounds_(b)) {
+                continue;
+            }
+            else {
+                fattenBounds_(b);
+            }
+            pb.updated.push_back(i);
+
+            ASSERT(b.getOccurencesCount());
+            for (u32 j=0; j<b.getOccurencesCount(); ++j) {
+                Segment* seg = b.getOccurence(j).segment_;
+                if (seg->batch_leaf_id_ == InvalidId()) {
+                    seg->batch_leaf_id_ = pb.leaves.size();
+                    pb.leaves.push_back(LeafTask{seg, 0, 0});
+                }
+                ++pb.leaves[seg->batch_leaf_id_].count;
+            }
+        }
+
+        u32 tasks_count = 0;
+        for (u32 i=0; i<pb.leaves.size(); ++i) {
+            pb.leaves[i].first = tasks_count;
+            tasks_count += pb.leaves[i].count;
+            pb.leaves[i].count = 0;
+        }
+        pb.tasks.resize(tasks_count);
+        pb.task_leaves.resize(tasks_count);
+
+        for (u32 i=0; i<pb.updated.size(); ++i) {
+            u32 batch_id = pb.updated[i];
+            Box& b = boxes_.accItem(box_ids[batch_id]);
+            for (u32 j=0; j<b.getOccurencesCount(); ++j) {
+                u32 leaf_id = b.getOccurence(j).segment_->batch_leaf_id_;
+                LeafTask& lt = pb.leaves[leaf_id];
+                u32 task_id = lt.first + lt.count++;
+                pb.tasks[task_id] = BoxTask{batch_id, &b, b.getOccurence(j).min_max_ids_};
+                pb.task_leaves[task_id] = leaf_id;
+            }
+        }
+        pb.updated.clear();
+
+        {
+            PROFILE_BLOCK("parallel points update");
+            // boxes' occurences are not added/removed here so each worker can modify its leafs independently
+            std::atomic<u32> next_leaf(0);
+            workers_->run([&](u32 worker_id) {
+                WorkerScratch& ws = pb.workers[worker_id];
+                for (;;) {
+                    u32 leaf_id = next_leaf.fetch_add(1, std::memory_order_relaxed);
+                    if (leaf_id >= pb.leaves.size())
                         break;
+
+                    const LeafTask& lt = pb.leaves[leaf_id];
+                    for (u32 t=lt.first; t<lt.first+lt.count; ++t) {
+                        const BoxTask& bt = pb.tasks[t];
+                        Index box_id = box_ids[bt.batch_id];
+                        bool crossing = false;
+                        bool oos;
+#ifdef SAP_LAZY_ENDPOINT_IDS
+                        lt.seg->resolveEndPointIds_(&pb.old_bounds[bt.batch_id*AXES_COUNT*2], box_id.getIndex(), bt.min_max_ids);
+#endif
+                        if (move_points)
+                            oos = lt.seg->moveBoxPoints_(*bt.box, box_id, bt.min_max_ids, &bounds_or_move_vecs[bt.batch_id*vec_size], ws.cands, crossing);
+                        else
+                            oos = lt.seg->updateBoxPoints_(*bt.box, box_id, bt.min_max_ids, ws.cands, crossing);
+
+                        u32 box_inner_id = box_id.getIndex();
+                        for (u32 i=0; i<ws.cands.possibly_added_.size(); ++i) {
+                            ws.pairs.push_back(SAP::CollPair(box_inner_id, ws.cands.possibly_added_[i]));
+                        }
+                        for (u32 i=0; i<ws.cands.removed_.size(); ++i) {
+                            ws.pairs.push_back(SAP::CollPair(box_inner_id, ws.cands.removed_[i]));
+                        }
+                        ws.cands.possibly_added_.clear();
+                        ws.cands.removed_.clear();
+
+                        if (crossing)
+                            ws.crossed.push_back(bt.batch_id);
+                        if (oos)
+                            ws.oos_tasks.push_back(t);
                     }
                 }
+            });
+        }
 
-                s->parent_->merge_(s);
+        // gather workers results in deterministic order
+        fast_vector<u32>& oos_tasks = pb.workers[0].oos_tasks;
+        fast_vector<u32>& crossed = pb.workers[0].crossed;
+        for (u32 w=0; w<pb.workers.size(); ++w) {
+            WorkerScratch& ws = pb.workers[w];
+            overlaps_.candidate_pairs_.insert(overlaps_.candidate_pairs_.end(), ws.pairs.begin(), ws.pairs.end());
+            ws.pairs.clear();
+#ifndef SAP_NO_STATS
+            overlaps_.stats_.add(ws.cands.stats_);
+            ws.cands.stats_.reset();
+#endif
+            if (w) {
+                oos_tasks.insert(oos_tasks.end(), ws.oos_tasks.begin(), ws.oos_tasks.end());
+                crossed.insert(crossed.end(), ws.crossed.begin(), ws.crossed.end());
+                ws.oos_tasks.clear();
+                ws.crossed.clear();
             }
+        }
+
+        std::sort(oos_tasks.begin(), oos_tasks.end());
+        for (u32 i=0; i<oos_tasks.size(); ++i) {
+            const BoxTask& bt = pb.tasks[oos_tasks[i]];
+            Segment* seg = pb.leaves[pb.task_leaves[oos_tasks[i]]].seg;
+            // occurences may be reordered by previous removals
+            u32 occ_id = bt.box->findOccurence(seg);
+#ifdef SAP_LAZY_ENDPOINT_IDS
+            seg->resolveEndPointIds_(bt.box->bounds_, box_ids[bt.batch_id].getIndex(), bt.box->getOccurence(occ_id).min_max_ids_);
+#endif
+            seg->removeOutOfSegmentBox_(*bt.box, box_ids[bt.batch_id], bt.box->getOccurence(occ_id).min_max_ids_, deferred_after_update_);
+        }
+        oos_tasks.clear();
 
-            deferred_after_update_.merges_.clear();
+        std::sort(crossed.begin(), crossed.end());
+        crossed.erase(std::unique(crossed.begin(), crossed.end()), crossed.end());
+        for (u32 i=0; i<crossed.size(); ++i) {
+            deferred_after_update_.crossed_boxes_.push_back(box_ids[crossed[i]]);
+        }
+        crossed.clear();
+
+        for (u32 i=0; i<pb.leaves.size(); ++i) {
+            pb.leaves[i].seg->batch_leaf_id_ = InvalidId();
+        }
+        pb.leaves.clear();
+        pb.old_bounds.clear();
+
+        if (needsRefresh_()) {
+            deferred_after_update_.refreshed_boxes_.insert(deferred_after_update_.refreshed_boxes_.end(), box_ids, box_ids+boxes_count);
+        }
+
+        afterBatchUpdate_<Derived>();
+    }
+
+    SMB_TPL
+    inline typename SMB_TYPE::Box& SMB_TYPE::updateBoxPoints_(Index box_id, const f32* bounds) {
+#ifdef DEBUG_BUILD
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            ASSERT(GET_MIN(bounds, a) <= GET_MAX(bounds, a));
+        }
+#endif
+        Box& b = boxes_.accItem(box_id);
+        memcpy(b.tight_bounds_, bounds, AXES_COUNT*2*sizeof(f32));
+        if (!fitsFatBounds_(b))
+            refattenBoxPoints_(b, box_id);
+        return b;
+    }
+
+    SMB_TPL
+    inline typename SMB_TYPE::Box& SMB_TYPE::moveBoxPoints_(Index box_id, const f32* move_vec) {
+        Box& b = boxes_.accItem(box_id);
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            GET_MIN(b.tight_bounds_, a) += move_vec[a];
+            GET_MAX(b.tight_bounds_, a) += move_vec[a];
+        }
+
+        if (fat_margin_ > 0.0f) {
+            // fat bounds are recentered around tight ones -> not a plain move
+            if (!fitsFatBounds_(b))
+                refattenBoxPoints_(b, box_id);
+            return b;
+        }
+
+#ifdef SAP_LAZY_ENDPOINT_IDS
+        resolveEndPointIds_(b, box_id);
+#endif
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            GET_MIN(b.bounds_, a) += move_vec[a];
+            GET_MAX(b.bounds_, a) += move_vec[a];
+        }
+
+        ASSERT(b.getOccurencesCount());
+        for (u32 i=0; i<b.getOccurencesCount(); ++i) {
+            bool oos = b.getOccurence(i).segment_->moveBox(b, box_id, b.getOccurence(i).min_max_ids_, move_vec, deferred_after_update_);
+            if (oos)
+                --i;
+        }
+        return b;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::refattenBoxPoints_(Box& box, Index box_id) {
+#ifdef SAP_LAZY_ENDPOINT_IDS
+        resolveEndPointIds_(box, box_id);
+#endif
+        fattenBounds_(box);
+
+        for (u32 i=0; i<box.getOccurencesCount(); ++i) {
+            bool oos = box.getOccurence(i).segment_->updateBox(box, box_id, box.getOccurence(i).min_max_ids_, deferred_after_update_);
+            if (oos)
+                --i;
+        }
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::fitsFatBounds_(Box& box)const {
+        if (fat_margin_ == 0.0f)
+            return false;
+        // fat bounds must contain tight ones and must not be too loose (e.g. after shrinking update)
+        f32 max_slack = 2*fat_margin_;
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            f32 low_slack = GET_MIN(box.tight_bounds_, a) - GET_MIN(box.bounds_, a);
+            f32 high_slack = GET_MAX(box.bounds_, a) - GET_MAX(box.tight_bounds_, a);
+            if (low_slack < 0.0f || high_slack < 0.0f || low_slack > max_slack || high_slack > max_slack)
+                return false;
+        }
+        return true;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::fattenBounds_(Box& box) {
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            GET_MIN(box.bounds_, a) = GET_MIN(box.tight_bounds_, a) - fat_margin_;
+            GET_MAX(box.bounds_, a) = GET_MAX(box.tight_bounds_, a) + fat_margin_;
+        }
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::resolveEndPointIds_(Box& box, Index box_id) {
+        for (u32 i=0; i<box.getOccurencesCount(); ++i) {
+            box.getOccurence(i).segment_->resolveEndPointIds_(box.bounds_, box_id.getIndex(), box.getOccurence(i).min_max_ids_);
+        }
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::removeBoxInner_(Index box_id) {
+        Box& b = boxes_.accItem(box_id);
+        forEachKeptPairOf_(box_id.getIndex(), [this](u32 other_id) {
+            overlaps_.removed_.push_back(other_id);
+        });
+
+        if (b.sleeping_) {
+            for (i32 i = b.getOccurencesCount()-1; i>=0; --i) {
+                Segment* seg = b.getOccurence(i).segment_;
+                seg->removeSleepingBox_(b, box_id.getIndex());
+                // sleeping boxes count in merge criteria too
+                if (seg->needsMerge_()) {
+                    if (deferred_maintenance_)
+                        scheduleMaintenance_(seg);
+                    else
+                        deferred_after_update_.scheduleMerge(seg);
+                }
+            }
+            --sleeping_boxes_count_;
+            if (!deferred_after_update_.merges_.empty()) {
+                doMerges_();
+            }
+        }
+#ifdef SAP_LAZY_ENDPOINT_IDS
+        else {
+            resolveEndPointIds_(b, box_id);
+        }
+#endif
+
+        for (i32 i = b.getOccurencesCount()-1; i>=0; --i) {
+            Segment* seg = b.getOccurence(i).segment_;
+#ifdef SAP_LAZY_ENDPOINT_IDS
+            // merge after previous removal could shift points
+            seg->resolveEndPointIds_(b.bounds_, box_id.getIndex(), b.getOccurence(i).min_max_ids_);
+#endif
+            seg->removeBox(b, box_id, b.getOccurence(i).min_max_ids_);
+        }
+
+        removeOverlaps_<Derived>(b, box_id);
+        ASSERT(overlaps_.possibly_added_.empty());
+
+        boxes_.removeItem(box_id);
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::afterUpdate_(Box& box, Index box_id, const f32* bounds) {
+        PROFILE_BLOCK("afterUpdate");
+
+        if (deferred_after_update_.crossing_) {
+            PROFILE_BLOCK("crossing");
+            addCrossingBox_(box, box_id, bounds);
+            deferred_after_update_.crossing_ = false;
+        }
+
+        if (!deferred_after_update_.merges_.empty()) {
+            PROFILE_BLOCK("merging");
+            doMerges_();
         }
 
         {
             PROFILE_BLOCK("Overlaps add/remove");
             removeOverlaps_<Derived>(box, box_id);
             addOverlaps_<Derived>(box, box_id);
+            if (needsRefresh_()) {
+                refreshUpdatedBox_<Derived>(box, box_id);
+            }
         }
 
 #ifdef SAP_VALIDATE_ALL_THE_TIME
@@ -525,6 +1597,247 @@ namespace grynca {
 #endif
     }
 
+    SMB_TPL
+    inline void SMB_TYPE::deferBatchUpdate_(Index box_id) {
+        u32 box_inner_id = box_id.getIndex();
+        for (u32 i=0; i<overlaps_.possibly_added_.size(); ++i) {
+            overlaps_.candidate_pairs_.push_back(SAP::CollPair(box_inner_id, overlaps_.possibly_added_[i]));
+        }
+        for (u32 i=0; i<overlaps_.removed_.size(); ++i) {
+            overlaps_.candidate_pairs_.push_back(SAP::CollPair(box_inner_id, overlaps_.removed_[i]));
+        }
+        overlaps_.possibly_added_.clear();
+        overlaps_.removed_.clear();
+
+        if (deferred_after_update_.crossing_) {
+            deferred_after_update_.crossed_boxes_.push_back(box_id);
+            deferred_after_update_.crossing_ = false;
+        }
+        if (needsRefresh_()) {
+            deferred_after_update_.refreshed_boxes_.push_back(box_id);
+        }
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::afterBatchUpdate_() {
+        PROFILE_BLOCK("afterBatchUpdate");
+
+        if (!deferred_after_update_.crossed_boxes_.empty()) {
+            PROFILE_BLOCK("crossing");
+            fast_vector<Index>& crossed = deferred_after_update_.crossed_boxes_;
+            for (u32 i=0; i<crossed.size(); ++i) {
+                Box& b = boxes_.accItem(crossed[i]);
+                addCrossingBox_(b, crossed[i], b.bounds_);
+                deferBatchUpdate_(crossed[i]);
+
+                // crossed box was not yet in its new segments when other boxes were moving there,
+                // so their separation could not be detected -> retest all its current pairs
+                u32 inner_id = crossed[i].getIndex();
+                forEachKeptPairOf_(inner_id, [this, inner_id](u32 other_id) {
+                    overlaps_.candidate_pairs_.push_back(SAP::CollPair(inner_id, other_id));
+                });
+            }
+            crossed.clear();
+        }
+
+        if (!deferred_after_update_.merges_.empty()) {
+            PROFILE_BLOCK("merging");
+            doMerges_();
+        }
+
+        {
+            PROFILE_BLOCK("Overlaps reconcile");
+            reconcileCandidatePairs_<Derived>();
+
+            fast_vector<Index>& refreshed = deferred_after_update_.refreshed_boxes_;
+            for (u32 i=0; i<refreshed.size(); ++i) {
+                refreshUpdatedBox_<Derived>(boxes_.accItem(refreshed[i]), refreshed[i]);
+            }
+            refreshed.clear();
+        }
+
+#ifdef SAP_VALIDATE_ALL_THE_TIME
+        validate();
+#endif
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::addCrossingBox_(Box& box, Index box_id, const f32* bounds) {
+        SAP_STAT(++overlaps_.stats_.crossings);
+        root_->addBoxTree_(bounds, [&box, box_id] (Segment* seg) {
+            if (box.findOccurence(seg) == InvalidId()) {
+                seg->addBox(box, box_id);
+            }
+        });
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::doMerges_() {
+        fast_vector<Segment*>& merges = deferred_after_update_.merges_;
+        for (u32 i=0; i<merges.size(); ++i) {
+            Segment* s = merges[i];
+            // could get split or filled by crossing boxes since it was scheduled
+            if (!s->needsMerge_())
+                continue;
+
+            // merge will destroy this and neighboring segment -> remove neighboring segment from looped occurences if it is also scheduled for merge
+            Segment* sn = s->getSplitNeighbor();
+            for (u32 j=i+1; j<merges.size(); ++j) {
+                if (merges[j] == sn) {
+                    merges[j] = merges.back();
+                    merges.pop_back();
+                    break;
+                }
+            }
+
+            s->parent_->merge_(s);
+        }
+
+        merges.clear();
+    }
+
+    SMB_TPL
+    inline typename SMB_TYPE::Segment* SMB_TYPE::newSegment_(Segment* parent) {
+        if (free_segments_.empty())
+            return new Segment(*this, parent);
+
+        Segment* s = free_segments_.back();
+        free_segments_.pop_back();
+        s->reset_(parent);
+        return s;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::freeSegment_(Segment* s) {
+        ASSERT(!s->children_[0] && !s->children_[1]);
+        if (s->maintenance_queued_)
+            --queued_maintenance_count_;
+        s->reset_(NULL);
+        free_segments_.push_back(s);
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::scheduleMaintenance_(Segment* s) {
+        if (s->maintenance_queued_)
+            return;
+        s->maintenance_queued_ = true;
+        ++queued_maintenance_count_;
+        maintenance_queue_.push_back(s);
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::addOverlap_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id) {
+        SAP::CollPair cp(b1_inner_id, b2_inner_id);
+        if (overlaps_.pm.findItem(cp) || !getAs_<Derived>().beforeBoxesOverlap_(b1, b2))
+            return;
+
+        bool was_added;
+        u32* node_id = overlaps_.pm.findOrAddItem(cp, was_added);
+        *node_id = overlaps_.adjacency.addPair(b1_inner_id, b2_inner_id);
+        SAP_STAT(++overlaps_.stats_.pairs_added);
+        if (overlap_events_.enabled_) {
+            overlap_events_.record(boxes_.getFullIndex(b1_inner_id), boxes_.getFullIndex(b2_inner_id), true);
+        }
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::removeOverlap_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id) {
+        SAP::CollPair cp(b1_inner_id, b2_inner_id);
+        u32* node_id = overlaps_.pm.findItem(cp);
+        if (!node_id)
+            return;
+        // hook can still read pair's data (getOverlapWithData(), findOverlap())
+        getAs_<Derived>().afterBoxesOverlap_(b1, b2);
+        if (overlap_events_.enabled_) {
+            overlap_events_.record(boxes_.getFullIndex(b1_inner_id), boxes_.getFullIndex(b2_inner_id), false);
+        }
+        SAP_STAT(++overlaps_.stats_.pairs_removed);
+        overlaps_.adjacency.removePair(*node_id);
+        overlaps_.pm.removeItem(cp, [](){});
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::addPair_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id) {
+        if (keepsFatPairs_()) {
+            addFatPair_(b1_inner_id, b2_inner_id);
+            if (!boxesOverlap_(b1, b2))
+                return;
+        }
+        addOverlap_<Derived>(b1, b2, b1_inner_id, b2_inner_id);
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::removePair_(Box& b1, Box& b2, u32 b1_inner_id, u32 b2_inner_id) {
+        removeOverlap_<Derived>(b1, b2, b1_inner_id, b2_inner_id);
+        if (!keepsFatPairs_())
+            return;
+        SAP::CollPair cp(b1_inner_id, b2_inner_id);
+        u32* node_id = overlaps_.fat_pm.findItem(cp);
+        if (!node_id)
+            return;
+        overlaps_.fat_adjacency.removePair(*node_id);
+        overlaps_.fat_pm.removeItem(cp, [](){});
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::addFatPair_(u32 b1_inner_id, u32 b2_inner_id) {
+        bool was_added;
+        u32* node_id = overlaps_.fat_pm.findOrAddItem(SAP::CollPair(b1_inner_id, b2_inner_id), was_added);
+        if (was_added)
+            *node_id = overlaps_.fat_adjacency.addPair(b1_inner_id, b2_inner_id);
+    }
+
+    SMB_TPL
+    template <typename Cb>
+    inline void SMB_TYPE::forEachKeptPairOf_(u32 box_inner_id, const Cb& cb)const {
+        if (keepsFatPairs_()) {
+            const SAP::Adjacency<u8>& adj = overlaps_.fat_adjacency;
+            for (u32 n=adj.getFirst(box_inner_id); n!=InvalidId(); n=adj.getNext(n, box_inner_id)) {
+                cb(adj.getOther(n, box_inner_id));
+            }
+            return;
+        }
+        const SAP::Adjacency<OverlapDataT>& adj = overlaps_.adjacency;
+        for (u32 n=adj.getFirst(box_inner_id); n!=InvalidId(); n=adj.getNext(n, box_inner_id)) {
+            cb(adj.getOther(n, box_inner_id));
+        }
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::findFatPairs_() {
+        overlaps_.fat_pm.clear();
+        overlaps_.fat_adjacency.clear();
+        if (!keepsFatPairs_())
+            return;
+
+        // reported pairs are kept, they are subset of found ones
+        sweepLeaves_([this](u32 b1_inner_id, u32 b2_inner_id) {
+            addFatPair_(b1_inner_id, b2_inner_id);
+        });
+        if (!sleeping_boxes_count_)
+            return;
+        fast_vector<u32>& cands = overlaps_.possibly_added_;
+        for (u32 box_pos=0; box_pos<boxes_.size(); ++box_pos) {
+            Box& b = boxes_.accItemAtPos2(box_pos);
+            if (b.sleeping_)
+                continue;
+            u32 inner_id = boxes_.getIndexForPos(box_pos).getIndex();
+            for (u32 i=0; i<b.getOccurencesCount(); ++i) {
+                b.getOccurence(i).segment_->findSleepingOverlaps_(b, inner_id);
+            }
+            for (u32 i=0; i<cands.size(); ++i) {
+                if (keptPairOverlaps_(b, boxes_.accItemWithInnerIndex(cands[i])))
+                    addFatPair_(inner_id, cands[i]);
+            }
+            cands.clear();
+        }
+    }
+
     SMB_TPL
     template <typename Derived>
     inline void SMB_TYPE::addOverlaps_(Box& box, Index box_id) {
@@ -532,12 +1845,8 @@ namespace grynca {
             u32 b2_inner_id = overlaps_.possibly_added_[i];
             ASSERT(b2_inner_id != box_id.getIndex());
             Box& b2 = boxes_.accItemWithInnerIndex(b2_inner_id);
-            if (boxesOverlap_(box, b2) && getAs_<Derived>().beforeBoxesOverlap_(box, b2)) {
-                bool was_added;
-                OverlapDataT* cl_data = overlaps_.pm.findOrAddItem(SAP::CollPair(box_id.getIndex(), b2_inner_id), was_added);
-                if (was_added) {
-                    new (cl_data) OverlapDataT();
-                }
+            if (keptPairOverlaps_(box, b2)) {
+                addPair_<Derived>(box, b2, box_id.getIndex(), b2_inner_id);
             }
         }
         overlaps_.possibly_added_.clear();
@@ -549,14 +1858,190 @@ namespace grynca {
         for (u32 i=0; i<overlaps_.removed_.size(); ++i) {
             u32 b2_inner_id = overlaps_.removed_[i];
             ASSERT(b2_inner_id != box_id.getIndex());
-            overlaps_.pm.removeItem(SAP::CollPair(box_id.getIndex(), b2_inner_id), [&]() {
-                Box& b2 = boxes_.accItemWithInnerIndex(b2_inner_id);
-                getAs_<Derived>().afterBoxesOverlap_(box, b2);
-            });
+            Box& b2 = boxes_.accItemWithInnerIndex(b2_inner_id);
+            removePair_<Derived>(box, b2, box_id.getIndex(), b2_inner_id);
         }
         overlaps_.removed_.clear();
     }
 
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::refreshOverlaps_(Box& box, Index box_id) {
+        u32 inner_id = box_id.getIndex();
+        forEachKeptPairOf_(inner_id, [this, &box, inner_id](u32 other_id) {
+            if (!canCollide_(inner_id, other_id) || !keptPairOverlaps_(box, boxes_.accItemWithInnerIndex(other_id)))
+                overlaps_.removed_.push_back(other_id);
+        });
+        removeOverlaps_<Derived>(box, box_id);
+
+        if (box.sleeping_) {
+            for (u32 i=0; i<box.getOccurencesCount(); ++i) {
+                box.getOccurence(i).segment_->findAwakeOverlaps_(box, inner_id);
+            }
+        }
+        else {
+#ifdef SAP_LAZY_ENDPOINT_IDS
+            resolveEndPointIds_(box, box_id);
+#endif
+            for (u32 i=0; i<box.getOccurencesCount(); ++i) {
+                Segment* seg = box.getOccurence(i).segment_;
+                seg->findOverlapsOnAxis_(box, inner_id, 0);
+                seg->findSleepingOverlaps_(box, inner_id);
+            }
+        }
+        addOverlaps_<Derived>(box, box_id);
+        if (keepsFatPairs_())
+            refreshTightOverlaps_<Derived>(box, box_id);
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::refreshTightOverlaps_(Box& box, Index box_id) {
+        u32 inner_id = box_id.getIndex();
+        const SAP::Adjacency<u8>& adj = overlaps_.fat_adjacency;
+        for (u32 n=adj.getFirst(inner_id); n!=InvalidId(); n=adj.getNext(n, inner_id)) {
+            u32 other_id = adj.getOther(n, inner_id);
+            Box& other = boxes_.accItemWithInnerIndex(other_id);
+            if (boxesOverlap_(box, other))
+                addOverlap_<Derived>(box, other, inner_id, other_id);
+            else
+                removeOverlap_<Derived>(box, other, inner_id, other_id);
+        }
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::refreshSleepingOverlaps_(Box& box, Index box_id) {
+        u32 inner_id = box_id.getIndex();
+        forEachKeptPairOf_(inner_id, [this, &box](u32 other_id) {
+            Box& other = boxes_.accItemWithInnerIndex(other_id);
+            if (other.sleeping_ && !keptPairOverlaps_(box, other))
+                overlaps_.removed_.push_back(other_id);
+        });
+        removeOverlaps_<Derived>(box, box_id);
+
+        for (u32 i=0; i<box.getOccurencesCount(); ++i) {
+            box.getOccurence(i).segment_->findSleepingOverlaps_(box, inner_id);
+        }
+        addOverlaps_<Derived>(box, box_id);
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::refreshUpdatedBox_(Box& box, Index box_id) {
+        if (keepsFatPairs_()) {
+            // tight boxes can start/stop overlapping without any endpoint swap,
+            // but only within fat pairs
+            if (sleeping_boxes_count_)
+                refreshSleepingOverlaps_<Derived>(box, box_id);
+            refreshTightOverlaps_<Derived>(box, box_id);
+            return;
+        }
+        refreshSleepingOverlaps_<Derived>(box, box_id);
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::needsRefresh_()const {
+        return keepsFatPairs_() || sleeping_boxes_count_ != 0;
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::beginRead_()const {
+#ifdef DEBUG_BUILD
+        ++reads_count_;
+#endif
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::endRead_()const {
+#ifdef DEBUG_BUILD
+        --reads_count_;
+#endif
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::assertNoReads_()const {
+#ifdef DEBUG_BUILD
+        ASSERT_M(reads_count_ == 0, "Manager modified during concurrent const query.");
+#endif
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::findAllOverlaps_() {
+        sweepLeaves_([this](u32 b1_inner_id, u32 b2_inner_id) {
+            Box& b1 = boxes_.accItemWithInnerIndex(b1_inner_id);
+            Box& b2 = boxes_.accItemWithInnerIndex(b2_inner_id);
+            addPair_<Derived>(b1, b2, b1_inner_id, b2_inner_id);
+        });
+    }
+
+    SMB_TPL
+    template <typename Cb>
+    inline void SMB_TYPE::sweepLeaves_(const Cb& cb) {
+        // single sweep per leaf instead of searching overlaps for each box separately
+        fast_vector<u32>& active = overlaps_.possibly_added_;
+        fast_vector<Segment*> s{root_};
+        while (!s.empty()) {
+            Segment* seg = s.back();
+            s.pop_back();
+
+            if (seg->isSplit()) {
+                s.push_back(seg->getChild(0));
+                s.push_back(seg->getChild(1));
+                continue;
+            }
+
+            seg->sweepOverlaps_(active, cb);
+        }
+        active.clear();
+    }
+
+    SMB_TPL
+    template <typename Derived>
+    inline void SMB_TYPE::reconcileCandidatePairs_() {
+        fast_vector<SAP::CollPair>& cps = overlaps_.candidate_pairs_;
+        std::sort(cps.begin(), cps.end());
+        cps.erase(std::unique(cps.begin(), cps.end()), cps.end());
+
+        for (u32 i=0; i<cps.size(); ++i) {
+            const SAP::CollPair& cp = cps[i];
+            ASSERT(cp.id1 != cp.id2);
+            Box& b1 = boxes_.accItemWithInnerIndex(cp.id1);
+            Box& b2 = boxes_.accItemWithInnerIndex(cp.id2);
+            if (keptPairOverlaps_(b1, b2)) {
+                addPair_<Derived>(b1, b2, cp.id1, cp.id2);
+            }
+            else {
+                removePair_<Derived>(b1, b2, cp.id1, cp.id2);
+            }
+        }
+        cps.clear();
+    }
+
+    SMB_TPL
+    inline bool SMB_TYPE::canCollide_(u32 b1_inner_id, u32 b2_inner_id)const {
+        return filters_[b1_inner_id].canCollide(filters_[b2_inner_id]);
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::filterCandidates_(u32 box_inner_id, fast_vector<u32>& ids, u32 from)const {
+        const SAP::CollisionFilter& f = filters_[box_inner_id];
+        u32 cnt = from;
+        for (u32 i=from; i<ids.size(); ++i) {
+            if (f.canCollide(filters_[ids[i]]))
+                ids[cnt++] = ids[i];
+        }
+        ids.resize(cnt);
+    }
+
+    SMB_TPL
+    inline void SMB_TYPE::setFilter_(u32 box_inner_id, const SAP::CollisionFilter& filter) {
+        if (box_inner_id >= filters_.size())
+            filters_.resize(box_inner_id+1);
+        filters_[box_inner_id] = filter;
+    }
+
     SMB_TPL
     inline void SMB_TYPE::debugPrintSegmentRec_(const std::string& name, std::vector<bool>& path, Segment* s, std::ostream& os, u32& segs_cnt, u32* splits_count) {
         ++segs_cnt;
@@ -597,27 +2082,105 @@ namespace grynca {
             path.pop_back();
         }
         else {
-            os << ind2 << name << ":" << " Leaf, boxes: " << s->getBoxesCount() << std::endl;
+            os << ind2 << name << ":" << " Leaf, boxes: " << s->getBoxesCount() << ", sleeping: " << s->getSleepingBoxesCount() << std::endl;
         }
     }
 
     SM_TPL
-    inline typename SM_TYPE::Box& SM_TYPE::addBox(Index& box_id_out, f32* bounds, const BoxDataT& box_data) {
-        return this->template addBoxInner_<Derived>(box_id_out, bounds, box_data);
+    inline typename SM_TYPE::Box& SM_TYPE::addBox(Index& box_id_out, f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter) {
+        this->assertNoReads_();
+        Box& box = this->template addBoxInner_<Derived>(box_id_out, bounds, box_data, filter);
+        if (this->trace_)
+            this->trace_->writeAdd(SAP::toAdd, box_id_out.getIndex(), bounds, filter);
+        return box;
+    }
+
+    SM_TPL
+    inline void SM_TYPE::addBoxes(const f32* bounds, const BoxDataT* boxes_data, u32 boxes_count, Index* box_ids_out, const SAP::CollisionFilter* filters) {
+        this->assertNoReads_();
+        this->template addBoxesInner_<Derived>(bounds, boxes_data, boxes_count, box_ids_out, filters);
+        if (this->trace_)
+            this->trace_->writeAddBoxes(box_ids_out, bounds, filters, boxes_count);
+    }
+
+    SM_TPL
+    inline typename SM_TYPE::Box& SM_TYPE::addStaticBox(Index& box_id_out, f32* bounds, const BoxDataT& box_data, const SAP::CollisionFilter& filter) {
+        this->assertNoReads_();
+        Box& box = this->template addStaticBoxInner_<Derived>(box_id_out, bounds, box_data, filter);
+        if (this->trace_)
+            this->trace_->writeAdd(SAP::toAddStatic, box_id_out.getIndex(), bounds, filter);
+        return box;
+    }
+
+    SM_TPL
+    inline void SM_TYPE::sleepBox(Index box_id) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeBoxOp(SAP::toSleep, box_id.getIndex());
+        this->template sleepBoxInner_<Derived>(box_id);
+    }
+
+    SM_TPL
+    inline void SM_TYPE::wakeBox(Index box_id) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeBoxOp(SAP::toWake, box_id.getIndex());
+        this->template wakeBoxInner_<Derived>(box_id);
+    }
+
+    SM_TPL
+    inline void SM_TYPE::setCollisionFilter(Index box_id, const SAP::CollisionFilter& filter) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeSetFilter(box_id.getIndex(), filter);
+        this->template setCollisionFilterInner_<Derived>(box_id, filter);
+    }
+
+    SM_TPL
+    inline void SM_TYPE::setReportFatOverlaps(bool fat) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeSetReportFatOverlaps(fat);
+        this->template setReportFatOverlapsInner_<Derived>(fat);
     }
 
     SM_TPL
     inline void SM_TYPE::updateBox(Index box_id, f32* bounds) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeUpdate(SAP::toUpdate, box_id.getIndex(), bounds);
         this->template updateBoxInner_<Derived>(box_id, bounds);
     }
 
     SM_TPL
     inline void SM_TYPE::moveBox(Index box_id, f32* move_vec) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeUpdate(SAP::toMove, box_id.getIndex(), move_vec);
         this->template moveBoxInner_<Derived>(box_id, move_vec);
     }
 
+    SM_TPL
+    inline void SM_TYPE::updateBoxes(const Index* box_ids, const f32* bounds, u32 boxes_count) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeUpdates(SAP::toUpdateBoxes, box_ids, bounds, boxes_count);
+        this->template updateBoxesInner_<Derived>(box_ids, bounds, boxes_count);
+    }
+
+    SM_TPL
+    inline void SM_TYPE::moveBoxes(const Index* box_ids, const f32* move_vecs, u32 boxes_count) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeUpdates(SAP::toMoveBoxes, box_ids, move_vecs, boxes_count);
+        this->template moveBoxesInner_<Derived>(box_ids, move_vecs, boxes_count);
+    }
+
     SM_TPL
     inline void SM_TYPE::removeBox(Index box_id) {
+        this->assertNoReads_();
+        if (this->trace_)
+            this->trace_->writeBoxOp(SAP::toRemove, box_id.getIndex());
         this->template removeBoxInner_<Derived>(box_id);
     }
 }
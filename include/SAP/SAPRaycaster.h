@@ -11,6 +11,25 @@ namespace grynca {
     public:
         SAP_DOMAIN_TYPES(SAPDomain);
 
+        struct BoxOp {
+            u32 box_id;
+            f32 t;
+
+            // nearest first in heap
+            static bool compare(const BoxOp& b1, const BoxOp& b2) {
+                return b1.t > b2.t;
+            }
+        };
+
+        // buffers of single query, const queries need one per thread
+        struct Scratch {
+            Scratch() : query_stamp(0) {}
+
+            fast_vector<BoxOp> pending_hits;    // heap of hits not reported yet
+            fast_vector<u32> box_stamps;        // indexed by box inner id
+            u32 query_stamp;
+        };
+
         // dir is not normalized
         void setRay(f32* origin, f32* dir);
 
@@ -18,37 +37,131 @@ namespace grynca {
         // bool cb(u32 box_id, f32 dt)
         template <typename HitCallback>
         void getHits(const HitCallback& cb);
+        // same as setRay() & getHits() with state in caller's scratch, can run concurrently with other const queries
+        // while manager is not modified (checked in debug build)
+        template <typename HitCallback>
+        void raycast(const f32* origin, const f32* dir, Scratch& scratch, const HitCallback& cb)const;
+
+        // reports boxes hit by box moving from bounds by move_vec with time of impact in [0, 1] near to far
+        // (t is 0 for boxes overlapping it at start), ray set with setRay() is kept
+        // bool cb(u32 box_id, f32 t)
+        template <typename HitCallback>
+        void sweepBox(const f32* bounds, const f32* move_vec, const HitCallback& cb);
+        template <typename HitCallback>
+        void sweepBox(const f32* bounds, const f32* move_vec, Scratch& scratch, const HitCallback& cb)const;
 
+        // nearest hit of ray set with setRay() (with same t as getHits() would report), returns false if ray hits nothing,
+        // segments & boxes further than current nearest hit are skipped
+        bool getClosestHit(u32& box_id_out, f32& t_out);
+        // same with state in caller's scratch (can run concurrently like raycast())
+        bool getClosestHit(const f32* origin, const f32* dir, Scratch& scratch, u32& box_id_out, f32& t_out)const;
+        // occlusion test, stops at first box hit (not necessarily nearest one)
+        bool anyHit(u32* box_id_out = NULL);
+        bool anyHit(const f32* origin, const f32* dir, Scratch& scratch, u32* box_id_out = NULL)const;
+
+        // packet of rays traced with single tree traversal (in chunks of RAY_PACKET_SIZE rays),
+        // origins & dirs: rays_count*AXES_COUNT coords (dirs are not normalized)
+        void setRays(const f32* origins, const f32* dirs, u32 rays_count);
+        u32 getRaysCount()const;
+        // hits of each ray are reported near to far (by t), cb returns false if no more hits are desired for that ray
+        // bool cb(u32 ray_id, u32 box_id, f32 dt)
+        template <typename HitCallback>
+        void getPacketHits(const HitCallback& cb);
+
+        struct RayHit {
+            u32 ray_id;
+            u32 box_id;
+            f32 t;
+        };
+        // appends at most max_hits_per_ray nearest hits of each ray (ordered by ray & dt)
+        void getPacketHits(fast_vector<RayHit>& hits_out, u32 max_hits_per_ray = u32(-1));
+
+        static constexpr u32 RAY_PACKET_SIZE = 64;
     private:
         friend Manager;
+        friend ReadView;
+
+        struct Ray;
 
         SAPRaycaster(const Manager& mgr);
-        bool overlapBox_(const f32* bounds, f32& t_out)const;
-        bool overlapSegment_(Segment* seg, f32& t_out)const;
+        static void initRay_(Ray& ray, const f32* origin, const f32* dir);
+        static void initSweep_(Ray& ray, const f32* bounds, const f32* move_vec);
+        static bool overlapBox_(const Ray& ray, const f32* bounds, f32& t_out);
+        // ray params where ray is inside all slabs of bounds (false when tmin > tmax)
+        static bool clipBox_(const Ray& ray, const f32* bounds, f32& tmin_out, f32& tmax_out);
+        // t where ray enters segment (0 when origin is inside), false when it enters after t_limit
+        static bool enterSegment_(const Ray& ray, Segment* seg, f32 t_limit, f32& t_out);
+        static bool enterBounds_(const Ray& ray, const f32* bounds, f32 t_limit, f32& t_out);
+        // bounds of ray part inside leaf (up to t_limit), false when ray misses it
+        static bool rayLeafBounds_(const Ray& ray, Segment* seg, f32 t_limit, f32* bounds_out);
+        // true when box was not yet tested during current query (boxes can live in multiple leaves)
+        static bool stampBox_(Scratch& scratch, u32 box_inner_id);
+        // starts new stamped query
+        static void nextQueryStamp_(Scratch& scratch);
+        void getClosestHitRec_(const Ray& ray, Scratch& scratch, Segment* seg, u32& box_id_out, f32& t_best)const;
+        bool anyHitRec_(const Ray& ray, Scratch& scratch, Segment* seg, u32& box_id_out)const;
+        template <typename HitCallback>
+        void traceHits_(const Ray& ray, Scratch& scratch, const HitCallback& cb)const;
+        // hits are reported once no unvisited segment can be entered before them (t_next is lowest entry t of
+        // segments waiting in traversal), so order is near to far across leaves
+        template <typename HitCallback>
+        bool getHitsRec_(const Ray& ray, Scratch& scratch, const HitCallback& cb, Segment* seg, f32 t_next)const;
+        // reports pending hits up to t_limit, returns false when cb wants no more hits
         template <typename HitCallback>
-        bool getHitsRec_(const HitCallback& cb, Segment* seg);
+        static bool reportHits_(Scratch& scratch, const HitCallback& cb, f32 t_limit);
+        // mask of packet rays hitting segment (entry t_out for all packet rays, 0 when origin is inside)
+        u64 overlapSegmentPacket_(Segment* seg, f32* t_out)const;
+        // as getHitsRec_() for each packet ray (t_next per ray), returns false when all rays in packet are done
+        template <typename HitCallback>
+        bool getPacketHitsRec_(const HitCallback& cb, Segment* seg, u64 rays_mask, const f32* t_next);
+        // adds hits of leaf boxes not yet tested by rays to pending ones
+        void getPacketLeafHits_(Segment* seg, u64 rays_mask);
+        // reports pending hits of rays from rays_mask up to their t_limit
+        template <typename HitCallback>
+        void reportPacketHits_(const HitCallback& cb, u64 rays_mask, const f32* t_limit);
 
         struct Ray {
             f32 origin[AXES_COUNT];
             f32 dir[AXES_COUNT];
             f32 inv_dir[AXES_COUNT];
             u8 dir_sgn[AXES_COUNT];
+            // swept box is traced as ray of its min corner against bounds with mins expanded by its extents
+            f32 extents[AXES_COUNT];
+            // subtracted from bounds min/max coords in slab tests
+            f32 offset[2][AXES_COUNT];
+            bool sweep;
         };
 
-        struct BoxOp {
+        // rays in lanes (padded to multiple of 8 for SIMD loads)
+        struct RayPacket {
+            f32 origins[AXES_COUNT][RAY_PACKET_SIZE];
+            f32 inv_dirs[AXES_COUNT][RAY_PACKET_SIZE];
+            u32 first_ray;
+            u32 count;
+            u64 done;       // rays that don't want more hits
+        };
+
+        struct PacketHitOp {
+            u32 ray;        // in packet
             u32 box_id;
             f32 t;
 
-
-            static bool compare(BoxOp& b1, BoxOp& b2) {
-                return b1.t < b2.t;
+            static bool compare(const PacketHitOp& h1, const PacketHitOp& h2) {
+                if (h1.ray != h2.ray)
+                    return h1.ray < h2.ray;
+                return h1.t < h2.t;
             }
         };
 
         const Manager* mgr_;
         Ray ray_;
-        fast_vector<BoxOp> overlaps_in_curr_seg_;
-        u32 prev_box_;
+        Scratch scratch_;
+        fast_vector<u64> box_tested_rays_;     // packet rays already tested against box (valid with current stamp)
+
+        fast_vector<f32> rays_origins_;
+        fast_vector<f32> rays_dirs_;
+        RayPacket packet_;
+        fast_vector<PacketHitOp> packet_pending_hits_;         // not yet reported hits of current packet
     };
 
 }
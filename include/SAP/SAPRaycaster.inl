@@ -1,6 +1,8 @@
 #include "SAPRaycaster.h"
 #include "SAPManagerC.h"
 #include <cstring>
+#include <cfloat>
+#include <cmath>
 #include "base.h"
 
 #define SRC_TPL template <typename SAPDomain>
@@ -9,41 +11,191 @@
 
 namespace grynca {
 
+    // odr-used (std::min) -> needs definition before c++17
+    SRC_TPL
+    constexpr u32 SRC_TYPE::RAY_PACKET_SIZE;
+
     SRC_TPL
     inline void SRC_TYPE::setRay(f32* origin, f32* dir) {
-        memcpy(ray_.dir, dir, AXES_COUNT*sizeof(f32));
-        memcpy(ray_.origin, origin, AXES_COUNT*sizeof(f32));
-        for (u32 a=0; a<AXES_COUNT; ++a) {
-            ray_.inv_dir[a] = 1.0f/ray_.dir[a];
-            ray_.dir_sgn[a] = (u8)(ray_.inv_dir[a] < 0);
-        }
+        initRay_(ray_, origin, dir);
     }
 
     SRC_TPL
     template <typename HitCallback>
     inline void SRC_TYPE::getHits(const HitCallback& cb) {
-        getHitsRec_(cb, mgr_->getRootSegment());
+        traceHits_(ray_, scratch_, cb);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline void SRC_TYPE::raycast(const f32* origin, const f32* dir, Scratch& scratch, const HitCallback& cb)const {
+        Ray ray;
+        initRay_(ray, origin, dir);
+        traceHits_(ray, scratch, cb);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline void SRC_TYPE::sweepBox(const f32* bounds, const f32* move_vec, const HitCallback& cb) {
+        sweepBox(bounds, move_vec, scratch_, cb);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline void SRC_TYPE::sweepBox(const f32* bounds, const f32* move_vec, Scratch& scratch, const HitCallback& cb)const {
+        Ray ray;
+        initSweep_(ray, bounds, move_vec);
+        traceHits_(ray, scratch, cb);
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::getClosestHit(u32& box_id_out, f32& t_out) {
+        return getClosestHit(ray_.origin, ray_.dir, scratch_, box_id_out, t_out);
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::getClosestHit(const f32* origin, const f32* dir, Scratch& scratch, u32& box_id_out, f32& t_out)const {
+        Ray ray;
+        initRay_(ray, origin, dir);
+        f32 t_best = FLT_MAX;
+        u32 box_id = InvalidId();
+        mgr_->beginRead_();
+        nextQueryStamp_(scratch);
+        getClosestHitRec_(ray, scratch, mgr_->getRootSegment(), box_id, t_best);
+        mgr_->endRead_();
+        if (box_id == InvalidId())
+            return false;
+        box_id_out = box_id;
+        t_out = t_best;
+        return true;
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::anyHit(u32* box_id_out) {
+        return anyHit(ray_.origin, ray_.dir, scratch_, box_id_out);
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::anyHit(const f32* origin, const f32* dir, Scratch& scratch, u32* box_id_out)const {
+        Ray ray;
+        initRay_(ray, origin, dir);
+        u32 box_id;
+        mgr_->beginRead_();
+        nextQueryStamp_(scratch);
+        bool hit = anyHitRec_(ray, scratch, mgr_->getRootSegment(), box_id);
+        mgr_->endRead_();
+        if (!hit)
+            return false;
+        if (box_id_out)
+            *box_id_out = box_id;
+        return true;
+    }
+
+    SRC_TPL
+    inline void SRC_TYPE::setRays(const f32* origins, const f32* dirs, u32 rays_count) {
+        rays_origins_.assign(origins, origins + rays_count*AXES_COUNT);
+        rays_dirs_.assign(dirs, dirs + rays_count*AXES_COUNT);
+    }
+
+    SRC_TPL
+    inline u32 SRC_TYPE::getRaysCount()const {
+        return u32(rays_origins_.size()/AXES_COUNT);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline void SRC_TYPE::getPacketHits(const HitCallback& cb) {
+        u32 rays_count = getRaysCount();
+        mgr_->beginRead_();
+        for (u32 first=0; first<rays_count; first+=RAY_PACKET_SIZE) {
+            RayPacket& p = packet_;
+            p.first_ray = first;
+            p.count = std::min(rays_count-first, RAY_PACKET_SIZE);
+            p.done = 0;
+            nextQueryStamp_(scratch_);
+            for (u32 r=0; r<RAY_PACKET_SIZE; ++r) {
+                for (u32 a=0; a<AXES_COUNT; ++a) {
+                    if (r < p.count) {
+                        p.origins[a][r] = rays_origins_[(first+r)*AXES_COUNT + a];
+                        p.inv_dirs[a][r] = 1.0f/rays_dirs_[(first+r)*AXES_COUNT + a];
+                    }
+                    else {
+                        p.origins[a][r] = 0.0f;
+                        p.inv_dirs[a][r] = 0.0f;
+                    }
+                }
+            }
+            u64 all = (p.count < 64) ? ((u64(1) << p.count) - 1) : ~u64(0);
+            f32 t_next[RAY_PACKET_SIZE];
+            std::fill(t_next, t_next + RAY_PACKET_SIZE, FLT_MAX);
+            if (getPacketHitsRec_(cb, mgr_->getRootSegment(), all, t_next))
+                reportPacketHits_(cb, all, t_next);
+            packet_pending_hits_.clear();
+        }
+        mgr_->endRead_();
+    }
+
+    SRC_TPL
+    inline void SRC_TYPE::getPacketHits(fast_vector<RayHit>& hits_out, u32 max_hits_per_ray) {
+        if (!max_hits_per_ray)
+            return;
+        size_t first_hit = hits_out.size();
+        // hits of each ray come near to far, so ray is done after max_hits_per_ray of them
+        fast_vector<u32> ray_hits(getRaysCount(), 0);
+        getPacketHits([&hits_out, &ray_hits, max_hits_per_ray](u32 ray_id, u32 box_id, f32 t) {
+            hits_out.push_back({ray_id, box_id, t});
+            return ++ray_hits[ray_id] < max_hits_per_ray;
+        });
+        // rays are interleaved across leaves, stable sort keeps dt order of each ray
+        std::stable_sort(hits_out.begin() + first_hit, hits_out.end(), [](const RayHit& h1, const RayHit& h2) {
+            return h1.ray_id < h2.ray_id;
+        });
     }
 
     SRC_TPL
     inline SRC_TYPE::SAPRaycaster(const Manager& mgr)
-     : mgr_(&mgr), prev_box_(InvalidId())
+     : mgr_(&mgr)
     {
     }
 
+    SRC_TPL
+    inline void SRC_TYPE::initRay_(Ray& ray, const f32* origin, const f32* dir) {
+        //static
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            ray.origin[a] = origin[a];
+            ray.dir[a] = dir[a];
+            ray.inv_dir[a] = 1.0f/dir[a];
+            ray.dir_sgn[a] = (u8)(ray.inv_dir[a] < 0);
+            ray.extents[a] = 0.0f;
+            ray.offset[0][a] = ray.offset[1][a] = origin[a];
+        }
+        ray.sweep = false;
+    }
 
     SRC_TPL
-    inline bool SRC_TYPE::overlapBox_(const f32* bounds, f32& t_out)const {
+    inline void SRC_TYPE::initSweep_(Ray& ray, const f32* bounds, const f32* move_vec) {
+        //static
+        initRay_(ray, bounds, move_vec);
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            ray.extents[a] = GET_COORD(bounds, 1, a) - GET_COORD(bounds, 0, a);
+            ray.offset[0][a] = ray.origin[a] + ray.extents[a];
+        }
+        ray.sweep = true;
+    }
+
 
-        f32 tmin = (GET_COORD(bounds, ray_.dir_sgn[0], 0) - ray_.origin[0])*ray_.inv_dir[0];
-        f32 tmax = (GET_COORD(bounds, 1-ray_.dir_sgn[0], 0) - ray_.origin[0])*ray_.inv_dir[0];
+    SRC_TPL
+    inline bool SRC_TYPE::clipBox_(const Ray& ray, const f32* bounds, f32& tmin_out, f32& tmax_out) {
+        //static
+        f32 tmin = (GET_COORD(bounds, ray.dir_sgn[0], 0) - ray.offset[ray.dir_sgn[0]][0])*ray.inv_dir[0];
+        f32 tmax = (GET_COORD(bounds, 1-ray.dir_sgn[0], 0) - ray.offset[1-ray.dir_sgn[0]][0])*ray.inv_dir[0];
 
         for (u32 a=1; a<AXES_COUNT; ++a) {
 
-            f32 tymin = (GET_COORD(bounds, ray_.dir_sgn[a], a) - ray_.origin[a]) * ray_.inv_dir[a];
+            f32 tymin = (GET_COORD(bounds, ray.dir_sgn[a], a) - ray.offset[ray.dir_sgn[a]][a]) * ray.inv_dir[a];
             if (tymin > tmax)
                 return false;
-            f32 tymax = (GET_COORD(bounds, 1-ray_.dir_sgn[a], a) - ray_.origin[a]) * ray_.inv_dir[a];
+            f32 tymax = (GET_COORD(bounds, 1-ray.dir_sgn[a], a) - ray.offset[1-ray.dir_sgn[a]][a]) * ray.inv_dir[a];
             if (tmin > tymax)
                 return false;
 
@@ -52,12 +204,23 @@ namespace grynca {
             if (tymax < tmax)
                 tmax = tymax;
         }
+        tmin_out = tmin;
+        tmax_out = tmax;
+        return true;
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::overlapBox_(const Ray& ray, const f32* bounds, f32& t_out) {
+        //static
+        f32 tmin, tmax;
+        if (!clipBox_(ray, bounds, tmin, tmax))
+            return false;
 
         if (tmin < 0) {
             if (tmax < 0)
                 return false;
-            //inside box
-            t_out = tmax;
+            //inside box (swept box overlaps it from start)
+            t_out = ray.sweep ? 0.0f : tmax;
         }
         else {
             if (tmin > 1.0f)
@@ -68,71 +231,309 @@ namespace grynca {
     }
 
     SRC_TPL
-    inline bool SRC_TYPE::overlapSegment_(Segment* seg, f32& t_out)const {
+    inline bool SRC_TYPE::enterSegment_(const Ray& ray, Segment* seg, f32 t_limit, f32& t_out) {
+        //static
         f32 bounds[AXES_COUNT*2];
         for (u32 a=0; a<AXES_COUNT; ++a) {
             seg->getLowBorder(a, bounds[a]);
             seg->getHighBorder(a, bounds[AXES_COUNT+a]);
         }
-        return overlapBox_(bounds, t_out);
+        return enterBounds_(ray, bounds, t_limit, t_out);
     }
 
     SRC_TPL
-    template <typename HitCallback>
-    inline bool SRC_TYPE::getHitsRec_(const HitCallback& cb, Segment* seg) {
+    inline bool SRC_TYPE::enterBounds_(const Ray& ray, const f32* bounds, f32 t_limit, f32& t_out) {
+        //static
+        f32 tmin, tmax;
+        if (!clipBox_(ray, bounds, tmin, tmax) || tmax < 0 || tmin > 1.0f)
+            return false;
+        t_out = std::max(tmin, 0.0f);
+        return t_out <= t_limit;
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::rayLeafBounds_(const Ray& ray, Segment* seg, f32 t_limit, f32* bounds_out) {
+        //static
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            seg->getLowBorder(a, bounds_out[a]);
+            seg->getHighBorder(a, bounds_out[AXES_COUNT+a]);
+        }
+        f32 tmin, tmax;
+        if (!clipBox_(ray, bounds_out, tmin, tmax) || tmax < 0 || tmin > 1.0f || tmin > t_limit)
+            return false;
+        f32 t_from = std::max(tmin, 0.0f);
+        f32 t_to = std::min(std::min(tmax, 1.0f), t_limit);
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            f32 p1 = ray.origin[a] + t_from*ray.dir[a];
+            f32 p2 = ray.origin[a] + t_to*ray.dir[a];
+            // covers rounding of computed points
+            f32 eps = 4*FLT_EPSILON*(fabsf(ray.origin[a]) + fabsf(ray.dir[a]) + ray.extents[a]);
+            bounds_out[a] = std::min(p1, p2) - eps;
+            bounds_out[AXES_COUNT+a] = std::max(p1, p2) + ray.extents[a] + eps;
+        }
+        return true;
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::stampBox_(Scratch& scratch, u32 box_inner_id) {
+        //static
+        if (box_inner_id >= scratch.box_stamps.size())
+            scratch.box_stamps.resize(box_inner_id+1, 0);
+        if (scratch.box_stamps[box_inner_id] == scratch.query_stamp)
+            return false;
+        scratch.box_stamps[box_inner_id] = scratch.query_stamp;
+        return true;
+    }
+
+    SRC_TPL
+    inline void SRC_TYPE::nextQueryStamp_(Scratch& scratch) {
+        //static
+        if (++scratch.query_stamp == 0) {
+            std::fill(scratch.box_stamps.begin(), scratch.box_stamps.end(), 0);
+            scratch.query_stamp = 1;
+        }
+    }
+
+    SRC_TPL
+    inline void SRC_TYPE::getClosestHitRec_(const Ray& ray, Scratch& scratch, Segment* seg, u32& box_id_out, f32& t_best)const {
         if (seg->isSplit()) {
-            f32 t1, t2;
-            bool in1 = overlapSegment_(seg->getChild(0), t1);
-            bool in2 = overlapSegment_(seg->getChild(1), t2);
-            if (in1) {
-                if (in2) {
-                    if (t1>t2) {
-                        if (!getHitsRec_(cb, seg->getChild(1)))
-                            return false;
-                        if (!getHitsRec_(cb, seg->getChild(0)))
-                            return false;
-                    }
-                    else {
-                        if (!getHitsRec_(cb, seg->getChild(0)))
-                            return false;
-                        if (!getHitsRec_(cb, seg->getChild(1)))
-                            return false;
-                    }
-                }
-                else {
-                    if (!getHitsRec_(cb, seg->getChild(0)))
-                        return false;
+            f32 t[2];
+            bool in[2];
+            in[0] = enterSegment_(ray, seg->getChild(0), t_best, t[0]);
+            in[1] = enterSegment_(ray, seg->getChild(1), t_best, t[1]);
+            u32 near = (in[0] && in[1]) ? u32(t[1] < t[0]) : u32(in[1]);
+            if (in[near])
+                getClosestHitRec_(ray, scratch, seg->getChild(near), box_id_out, t_best);
+            // t_best could shrink in near child
+            u32 far = 1-near;
+            if (in[far] && t[far] <= t_best)
+                getClosestHitRec_(ray, scratch, seg->getChild(far), box_id_out, t_best);
+        }
+        else {
+            f32 ray_bounds[AXES_COUNT*2];
+            if (!rayLeafBounds_(ray, seg, t_best, ray_bounds))
+                return;
+            // no sorting needed, just keep the nearest
+            auto test_box = [this, &ray, &scratch, &box_id_out, &t_best](u32 box_inner_id) {
+                if (!stampBox_(scratch, box_inner_id))
+                    return true;
+                const auto& box = mgr_->boxes_.getItemWithInnerIndex(box_inner_id);
+                f32 t;
+                if (overlapBox_(ray, box.getBounds(), t) && t < t_best) {
+                    t_best = t;
+                    box_id_out = box_inner_id;
                 }
+                return true;
+            };
+            seg->getLeafCandidates_(ray_bounds, test_box);
+        }
+    }
+
+    SRC_TPL
+    inline bool SRC_TYPE::anyHitRec_(const Ray& ray, Scratch& scratch, Segment* seg, u32& box_id_out)const {
+        if (seg->isSplit()) {
+            f32 t[2];
+            bool in[2];
+            in[0] = enterSegment_(ray, seg->getChild(0), FLT_MAX, t[0]);
+            in[1] = enterSegment_(ray, seg->getChild(1), FLT_MAX, t[1]);
+            u32 near = (in[0] && in[1]) ? u32(t[1] < t[0]) : u32(in[1]);
+            if (in[near] && anyHitRec_(ray, scratch, seg->getChild(near), box_id_out))
+                return true;
+            return in[1-near] && anyHitRec_(ray, scratch, seg->getChild(1-near), box_id_out);
+        }
+
+        f32 ray_bounds[AXES_COUNT*2];
+        if (!rayLeafBounds_(ray, seg, 1.0f, ray_bounds))
+            return false;
+        // candidates visit stops at first hit
+        return !seg->getLeafCandidates_(ray_bounds, [this, &ray, &scratch, &box_id_out](u32 box_inner_id) {
+            f32 t;
+            if (!stampBox_(scratch, box_inner_id) || !overlapBox_(ray, mgr_->boxes_.getItemWithInnerIndex(box_inner_id).getBounds(), t))
+                return true;
+            box_id_out = box_inner_id;
+            return false;
+        });
+    }
+
+    SRC_TPL
+    inline u64 SRC_TYPE::overlapSegmentPacket_(Segment* seg, f32* t_out)const {
+        f32 bounds[AXES_COUNT*2];
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            seg->getLowBorder(a, bounds[a]);
+            seg->getHighBorder(a, bounds[AXES_COUNT+a]);
+        }
+        return SAP::simd::raysBoxHits<AXES_COUNT, true>(packet_.origins[0], packet_.inv_dirs[0], RAY_PACKET_SIZE, packet_.count, bounds, t_out);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline bool SRC_TYPE::getPacketHitsRec_(const HitCallback& cb, Segment* seg, u64 rays_mask, const f32* t_next) {
+        rays_mask &= ~packet_.done;
+        if (!rays_mask)
+            return packet_.done != ((packet_.count < 64) ? ((u64(1) << packet_.count) - 1) : ~u64(0));
+
+        if (!seg->isSplit()) {
+            getPacketLeafHits_(seg, rays_mask);
+            reportPacketHits_(cb, rays_mask, t_next);
+            return true;
+        }
+
+        f32 t0[RAY_PACKET_SIZE], t1[RAY_PACKET_SIZE];
+        u64 in0 = overlapSegmentPacket_(seg->getChild(0), t0) & rays_mask;
+        u64 in1 = overlapSegmentPacket_(seg->getChild(1), t1) & rays_mask;
+        u64 both = in0 & in1;
+        // rays in both children that hit second one first
+        u64 second_first = 0;
+        for (u64 rays = both; rays; rays &= rays-1) {
+            u32 r = SAP::simd::lowestBit64(rays);
+            if (t0[r] > t1[r])
+                second_first |= u64(1) << r;
+        }
+        // each ray visits its children near to far, near child can report hits only up to entry of far one
+        f32 t_next_near[RAY_PACKET_SIZE];
+        std::copy(t_next, t_next + RAY_PACKET_SIZE, t_next_near);
+        for (u64 rays = both; rays; rays &= rays-1) {
+            u32 r = SAP::simd::lowestBit64(rays);
+            t_next_near[r] = std::min(t_next[r], (second_first & (u64(1) << r)) ? t0[r] : t1[r]);
+        }
+        if ((in0 & ~second_first) && !getPacketHitsRec_(cb, seg->getChild(0), in0 & ~second_first, t_next_near))
+            return false;
+        // child 1 is far for rest of rays in both
+        for (u64 rays = both & ~second_first; rays; rays &= rays-1) {
+            u32 r = SAP::simd::lowestBit64(rays);
+            t_next_near[r] = t_next[r];
+        }
+        if (in1 && !getPacketHitsRec_(cb, seg->getChild(1), in1, t_next_near))
+            return false;
+        if (second_first && !getPacketHitsRec_(cb, seg->getChild(0), second_first, t_next))
+            return false;
+        return true;
+    }
+
+    SRC_TPL
+    inline void SRC_TYPE::getPacketLeafHits_(Segment* seg, u64 rays_mask) {
+        RayPacket& p = packet_;
+        f32 ts[RAY_PACKET_SIZE];
+        auto test_box = [this, &p, &ts, rays_mask](u32 box_inner_id) {
+            if (stampBox_(scratch_, box_inner_id)) {
+                if (box_inner_id >= box_tested_rays_.size())
+                    box_tested_rays_.resize(box_inner_id+1);
+                box_tested_rays_[box_inner_id] = 0;
             }
-            else if (in2) {
-                if (!getHitsRec_(cb, seg->getChild(1)))
-                    return false;
+            // each ray tests box only once
+            u64 rays = rays_mask & ~box_tested_rays_[box_inner_id];
+            if (!rays)
+                return true;
+            box_tested_rays_[box_inner_id] |= rays;
+            const auto& box = mgr_->boxes_.getItemWithInnerIndex(box_inner_id);
+            u64 hits = SAP::simd::raysBoxHits<AXES_COUNT>(p.origins[0], p.inv_dirs[0], RAY_PACKET_SIZE, p.count, box.getBounds(), ts) & rays;
+            for (; hits; hits &= hits-1) {
+                u32 r = SAP::simd::lowestBit64(hits);
+                packet_pending_hits_.push_back({r, box_inner_id, ts[r]});
+            }
+            return true;
+        };
+
+        // boxes are candidates for union of packet rays parts inside leaf (same as for single ray)
+        f32 ray_bounds[AXES_COUNT*2];
+        bool in_leaf = false;
+        for (u64 rays = rays_mask; rays; rays &= rays-1) {
+            u32 r = SAP::simd::lowestBit64(rays);
+            Ray ray;
+            initRay_(ray, &rays_origins_[(p.first_ray + r)*AXES_COUNT], &rays_dirs_[(p.first_ray + r)*AXES_COUNT]);
+            f32 bounds[AXES_COUNT*2];
+            if (!rayLeafBounds_(ray, seg, 1.0f, bounds))
+                continue;
+            for (u32 a=0; a<AXES_COUNT; ++a) {
+                ray_bounds[a] = in_leaf ? std::min(ray_bounds[a], bounds[a]) : bounds[a];
+                ray_bounds[AXES_COUNT+a] = in_leaf ? std::max(ray_bounds[AXES_COUNT+a], bounds[AXES_COUNT+a]) : bounds[AXES_COUNT+a];
             }
+            in_leaf = true;
         }
-        else {
-            for (u32 pid=0; pid<seg->points_[0].size(); ++pid) {
-                SAP::EndPoint &p = seg->points_[0][pid];
-                if (p.getIsMax()) {
-                    u32 box_inner_id = p.getBoxId();
-                    const auto& box = mgr_->boxes_.getItemWithInnerIndex(box_inner_id);
-                    f32 t;
-                    if (overlapBox_(box.getBounds(), t)) {
-                        overlaps_in_curr_seg_.push_back({box_inner_id, t});
-                    }
-                }
+        if (in_leaf)
+            seg->getLeafCandidates_(ray_bounds, test_box);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline void SRC_TYPE::reportPacketHits_(const HitCallback& cb, u64 rays_mask, const f32* t_limit) {
+        RayPacket& p = packet_;
+        fast_vector<PacketHitOp>& pending = packet_pending_hits_;
+        std::sort(pending.begin(), pending.end(), PacketHitOp::compare);
+        u32 kept = 0;
+        for (u32 i=0; i<pending.size(); ++i) {
+            const PacketHitOp& h = pending[i];
+            u64 ray_bit = u64(1) << h.ray;
+            if (p.done & ray_bit)
+                continue;
+            if (!(rays_mask & ray_bit) || h.t > t_limit[h.ray]) {
+                pending[kept++] = h;
+                continue;
             }
-            std::sort(overlaps_in_curr_seg_.begin(), overlaps_in_curr_seg_.end(), BoxOp::compare);
-            for (u32 i=0; i<overlaps_in_curr_seg_.size(); ++i) {
-                if (overlaps_in_curr_seg_[i].box_id == prev_box_)
-                    continue;
-                prev_box_ = overlaps_in_curr_seg_[i].box_id;
-                if (!cb(overlaps_in_curr_seg_[i].box_id, overlaps_in_curr_seg_[i].t)) {
-                    overlaps_in_curr_seg_.clear();
-                    prev_box_ = InvalidId();
-                    return false;
+            if (!cb(p.first_ray + h.ray, h.box_id, h.t))
+                p.done |= ray_bit;
+        }
+        pending.resize(kept);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline void SRC_TYPE::traceHits_(const Ray& ray, Scratch& scratch, const HitCallback& cb)const {
+        mgr_->beginRead_();
+        nextQueryStamp_(scratch);
+        if (getHitsRec_(ray, scratch, cb, mgr_->getRootSegment(), FLT_MAX))
+            reportHits_(scratch, cb, FLT_MAX);
+        mgr_->endRead_();
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline bool SRC_TYPE::getHitsRec_(const Ray& ray, Scratch& scratch, const HitCallback& cb, Segment* seg, f32 t_next)const {
+        if (seg->isSplit()) {
+            f32 t[2];
+            bool in[2];
+            in[0] = enterSegment_(ray, seg->getChild(0), FLT_MAX, t[0]);
+            in[1] = enterSegment_(ray, seg->getChild(1), FLT_MAX, t[1]);
+            u32 near = (in[0] && in[1]) ? u32(t[1] < t[0]) : u32(in[1]);
+            u32 far = 1-near;
+            if (in[near] && !getHitsRec_(ray, scratch, cb, seg->getChild(near), in[far] ? std::min(t_next, t[far]) : t_next))
+                return false;
+            if (in[far] && !getHitsRec_(ray, scratch, cb, seg->getChild(far), t_next))
+                return false;
+            return true;
+        }
+
+        f32 ray_bounds[AXES_COUNT*2];
+        if (rayLeafBounds_(ray, seg, 1.0f, ray_bounds)) {
+            seg->getLeafCandidates_(ray_bounds, [this, &ray, &scratch](u32 box_inner_id) {
+                // box was already tested in other leaf
+                if (!stampBox_(scratch, box_inner_id))
+                    return true;
+                const auto& box = mgr_->boxes_.getItemWithInnerIndex(box_inner_id);
+                f32 t;
+                if (overlapBox_(ray, box.getBounds(), t)) {
+                    scratch.pending_hits.push_back({box_inner_id, t});
+                    std::push_heap(scratch.pending_hits.begin(), scratch.pending_hits.end(), BoxOp::compare);
                 }
+                return true;
+            });
+        }
+        return reportHits_(scratch, cb, t_next);
+    }
+
+    SRC_TPL
+    template <typename HitCallback>
+    inline bool SRC_TYPE::reportHits_(Scratch& scratch, const HitCallback& cb, f32 t_limit) {
+        //static
+        fast_vector<BoxOp>& pending = scratch.pending_hits;
+        while (!pending.empty() && pending.front().t <= t_limit) {
+            BoxOp hit = pending.front();
+            std::pop_heap(pending.begin(), pending.end(), BoxOp::compare);
+            pending.pop_back();
+            if (!cb(hit.box_id, hit.t)) {
+                pending.clear();
+                return false;
             }
-            overlaps_in_curr_seg_.clear();
         }
         return true;
     }
@@ -0,0 +1,69 @@
+#ifndef SAPREADVIEW_H
+#define SAPREADVIEW_H
+
+#include "SAP_internal.h"
+#include "SAPRaycaster.h"
+
+namespace grynca {
+
+    // read-only copy of tree & box bounds published by SAPManagerBase::publishReadView(),
+    // queries don't touch manager so they can run from any thread while it is being modified
+    template <typename SAPDomain>
+    class SAPReadView {
+    public:
+        SAP_DOMAIN_TYPES(SAPDomain);
+        typedef typename Raycaster::Scratch Scratch;
+
+        SAPReadView();
+
+        // increases with each publish
+        u64 getVersion()const;
+        u32 getBoxesCount()const;
+
+        // same as SAPManagerBase::queryAABB() at publish time
+        // void cb(Index box_id)
+        template <typename Cb>
+        void queryAABB(const f32* bounds, const Cb& cb)const;
+        // same as SAPRaycaster::raycast() & sweepBox() at publish time, scratch is needed per thread
+        // bool cb(Index box_id, f32 t)
+        template <typename HitCallback>
+        void raycast(const f32* origin, const f32* dir, Scratch& scratch, const HitCallback& cb)const;
+        template <typename HitCallback>
+        void sweepBox(const f32* bounds, const f32* move_vec, Scratch& scratch, const HitCallback& cb)const;
+    private:
+        friend Manager;
+        typedef typename Raycaster::Ray Ray;
+
+        struct Node {
+            f32 bounds[AXES_COUNT*2];       // segment borders
+            u32 children[2];                // InvalidId() for leaf
+            u32 boxes_from, boxes_to;       // range in leaf_boxes_
+        };
+
+        // rebuilds from manager's current state (reusing buffers)
+        void build_(const Manager& mgr, u64 version);
+        u32 addNodeRec_(Segment* seg);
+        // box is reported by leaf containing low corner of its overlap with bounds (same as Segment::ownsOverlap_())
+        bool ownsOverlap_(const Node& leaf, const f32* bounds, u32 box_pos)const;
+        template <typename Cb>
+        void queryAABBRec_(u32 node_id, const f32* bounds, const Cb& cb)const;
+        template <typename HitCallback>
+        void traceHits_(const Ray& ray, Scratch& scratch, const HitCallback& cb)const;
+        // as Raycaster::getHitsRec_()
+        template <typename HitCallback>
+        bool getHitsRec_(const Ray& ray, Scratch& scratch, const HitCallback& cb, u32 node_id, f32 t_next)const;
+
+        u64 version_;
+        fast_vector<Node> nodes_;           // root first
+        fast_vector<u32> leaf_boxes_;       // box positions of leafs (awake & sleeping)
+        // by box position (position in manager's boxes at publish time)
+        fast_vector<Index> box_ids_;
+        fast_vector<f32> box_bounds_;       // AXES_COUNT*2 per box
+        fast_vector<f32> box_fat_mins_;     // AXES_COUNT per box (boxes are placed to leafs by fat bounds)
+
+        fast_vector<u32> pos_of_inner_;     // build scratch
+    };
+}
+
+#include "SAPReadView.inl"
+#endif //SAPREADVIEW_H
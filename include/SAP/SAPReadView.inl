@@ -0,0 +1,202 @@
+#include "SAPReadView.h"
+#include "SAPManagerC.h"
+#include "SAPSegment.h"
+#include <cfloat>
+#include "base.h"
+
+#define SRV_TPL template <typename SAPDomain>
+#define SRV_TYPE SAPReadView<SAPDomain>
+#define GET_MIN(BOUNDS, AXIS) BOUNDS[AXIS]
+#define GET_MAX(BOUNDS, AXIS) BOUNDS[AXES_COUNT+AXIS]
+
+namespace grynca {
+
+    SRV_TPL
+    inline SRV_TYPE::SAPReadView()
+     : version_(0)
+    {}
+
+    SRV_TPL
+    inline u64 SRV_TYPE::getVersion()const {
+        return version_;
+    }
+
+    SRV_TPL
+    inline u32 SRV_TYPE::getBoxesCount()const {
+        return u32(box_ids_.size());
+    }
+
+    SRV_TPL
+    template <typename Cb>
+    inline void SRV_TYPE::queryAABB(const f32* bounds, const Cb& cb)const {
+        queryAABBRec_(0, bounds, cb);
+    }
+
+    SRV_TPL
+    template <typename HitCallback>
+    inline void SRV_TYPE::raycast(const f32* origin, const f32* dir, Scratch& scratch, const HitCallback& cb)const {
+        Ray ray;
+        Raycaster::initRay_(ray, origin, dir);
+        traceHits_(ray, scratch, cb);
+    }
+
+    SRV_TPL
+    template <typename HitCallback>
+    inline void SRV_TYPE::sweepBox(const f32* bounds, const f32* move_vec, Scratch& scratch, const HitCallback& cb)const {
+        Ray ray;
+        Raycaster::initSweep_(ray, bounds, move_vec);
+        traceHits_(ray, scratch, cb);
+    }
+
+    SRV_TPL
+    inline void SRV_TYPE::build_(const Manager& mgr, u64 version) {
+        version_ = version;
+        nodes_.clear();
+        leaf_boxes_.clear();
+
+        u32 boxes_count = mgr.boxes_.size();
+        box_ids_.resize(boxes_count);
+        box_bounds_.resize(boxes_count*AXES_COUNT*2);
+        box_fat_mins_.resize(boxes_count*AXES_COUNT);
+        for (u32 box_pos=0; box_pos<boxes_count; ++box_pos) {
+            Index box_id = mgr.boxes_.getIndexForPos(box_pos);
+            const Box& box = mgr.boxes_.getItemWithInnerIndex(box_id.getIndex());
+            box_ids_[box_pos] = box_id;
+            memcpy(&box_bounds_[box_pos*AXES_COUNT*2], box.getBounds(), AXES_COUNT*2*sizeof(f32));
+            memcpy(&box_fat_mins_[box_pos*AXES_COUNT], box.getFatBounds(), AXES_COUNT*sizeof(f32));
+            if (box_id.getIndex() >= pos_of_inner_.size())
+                pos_of_inner_.resize(box_id.getIndex()+1);
+            pos_of_inner_[box_id.getIndex()] = box_pos;
+        }
+        addNodeRec_(mgr.getRootSegment());
+    }
+
+    SRV_TPL
+    inline u32 SRV_TYPE::addNodeRec_(Segment* seg) {
+        u32 node_id = u32(nodes_.size());
+        nodes_.emplace_back();
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            seg->getLowBorder(a, nodes_[node_id].bounds[a]);
+            seg->getHighBorder(a, nodes_[node_id].bounds[AXES_COUNT+a]);
+        }
+        if (seg->isSplit()) {
+            nodes_[node_id].boxes_from = nodes_[node_id].boxes_to = 0;
+            // nodes_ may reallocate while adding children
+            u32 child0 = addNodeRec_(seg->getChild(0));
+            u32 child1 = addNodeRec_(seg->getChild(1));
+            nodes_[node_id].children[0] = child0;
+            nodes_[node_id].children[1] = child1;
+            return node_id;
+        }
+
+        nodes_[node_id].children[0] = nodes_[node_id].children[1] = InvalidId();
+        nodes_[node_id].boxes_from = u32(leaf_boxes_.size());
+        const Points& ps = seg->points_[0];
+        for (u32 i=0; i<ps.size(); ++i) {
+            if (!ps.getIsMax(i))
+                leaf_boxes_.push_back(pos_of_inner_[ps.getBoxId(i)]);
+        }
+        for (u32 i=0; i<seg->sleeping_points_.size(); ++i) {
+            leaf_boxes_.push_back(pos_of_inner_[seg->sleeping_points_.getBoxId(i)]);
+        }
+        nodes_[node_id].boxes_to = u32(leaf_boxes_.size());
+        return node_id;
+    }
+
+    SRV_TPL
+    inline bool SRV_TYPE::ownsOverlap_(const Node& leaf, const f32* bounds, u32 box_pos)const {
+        const f32* fat_mins = &box_fat_mins_[box_pos*AXES_COUNT];
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            f32 p = std::max(GET_MIN(bounds, a), fat_mins[a]);
+            // missing borders are at -+FLT_MAX
+            if (p < GET_MIN(leaf.bounds, a) || p >= GET_MAX(leaf.bounds, a))
+                return false;
+        }
+        return true;
+    }
+
+    SRV_TPL
+    template <typename Cb>
+    inline void SRV_TYPE::queryAABBRec_(u32 node_id, const f32* bounds, const Cb& cb)const {
+        const Node& n = nodes_[node_id];
+        if (n.children[0] != InvalidId()) {
+            for (u32 c=0; c<2; ++c) {
+                const Node& child = nodes_[n.children[c]];
+                bool overlaps = true;
+                for (u32 a=0; a<AXES_COUNT; ++a) {
+                    if (GET_MIN(bounds, a) > GET_MAX(child.bounds, a) || GET_MAX(bounds, a) < GET_MIN(child.bounds, a)) {
+                        overlaps = false;
+                        break;
+                    }
+                }
+                if (overlaps)
+                    queryAABBRec_(n.children[c], bounds, cb);
+            }
+            return;
+        }
+
+        for (u32 i=n.boxes_from; i<n.boxes_to; ++i) {
+            u32 box_pos = leaf_boxes_[i];
+            const f32* box_bounds = &box_bounds_[box_pos*AXES_COUNT*2];
+            bool overlaps = true;
+            for (u32 a=0; a<AXES_COUNT; ++a) {
+                if (GET_MIN(box_bounds, a) > GET_MAX(bounds, a) || GET_MAX(box_bounds, a) < GET_MIN(bounds, a)) {
+                    overlaps = false;
+                    break;
+                }
+            }
+            if (overlaps && ownsOverlap_(n, bounds, box_pos))
+                cb(box_ids_[box_pos]);
+        }
+    }
+
+    SRV_TPL
+    template <typename HitCallback>
+    inline void SRV_TYPE::traceHits_(const Ray& ray, Scratch& scratch, const HitCallback& cb)const {
+        Raycaster::nextQueryStamp_(scratch);
+        if (getHitsRec_(ray, scratch, cb, 0, FLT_MAX)) {
+            Raycaster::reportHits_(scratch, [this, &cb](u32 box_pos, f32 t) {
+                return cb(box_ids_[box_pos], t);
+            }, FLT_MAX);
+        }
+    }
+
+    SRV_TPL
+    template <typename HitCallback>
+    inline bool SRV_TYPE::getHitsRec_(const Ray& ray, Scratch& scratch, const HitCallback& cb, u32 node_id, f32 t_next)const {
+        const Node& n = nodes_[node_id];
+        if (n.children[0] != InvalidId()) {
+            f32 t[2];
+            bool in[2];
+            in[0] = Raycaster::enterBounds_(ray, nodes_[n.children[0]].bounds, FLT_MAX, t[0]);
+            in[1] = Raycaster::enterBounds_(ray, nodes_[n.children[1]].bounds, FLT_MAX, t[1]);
+            u32 near = (in[0] && in[1]) ? u32(t[1] < t[0]) : u32(in[1]);
+            u32 far = 1-near;
+            if (in[near] && !getHitsRec_(ray, scratch, cb, n.children[near], in[far] ? std::min(t_next, t[far]) : t_next))
+                return false;
+            if (in[far] && !getHitsRec_(ray, scratch, cb, n.children[far], t_next))
+                return false;
+            return true;
+        }
+
+        // box positions are used instead of inner ids in scratch
+        for (u32 i=n.boxes_from; i<n.boxes_to; ++i) {
+            u32 box_pos = leaf_boxes_[i];
+            if (!Raycaster::stampBox_(scratch, box_pos))
+                continue;
+            f32 t;
+            if (Raycaster::overlapBox_(ray, &box_bounds_[box_pos*AXES_COUNT*2], t)) {
+                scratch.pending_hits.push_back({box_pos, t});
+                std::push_heap(scratch.pending_hits.begin(), scratch.pending_hits.end(), Raycaster::BoxOp::compare);
+            }
+        }
+        return Raycaster::reportHits_(scratch, [this, &cb](u32 box_pos, f32 t) {
+            return cb(box_ids_[box_pos], t);
+        }, t_next);
+    }
+}
+
+#undef SRV_TPL
+#undef SRV_TYPE
+#undef GET_MIN
+#undef GET_MAX
@@ -17,7 +17,7 @@ namespace grynca {
         void addBox(Box& box, Index box_id);
 
         // returns true if moved out of segment
-        bool moveBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, f32* move_vec, typename Manager::DeferredAfterUpdate& dau);
+        bool moveBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, const f32* move_vec, typename Manager::DeferredAfterUpdate& dau);
         bool updateBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, typename Manager::DeferredAfterUpdate& dau);
         void removeBox(Box& box, Index box_id, SAP::MinMax* min_max_ids);
 
@@ -34,7 +34,9 @@ namespace grynca {
         bool getHighBorder(u32 axis, f32& hb_out);
 
         bool isSplit();
-        u32 getBoxesCount();
+        u32 getBoxesCount();        // awake boxes
+        u32 getSleepingBoxesCount();
+        u32 getMemoryUsage()const;     // bytes incl. endpoints
         f32 getSplitValue() { return split_value_; }
         u8 getSplitAxis() { return split_axis_; }
 
@@ -43,28 +45,85 @@ namespace grynca {
     private:
         friend Box;
         friend Raycaster;
+        friend ReadView;
         friend Manager;
 
         template <typename AddedCb>
         void addBoxTree_(const f32* bounds, const AddedCb& cb);
-        u32 bisectInsertFind_(SAP::Points& points, f32 val, u32 from, u32 to);
-        void findOverlapsOnAxis_(Box& box, u32 axis);
+        // fills empty leaf with presorted endpoints of boxes and splits it recursively
+        void bulkLoad_(const Index* box_ids, u32 boxes_count);
+        // reports each overlapping pair in leaf (only in leaf that owns it)
+        // void cb(u32 box1_inner_id, u32 box2_inner_id)
+        template <typename PairCb>
+        void sweepOverlaps_(fast_vector<u32>& active_scratch, const PairCb& cb);
+        // true if this leaf contains low corner of overlap of two boxes (each overlap is owned by exactly one leaf)
+        bool ownsOverlap_(Box& b1, Box& b2);
+        bool ownsOverlap_(const f32* bounds, const Box& box);
+        // reports boxes (awake & sleeping) whose tight bounds intersect given bounds and whose overlap with them
+        // is owned by this leaf, only min points in range on most selective axis are scanned
+        // void cb(u32 box_inner_id)
+        template <typename Cb>
+        void queryLeaf_(const f32* bounds, const Cb& cb);
+        // boxes (including sleeping) whose min point lies in [bounds min - longest side, bounds max] on most selective axis,
+        // only those can overlap bounds, cb returns false to stop (then returns false)
+        // bool cb(u32 box_inner_id)
+        template <typename Cb>
+        bool getLeafCandidates_(const f32* bounds, const Cb& cb);
+        // points with values in [low, high]
+        static void findValuesRange_(const Points& points, f32 low, f32 high, u32& from_out, u32& to_out);
+        u32 bisectInsertFind_(Points& points, f32 val, u32 from, u32 to);
+        // finds endpoint ids of box with given bounds (bounds must match points' values)
+        void resolveEndPointIds_(const f32* bounds, u32 box_inner_id, SAP::MinMax* min_max_ids_out);
+        u32 findEndPointId_(u32 axis, u32 box_inner_id, u32 is_max, f32 value);
+        // sets valid endpoint ids to all boxes in segment (with SAP_LAZY_ENDPOINT_IDS they are not maintained)
+        void refreshEndPointIds_();
+        void findOverlapsOnAxis_(Box& box, u32 box_inner_id, u32 axis);
         u32 getScanStartId_(u32 min_id, u32 axis);   // if from where we must scan for overlaps
         void insertSingleAxis_(Box& new_box, u32 new_box_inner_id, u32 axis);
         void addBoxInner_(Box& box, u32 box_inner_id);
         void removeBoxInner_(Box& box, Index box_id, SAP::MinMax* min_max_ids);
         SAP::LongestSide findLongestSide_(u32 axis);
-        void moveMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, f32* move_vec, u32 axis, f32 low, f32 high, bool& crossing_out, bool& oos_out);
-        void updateMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, u32 axis, f32 low, f32 high, bool& crossing_out);
-        u32 moveMinRight_(u32 point_id, f32 new_value, u32 axis);
-        u32 moveMaxRight_(u32 point_id, f32 new_value, u32 axis);
-        u32 moveMinLeft_(i32 point_id, f32 new_value, u32 axis);
-        u32 moveMaxLeft_(i32 point_id, f32 new_value, u32 axis);
-        void split_();
+        // awake boxes & sleeping ones weighted by SLEEPING_BOXES_PER_BOX (split & merge criteria)
+        u32 getWeightedBoxesCount_();
+        // sleeping boxes have only min point on axis 0 (without ids in occurence), awake boxes don't pass them when moving
+        void addSleepingBox_(Box& box, u32 box_inner_id);
+        void removeSleepingBox_(Box& box, u32 box_inner_id);
+        // moves box's points from sleeping to awake ones (may split)
+        void wakeBox_(Box& box, u32 box_inner_id);
+        u32 findSleepingPointId_(u32 box_inner_id, f32 min_value);
+        SAP::LongestSide findSleepingLongestSide_();
+        // candidates by values on axis 0 (to possibly_added_), sleeping boxes for awake box and vice versa
+        void findSleepingOverlaps_(Box& box, u32 box_inner_id);
+        void findAwakeOverlaps_(Box& box, u32 box_inner_id);
+        // only move endpoints within this segment (does not remove box when it moves out of segment - returns true)
+        // can run concurrently for different segments
+        bool moveBoxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, const f32* move_vec, SAP::Candidates& cands, bool& crossing_out);
+        bool updateBoxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, SAP::Candidates& cands, bool& crossing_out);
+        void removeOutOfSegmentBox_(Box& box, Index box_id, SAP::MinMax* min_max_ids, typename Manager::DeferredAfterUpdate& dau);
+        void moveMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, const f32* move_vec, u32 axis, f32 low, f32 high, SAP::Candidates& cands, bool& crossing_out, bool& oos_out);
+        void updateMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, u32 axis, f32 low, f32 high, SAP::Candidates& cands, bool& crossing_out);
+        u32 moveMinRight_(u32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands);
+        u32 moveMaxRight_(u32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands);
+        u32 moveMinLeft_(i32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands);
+        u32 moveMaxLeft_(i32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands);
+        // segments come from manager's pool (see SAPManagerBase::newSegment_())
+        void reset_(Segment* parent);
+        // bulk: leaf may be much fuller than MAX_BOXES_IN_SEGMENT (bulk load), split needs to reduce it only by some part
+        void split_(bool bulk = false);
         void merge_(Segment* removed_child);
+        // restructuring criteria (with hysteresis, see SAP::DefaultPolicy)
+        bool needsSplit_();
+        bool needsMerge_();
+        // splits now or queues leaf for SAPManagerBase::maintainTree() when maintenance is deferred
+        void splitIfNeeded_();
         void pointToChild_(Segment* child, u32 a, u32 point_id);
+        // segment's own record in manager's snapshot (children are written by manager),
+        // endpoint ids in boxes & borders must be refreshed after read
+        void writeSnapshot_(SAP::SnapshotWriter& w);
+        bool readSnapshot_(SAP::SnapshotReader& r, const fast_vector<u32>& box_ids_map);
         void setDebugName_();
         void calcBorders_();
+        void calcBordersRec_();     // for subtree
         bool calcLowBorder_(u32 axis, f32& val);
         bool calcHighBorder_(u32 axis, f32& val);
         f32 findLowestPointRec_(u32 a);
@@ -80,10 +139,15 @@ namespace grynca {
         u8 split_axis_;
         f32 split_value_;
 
-        SAP::Points points_[AXES_COUNT];       // sorted from low to high
+        Points points_[AXES_COUNT];       // sorted from low to high
         SAP::LongestSide longest_sides_[AXES_COUNT];
+        Points sleeping_points_;            // min points on axis 0 of sleeping boxes, sorted
+        SAP::LongestSide sleeping_longest_side_;
 
         SAPSegment<SAPDomain>* children_[2];
+        u32 batch_leaf_id_;         // used during parallel batch update
+        bool maintenance_queued_;   // in manager's maintenance queue
+        u32 split_failed_count_;    // weighted boxes count when split_() last failed (0 when it did not)
 
         struct {
             f32 low;
@@ -3,6 +3,7 @@
 #include "SAPManagerC.h"
 #include "types/containers/fast_vector.h"
 #include "types/Index.h"
+#include <algorithm>
 
 #define GET_MIN(BOUNDS, AXIS) BOUNDS[AXIS]
 #define GET_MAX(BOUNDS, AXIS) BOUNDS[AXES_COUNT+AXIS]
@@ -13,12 +14,9 @@ namespace grynca {
 
     SEG_TPL
     inline SEG_TYPE::SAPSegment(Manager& mgr, Segment* parent)
-     : manager_(&mgr),
-       parent_(parent),
-       split_axis_(SAP::InvalidAxis),
-       split_value_(0.0)
+     : manager_(&mgr)
     {
-        children_[0] = children_[1] = NULL;
+        reset_(parent);
     }
 
     SEG_TPL
@@ -29,11 +27,29 @@ namespace grynca {
             delete children_[1];
     }
 
+    SEG_TPL
+    inline void SEG_TYPE::reset_(Segment* parent) {
+        parent_ = parent;
+        split_axis_ = SAP::InvalidAxis;
+        split_value_ = 0.0;
+        batch_leaf_id_ = InvalidId();
+        maintenance_queued_ = false;
+        split_failed_count_ = 0;
+        children_[0] = children_[1] = NULL;
+        // buffers keep their capacity
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            points_[a].clear();
+            longest_sides_[a] = SAP::LongestSide();
+        }
+        sleeping_points_.clear();
+        sleeping_longest_side_ = SAP::LongestSide();
+    }
+
     SEG_TPL
     inline void SEG_TYPE::addBox(Box& box, Index box_id) {
         for (u32 a=0; a<AXES_COUNT; ++a) {
             insertSingleAxis_(box, box_id.getIndex(), a);
-            findOverlapsOnAxis_(box, a);
+            findOverlapsOnAxis_(box, box_id.getIndex(), a);
             // update longest side if neccessary
             f32 side_len = box.getMaxValue(a) - box.getMinValue(a);
             if (side_len > longest_sides_[a].length) {
@@ -41,36 +57,43 @@ namespace grynca {
                 longest_sides_[a].box_id = box_id.getIndex();
             }
         }
-        if (getBoxesCount() > SAP::MAX_BOXES_IN_SEGMENT) {
-            split_();
-        }
+        splitIfNeeded_();
     }
 
     SEG_TPL
-    inline bool SEG_TYPE::moveBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, f32* move_vec, typename Manager::DeferredAfterUpdate& dau) {
+    inline bool SEG_TYPE::moveBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, const f32* move_vec, typename Manager::DeferredAfterUpdate& dau) {
         PROFILE_BLOCK("SAPSegment::moveBox");
 
-        bool oos = false;
-        for (u32 a=0; a<AXES_COUNT; ++a) {
-            moveMinMaxPoints_(box, box_id, old_min_max_ids, move_vec, a, borders_[a].low, borders_[a].high, dau.crossing_, oos);
+        bool oos = moveBoxPoints_(box, box_id, old_min_max_ids, move_vec, manager_->overlaps_, dau.crossing_);
+        if (oos) {
+            removeOutOfSegmentBox_(box, box_id, old_min_max_ids, dau);
         }
+        return oos;
+    }
 
+    SEG_TPL
+    inline bool SEG_TYPE::updateBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, typename Manager::DeferredAfterUpdate& dau) {
+        bool oos = updateBoxPoints_(box, box_id, old_min_max_ids, manager_->overlaps_, dau.crossing_);
         if (oos) {
-            removeBoxInner_(box, box_id, old_min_max_ids);
-            if (getBoxesCount() < SAP::MIN_BOXES_IN_SEGMENT && parent_) {
-                dau.merges_.push_back(this);
-            }
-            return true;
+            removeOutOfSegmentBox_(box, box_id, old_min_max_ids, dau);
         }
+        return oos;
+    }
 
-        return false;
+    SEG_TPL
+    inline bool SEG_TYPE::moveBoxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, const f32* move_vec, SAP::Candidates& cands, bool& crossing_out) {
+        bool oos = false;
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            moveMinMaxPoints_(box, box_id, old_min_max_ids, move_vec, a, borders_[a].low, borders_[a].high, cands, crossing_out, oos);
+        }
+        return oos;
     }
 
     SEG_TPL
-    inline bool SEG_TYPE::updateBox(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, typename Manager::DeferredAfterUpdate& dau) {
+    inline bool SEG_TYPE::updateBoxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, SAP::Candidates& cands, bool& crossing_out) {
         bool oos = false;
         for (u32 a=0; a<AXES_COUNT; ++a) {
-            updateMinMaxPoints_(box, box_id, old_min_max_ids, a, borders_[a].low, borders_[a].high, dau.crossing_);
+            updateMinMaxPoints_(box, box_id, old_min_max_ids, a, borders_[a].low, borders_[a].high, cands, crossing_out);
 
             f32 min_val = box.getMinValue(a);
             f32 max_val = box.getMaxValue(a);
@@ -88,14 +111,18 @@ namespace grynca {
                 }
             }
         }
+        return oos;
+    }
 
-        if (oos) {
-            removeBoxInner_(box, box_id, old_min_max_ids);
-            if (getBoxesCount() < SAP::MIN_BOXES_IN_SEGMENT && parent_) {
-                dau.merges_.push_back(this);
-            }
+    SEG_TPL
+    inline void SEG_TYPE::removeOutOfSegmentBox_(Box& box, Index box_id, SAP::MinMax* min_max_ids, typename Manager::DeferredAfterUpdate& dau) {
+        removeBoxInner_(box, box_id, min_max_ids);
+        if (needsMerge_()) {
+            if (manager_->deferred_maintenance_)
+                manager_->scheduleMaintenance_(this);
+            else
+                dau.scheduleMerge(this);
         }
-        return oos;
     }
 
     SEG_TPL
@@ -103,8 +130,11 @@ namespace grynca {
 
         removeBoxInner_(box, box_id, min_max_ids);
 
-        if (getBoxesCount() < SAP::MIN_BOXES_IN_SEGMENT && parent_) {
-            parent_->merge_(this);
+        if (needsMerge_()) {
+            if (manager_->deferred_maintenance_)
+                manager_->scheduleMaintenance_(this);
+            else
+                parent_->merge_(this);
         }
     }
 
@@ -177,6 +207,20 @@ namespace grynca {
         return points_[0].size()/2;
     }
 
+    SEG_TPL
+    inline u32 SEG_TYPE::getSleepingBoxesCount() {
+        return sleeping_points_.size();
+    }
+
+    SEG_TPL
+    inline u32 SEG_TYPE::getMemoryUsage()const {
+        u32 bytes = sizeof(Segment) + sleeping_points_.getMemoryUsage();
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            bytes += points_[a].getMemoryUsage();
+        }
+        return bytes;
+    }
+
     SEG_TPL
     inline void SEG_TYPE::getCrossedBoxes(fast_vector<u32>& crossed_out) {
         ASSERT(isSplit());
@@ -184,8 +228,8 @@ namespace grynca {
             return;
 
         u32 i = 0;
-        while (children_[1]->points_[split_axis_][i].getValue() < split_value_) {
-            crossed_out.push_back(children_[1]->points_[split_axis_][i].getBoxId());
+        while (children_[1]->points_[split_axis_].getValue(i) < split_value_) {
+            crossed_out.push_back(children_[1]->points_[split_axis_].getBoxId(i));
             ++i;
         }
     }
@@ -221,9 +265,168 @@ namespace grynca {
 
 
     SEG_TPL
-    inline u32 SEG_TYPE::bisectInsertFind_(SAP::Points& points, f32 val, u32 from, u32 to) {
+    inline void SEG_TYPE::bulkLoad_(const Index* box_ids, u32 boxes_count) {
+        ASSERT(!isSplit() && !getBoxesCount());
+
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            Points& ps = points_[a];
+            ps.reserve(boxes_count*2);
+            for (u32 i=0; i<boxes_count; ++i) {
+                Box& b = manager_->boxes_.accItem(box_ids[i]);
+                u32 box_inner_id = box_ids[i].getIndex();
+                ps.pushBack(SAP::EndPoint(box_inner_id, false, b.getMinValue(a)));
+                ps.pushBack(SAP::EndPoint(box_inner_id, true, b.getMaxValue(a)));
+
+                f32 side_len = b.getMaxValue(a) - b.getMinValue(a);
+                if (side_len > longest_sides_[a].length) {
+                    longest_sides_[a].length = side_len;
+                    longest_sides_[a].box_id = box_inner_id;
+                }
+            }
+            ps.sort();
+
+            for (u32 i=0; i<ps.size(); ++i) {
+                Box& b = manager_->boxes_.accItemWithInnerIndex(ps.getBoxId(i));
+                b.setEndPointId(this, a, i, ps.getIsMax(i));
+            }
+        }
+
+        // split top-down with same criteria as when boxes are added one by one
+        fast_vector<Segment*> segs{this};
+        while (!segs.empty()) {
+            Segment* s = segs.back();
+            segs.pop_back();
+
+            if (s->needsSplit_()) {
+                s->split_(true);
+                if (s->isSplit()) {
+                    segs.push_back(s->getChild(0));
+                    segs.push_back(s->getChild(1));
+                }
+            }
+        }
+    }
+
+    SEG_TPL
+    template <typename PairCb>
+    inline void SEG_TYPE::sweepOverlaps_(fast_vector<u32>& active_scratch, const PairCb& cb) {
+        ASSERT(!isSplit());
+
+        Points& ps = points_[0];
+        active_scratch.clear();
+        for (u32 i=0; i<ps.size(); ++i) {
+            u32 bid = ps.getBoxId(i);
+            if (ps.getIsMax(i)) {
+                for (u32 j=0; j<active_scratch.size(); ++j) {
+                    if (active_scratch[j] == bid) {
+                        active_scratch[j] = active_scratch.back();
+                        active_scratch.pop_back();
+                        break;
+                    }
+                }
+            }
+            else {
+                Box& b1 = manager_->boxes_.accItemWithInnerIndex(bid);
+                for (u32 j=0; j<active_scratch.size(); ++j) {
+                    if (!manager_->canCollide_(bid, active_scratch[j]))
+                        continue;
+                    Box& b2 = manager_->boxes_.accItemWithInnerIndex(active_scratch[j]);
+                    if (manager_->keptPairOverlaps_(b1, b2) && ownsOverlap_(b1, b2)) {
+                        cb(bid, active_scratch[j]);
+                    }
+                }
+                active_scratch.push_back(bid);
+            }
+        }
+    }
+
+    SEG_TPL
+    inline bool SEG_TYPE::ownsOverlap_(Box& b1, Box& b2) {
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            f32 p = std::max(b1.getMinValue(a), b2.getMinValue(a));
+            if (borders_[a].has_low && p < borders_[a].low)
+                return false;
+            if (borders_[a].has_high && p >= borders_[a].high)
+                return false;
+        }
+        return true;
+    }
+
+    SEG_TPL
+    inline bool SEG_TYPE::ownsOverlap_(const f32* bounds, const Box& box) {
+        const f32* box_bounds = box.getFatBounds();
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            f32 p = std::max(GET_MIN(bounds, a), GET_MIN(box_bounds, a));
+            if (borders_[a].has_low && p < borders_[a].low)
+                return false;
+            if (borders_[a].has_high && p >= borders_[a].high)
+                return false;
+        }
+        return true;
+    }
+
+    SEG_TPL
+    template <typename Cb>
+    inline void SEG_TYPE::queryLeaf_(const f32* bounds, const Cb& cb) {
+        ASSERT(!isSplit());
+        auto check_box = [this, bounds, &cb](u32 box_inner_id) {
+            const Box& b = manager_->boxes_.getItemWithInnerIndex(box_inner_id);
+            const f32* box_bounds = b.getBounds();
+            for (u32 a=0; a<AXES_COUNT; ++a) {
+                if (GET_MIN(box_bounds, a) > GET_MAX(bounds, a) || GET_MAX(box_bounds, a) < GET_MIN(bounds, a))
+                    return true;
+            }
+            if (ownsOverlap_(bounds, b))
+                cb(box_inner_id);
+            return true;
+        };
+        getLeafCandidates_(bounds, check_box);
+    }
+
+    SEG_TPL
+    template <typename Cb>
+    inline bool SEG_TYPE::getLeafCandidates_(const f32* bounds, const Cb& cb) {
+        ASSERT(!isSplit());
+        // boxes with min point in [bounds min - longest side, bounds max] may overlap on axis
+        u32 axis = 0, from = 0, to = 0;
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            u32 f, t;
+            findValuesRange_(points_[a], GET_MIN(bounds, a) - longest_sides_[a].length, GET_MAX(bounds, a), f, t);
+            if (a == 0 || t-f < to-from) {
+                axis = a;
+                from = f;
+                to = t;
+            }
+            if (from == to)
+                break;
+        }
+        const Points& ps = points_[axis];
+        for (u32 i=from; i<to; ++i) {
+            if (!ps.getIsMax(i) && !cb(ps.getBoxId(i)))
+                return false;
+        }
+
+        findValuesRange_(sleeping_points_, GET_MIN(bounds, 0) - sleeping_longest_side_.length, GET_MAX(bounds, 0), from, to);
+        for (u32 i=from; i<to; ++i) {
+            if (!cb(sleeping_points_.getBoxId(i)))
+                return false;
+        }
+        return true;
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::findValuesRange_(const Points& points, f32 low, f32 high, u32& from_out, u32& to_out) {
+        //static
+        from_out = points.lowerBound(low);
+        to_out = points.upperBound(high);
+        if (to_out < from_out)
+            to_out = from_out;
+    }
+
+    SEG_TPL
+    inline u32 SEG_TYPE::bisectInsertFind_(Points& points, f32 val, u32 from, u32 to) {
         u32 half = from + (to-from)/2;
-        if (val < points[half].getValue()) {
+        if (val < points.getValue(half)) {
             if (half == from)
                 return from;
             else
@@ -238,42 +441,52 @@ namespace grynca {
     }
 
     SEG_TPL
-    inline void SEG_TYPE::findOverlapsOnAxis_(Box& box, u32 axis) {
-        SAP::Points& ps = points_[axis];
-        u32 min_id = box.getMinId(this, axis);
-        u32 max_id = box.getMaxId(this, axis);
+    inline void SEG_TYPE::resolveEndPointIds_(const f32* bounds, u32 box_inner_id, SAP::MinMax* min_max_ids_out) {
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            min_max_ids_out[a].v[0] = findEndPointId_(a, box_inner_id, 0, GET_MIN(bounds, a));
+            min_max_ids_out[a].v[1] = findEndPointId_(a, box_inner_id, 1, GET_MAX(bounds, a));
+        }
+    }
 
-        u32 from = getScanStartId_(min_id, axis);
+    SEG_TPL
+    inline u32 SEG_TYPE::findEndPointId_(u32 axis, u32 box_inner_id, u32 is_max, f32 value) {
+        return SAP::findPointId(points_[axis], box_inner_id, is_max, value);
+    }
 
-        for (u32 i=from; i< min_id; ++i) {
-            u32 bid = ps[i].getBoxId();
-            if (!ps[i].getIsMax()) {
-                ASSERT(ps[min_id].getBoxId() != bid);
-                manager_->overlaps_.possibly_added_.push_back(bid);
+    SEG_TPL
+    inline void SEG_TYPE::refreshEndPointIds_() {
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            Points& ps = points_[a];
+            for (u32 i=0; i<ps.size(); ++i) {
+                Box& b = manager_->boxes_.accItemWithInnerIndex(ps.getBoxId(i));
+                b.setEndPointId(this, a, i, ps.getIsMax(i));
             }
         }
+    }
 
-        for (u32 i= min_id +1; i<max_id; ++i) {
-            u32 bid = ps[i].getBoxId();
-            if (!ps[i].getIsMax()) {
-                ASSERT(ps[min_id].getBoxId() != bid);
-                manager_->overlaps_.possibly_added_.push_back(bid);
-            }
-        }
+    SEG_TPL
+    inline void SEG_TYPE::findOverlapsOnAxis_(Box& box, u32 box_inner_id, u32 axis) {
+        Points& ps = points_[axis];
+        u32 min_id = box.getMinId(this, axis);
+        u32 max_id = box.getMaxId(this, axis);
+
+        u32 from = getScanStartId_(min_id, axis);
+
+        fast_vector<u32>& possibly_added = manager_->overlaps_.possibly_added_;
+        u32 prev_size = u32(possibly_added.size());
+        ps.gatherMinBoxIds(from, min_id, possibly_added);
+        ps.gatherMinBoxIds(min_id+1, max_id, possibly_added);
+        manager_->filterCandidates_(box_inner_id, possibly_added, prev_size);
     }
 
     SEG_TPL
     inline u32 SEG_TYPE::getScanStartId_(u32 min_id, u32 axis) {
-        SAP::Points& ps = points_[axis];
-        f32 min_val = ps[min_id].getValue();
+        Points& ps = points_[axis];
+        f32 min_val = ps.getValue(min_id);
         // find from where we must scan for overlaps
         f32 longest_len = longest_sides_[axis].length;
         if (longest_len != 0.0f) {
-            for (i32 from= min_id -1; from>0; --from) {
-                f32 len = min_val - ps[from].getValue();
-                if (len > longest_len)
-                    return u32(from);
-            }
+            return ps.findLastFurther(min_id, min_val, longest_len);
         }
         return 0;
     }
@@ -283,12 +496,13 @@ namespace grynca {
         f32 min_val = new_box.getMinValue(axis);
         f32 max_val = new_box.getMaxValue(axis);
 
-        SAP::Points& ps = points_[axis];
+        Points& ps = points_[axis];
 
         u32 new_min_id, new_max_id;
-        u32 points_count = u32(ps.size());
+        u32 points_count = ps.size();
         if (!ps.empty()) {
-            new_min_id = bisectInsertFind_(ps, min_val, 0, points_count-1);
+            // min before equal values, max after them
+            new_min_id = ps.lowerBound(min_val);
             if (new_min_id == points_count)
                 new_max_id = new_min_id+1;
             else
@@ -299,32 +513,34 @@ namespace grynca {
             new_max_id = 1;
         }
 
-        ps.emplace(ps.begin()+new_min_id, new_box_inner_id, false, min_val);
-        ps.emplace(ps.begin()+new_max_id, new_box_inner_id, true, max_val);
+        ps.insert(new_min_id, SAP::EndPoint(new_box_inner_id, false, min_val));
+        ps.insert(new_max_id, SAP::EndPoint(new_box_inner_id, true, max_val));
 
         new_box.setMinMaxId(this, axis, new_min_id, new_max_id);
 
+#ifndef SAP_LAZY_ENDPOINT_IDS
         // fix ids for other boxes
         for (u32 i=new_min_id+1; i<new_max_id; ++i) {
-            Box& b = manager_->boxes_.accItemWithInnerIndex(ps[i].getBoxId());
-            b.setEndPointId(this, axis, i, ps[i].getIsMax());
+            Box& b = manager_->boxes_.accItemWithInnerIndex(ps.getBoxId(i));
+            b.setEndPointId(this, axis, i, ps.getIsMax(i));
         }
         for (u32 i=new_max_id+1; i<ps.size(); ++i) {
-            Box& b = manager_->boxes_.accItemWithInnerIndex(ps[i].getBoxId());
-            b.setEndPointId(this, axis, i, ps[i].getIsMax());
+            Box& b = manager_->boxes_.accItemWithInnerIndex(ps.getBoxId(i));
+            b.setEndPointId(this, axis, i, ps.getIsMax(i));
         }
+#endif
     }
 
     SEG_TPL
     inline SAP::LongestSide SEG_TYPE::findLongestSide_(u32 axis) {
         f32 longest_side = 0.0f;
         u32 longest_id = SAP::InvalidAxis;
-        SAP::Points& ps = points_[axis];
+        Points& ps = points_[axis];
         for (u32 i=0; i<ps.size(); ++i) {
-            if (ps[i].getIsMax()) {
-                u32 box_inner_id = ps[i].getBoxId();
+            if (ps.getIsMax(i)) {
+                u32 box_inner_id = ps.getBoxId(i);
                 Box& b = manager_->boxes_.accItemWithInnerIndex(box_inner_id);
-                f32 side = ps[i].getValue() - b.getMinValue(axis);
+                f32 side = ps.getValue(i) - b.getMinValue(axis);
                 if (side > longest_side) {
                     longest_side = side;
                     longest_id = box_inner_id;
@@ -346,32 +562,112 @@ namespace grynca {
             }
         }
         // TODO: dont split during merge - was buggy
-//        if (getBoxesCount() > SAP::MAX_BOXES_IN_SEGMENT) {
+//        if (getBoxesCount() > Policy::MAX_BOXES_IN_SEGMENT) {
 //            split_();
 //        }
     }
 
+    SEG_TPL
+    inline void SEG_TYPE::addSleepingBox_(Box& box, u32 box_inner_id) {
+        f32 min_val = box.getMinValue(0);
+        sleeping_points_.insert(sleeping_points_.lowerBound(min_val), SAP::EndPoint(box_inner_id, false, min_val));
+
+        f32 side_len = box.getMaxValue(0) - min_val;
+        if (side_len > sleeping_longest_side_.length) {
+            sleeping_longest_side_.length = side_len;
+            sleeping_longest_side_.box_id = box_inner_id;
+        }
+        box.addOccurence(this);
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::removeSleepingBox_(Box& box, u32 box_inner_id) {
+        sleeping_points_.erase(findSleepingPointId_(box_inner_id, box.getMinValue(0)));
+        if (sleeping_longest_side_.box_id == box_inner_id) {
+            sleeping_longest_side_ = findSleepingLongestSide_();
+        }
+        box.removeOccurence(this);
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::wakeBox_(Box& box, u32 box_inner_id) {
+        removeSleepingBox_(box, box_inner_id);
+        addBoxInner_(box, box_inner_id);
+        splitIfNeeded_();
+    }
+
+    SEG_TPL
+    inline u32 SEG_TYPE::findSleepingPointId_(u32 box_inner_id, f32 min_value) {
+        return SAP::findPointId(sleeping_points_, box_inner_id, 0, min_value);
+    }
+
+    SEG_TPL
+    inline SAP::LongestSide SEG_TYPE::findSleepingLongestSide_() {
+        SAP::LongestSide ls;
+        Points& ps = sleeping_points_;
+        for (u32 i=0; i<ps.size(); ++i) {
+            Box& b = manager_->boxes_.accItemWithInnerIndex(ps.getBoxId(i));
+            f32 side = b.getMaxValue(0) - ps.getValue(i);
+            if (side > ls.length) {
+                ls.length = side;
+                ls.box_id = ps.getBoxId(i);
+            }
+        }
+        return ls;
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::findSleepingOverlaps_(Box& box, u32 box_inner_id) {
+        Points& ps = sleeping_points_;
+        if (ps.empty())
+            return;
+        // mins in [min - longest, max] (max inclusive)
+        u32 from = ps.lowerBound(box.getMinValue(0) - sleeping_longest_side_.length);
+        u32 to = ps.upperBound(box.getMaxValue(0));
+
+        fast_vector<u32>& possibly_added = manager_->overlaps_.possibly_added_;
+        u32 prev_size = u32(possibly_added.size());
+        ps.gatherMinBoxIds(from, to, possibly_added);
+        manager_->filterCandidates_(box_inner_id, possibly_added, prev_size);
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::findAwakeOverlaps_(Box& box, u32 box_inner_id) {
+        Points& ps = points_[0];
+        if (ps.empty())
+            return;
+        u32 from = ps.lowerBound(box.getMinValue(0) - longest_sides_[0].length);
+        u32 to = ps.upperBound(box.getMaxValue(0));
+
+        fast_vector<u32>& possibly_added = manager_->overlaps_.possibly_added_;
+        u32 prev_size = u32(possibly_added.size());
+        ps.gatherMinBoxIds(from, to, possibly_added);
+        manager_->filterCandidates_(box_inner_id, possibly_added, prev_size);
+    }
+
     SEG_TPL
     inline void SEG_TYPE::removeBoxInner_(Box& box, Index box_id, SAP::MinMax* min_max_ids) {
         for (u32 a=0; a<AXES_COUNT; ++a) {
             u32 min_id = min_max_ids[a].v[0];
             u32 max_id = min_max_ids[a].v[1];
-            SAP::Points& ps = points_[a];
+            Points& ps = points_[a];
 
+#ifndef SAP_LAZY_ENDPOINT_IDS
             // fix ids for other boxes
             for (u32 i=min_id+1; i<max_id; ++i) {
-                u32 b2_inner_id = ps[i].getBoxId();
+                u32 b2_inner_id = ps.getBoxId(i);
                 Box& b2 = manager_->boxes_.accItemWithInnerIndex(b2_inner_id);
-                b2.setEndPointId(this, a, i-1, ps[i].getIsMax());
+                b2.setEndPointId(this, a, i-1, ps.getIsMax(i));
             }
             for (u32 i=max_id+1; i<ps.size(); ++i) {
-                u32 b2_inner_id = ps[i].getBoxId();
+                u32 b2_inner_id = ps.getBoxId(i);
                 Box& b2 = manager_->boxes_.accItemWithInnerIndex(b2_inner_id);
-                b2.setEndPointId(this, a, i-2, ps[i].getIsMax());
+                b2.setEndPointId(this, a, i-2, ps.getIsMax(i));
             }
+#endif
 
-            ps.erase(ps.begin()+max_id);
-            ps.erase(ps.begin()+min_id);
+            ps.erase(max_id);
+            ps.erase(min_id);
 
             if (longest_sides_[a].box_id == box_id.getIndex()) {
                 longest_sides_[a] = findLongestSide_(a);
@@ -382,187 +678,166 @@ namespace grynca {
     }
 
     SEG_TPL
-    inline u32 SEG_TYPE::moveMinRight_(u32 point_id, f32 new_value, u32 axis) {
-        SAP::Points& points = points_[axis];
+    inline u32 SEG_TYPE::moveMinRight_(u32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands) {
+        Points& points = points_[axis];
 
         u32 from_id = point_id;
-        for (++point_id; point_id <points.size(); ++point_id) {
-            SAP::EndPoint &p = points[point_id];
-            if (new_value <= p.getValue())
-                break;
-        }
-
-        --point_id;
+        point_id = points.findFirstGreaterEq(point_id+1, new_value) - 1;
         i32 count = point_id-from_id;
 
         if (count>0) {
-#ifdef DEBUG_BUILD
-            u32 b_inner_id = points[from_id].getBoxId();
-#endif
-            SAP::EndPoint tmp_point = points[from_id];
-            memmove(&points[from_id], &points[from_id+1], sizeof(SAP::EndPoint)*count);
+            SAP_STAT(cands.stats_.endpoint_swaps[axis] += u32(count));
+            u32 b_inner_id = points.getBoxId(from_id);
+            points.movePoint(from_id, point_id);
             for (; from_id<point_id; ++from_id) {
-                SAP::EndPoint& p = points[from_id];
-                u32 b2_inner_id = p.getBoxId();
+                u32 b2_inner_id = points.getBoxId(from_id);
+                u32 b2_is_max = points.getIsMax(from_id);
+#ifndef SAP_LAZY_ENDPOINT_IDS
                 Box& b2 = manager_->boxes_.accItemWithInnerIndex(b2_inner_id);
-                b2.setEndPointId(this, axis, from_id, p.getIsMax());
+                b2.setEndPointId(this, axis, from_id, b2_is_max);
+#endif
 
-                if (p.getIsMax()) {
+                if (b2_is_max && manager_->canCollide_(b_inner_id, b2_inner_id)) {
                     ASSERT(b_inner_id != b2_inner_id);
-                    manager_->overlaps_.removed_.push_back(b2_inner_id);
+                    cands.removed_.push_back(b2_inner_id);
+                    SAP_STAT(++cands.stats_.candidates);
                 }
             }
-            points[point_id] = tmp_point;
         }
-        points[point_id].setValue(new_value);
+        points.setValue(point_id, new_value);
         return u32(point_id);
     }
 
     SEG_TPL
-    inline u32 SEG_TYPE::moveMaxRight_(u32 point_id, f32 new_value, u32 axis) {
-        SAP::Points& points = points_[axis];
+    inline u32 SEG_TYPE::moveMaxRight_(u32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands) {
+        Points& points = points_[axis];
 
         u32 from_id = point_id;
-        for (++point_id; point_id <points.size(); ++point_id) {
-            SAP::EndPoint &p = points[point_id];
-            if (new_value <= p.getValue())
-                break;
-        }
-
-        --point_id;
+        // mins with equal value are passed (mins are before maxes on equal values)
+        point_id = points.findFirstGreater(point_id+1, new_value) - 1;
         i32 count = point_id-from_id;
 
         if (count>0) {
-#ifdef DEBUG_BUILD
-            u32 b_inner_id = points[from_id].getBoxId();
-#endif
-            SAP::EndPoint tmp_point = points[from_id];
-            memmove(&points[from_id], &points[from_id+1], sizeof(SAP::EndPoint)*count);
+            SAP_STAT(cands.stats_.endpoint_swaps[axis] += u32(count));
+            u32 b_inner_id = points.getBoxId(from_id);
+            points.movePoint(from_id, point_id);
             for (; from_id<point_id; ++from_id) {
-                SAP::EndPoint& p = points[from_id];
-                u32 b2_inner_id = p.getBoxId();
+                u32 b2_inner_id = points.getBoxId(from_id);
+                u32 b2_is_max = points.getIsMax(from_id);
+#ifndef SAP_LAZY_ENDPOINT_IDS
                 Box& b2 = manager_->boxes_.accItemWithInnerIndex(b2_inner_id);
-                b2.setEndPointId(this, axis, from_id, p.getIsMax());
+                b2.setEndPointId(this, axis, from_id, b2_is_max);
+#endif
 
-                if (!p.getIsMax()) {
+                if (!b2_is_max && manager_->canCollide_(b_inner_id, b2_inner_id)) {
                     ASSERT(b_inner_id != b2_inner_id);
-                    manager_->overlaps_.possibly_added_.push_back(b2_inner_id);
+                    cands.possibly_added_.push_back(b2_inner_id);
+                    SAP_STAT(++cands.stats_.candidates);
                 }
             }
-            points[point_id] = tmp_point;
         }
-        points[point_id].setValue(new_value);
+        points.setValue(point_id, new_value);
         return u32(point_id);
     }
 
     SEG_TPL
-    inline u32 SEG_TYPE::moveMinLeft_(i32 point_id, f32 new_value, u32 axis) {
-        SAP::Points& points = points_[axis];
+    inline u32 SEG_TYPE::moveMinLeft_(i32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands) {
+        Points& points = points_[axis];
 
         i32 from_id = point_id;
-        for (--point_id; point_id >=0; --point_id) {
-            SAP::EndPoint& p = points[point_id];
-            if (new_value >= p.getValue())
-                break;
-        }
-
-        ++point_id;
+        // maxes with equal value are passed
+        point_id = points.findLastLess(u32(point_id), new_value) + 1;
         i32 count = from_id-point_id;
         if (count>0) {
-#ifdef DEBUG_BUILD
-            u32 b_inner_id = points[from_id].getBoxId();
-#endif
-            SAP::EndPoint tmp_point = points[from_id];
-            memmove(&points[point_id+1], &points[point_id], sizeof(SAP::EndPoint)*count);
+            SAP_STAT(cands.stats_.endpoint_swaps[axis] += u32(count));
+            u32 b_inner_id = points.getBoxId(u32(from_id));
+            points.movePoint(u32(from_id), u32(point_id));
             for (; from_id>point_id; --from_id) {
-                SAP::EndPoint& p = points[from_id];
-                u32 b2_inner_id = p.getBoxId();
+                u32 b2_inner_id = points.getBoxId(u32(from_id));
+                u32 b2_is_max = points.getIsMax(u32(from_id));
+#ifndef SAP_LAZY_ENDPOINT_IDS
                 Box& b2 = manager_->boxes_.accItemWithInnerIndex(b2_inner_id);
-                b2.setEndPointId(this, axis, (u32)from_id, p.getIsMax());
+                b2.setEndPointId(this, axis, (u32)from_id, b2_is_max);
+#endif
 
-                if (p.getIsMax()) {
+                if (b2_is_max && manager_->canCollide_(b_inner_id, b2_inner_id)) {
                     ASSERT(b_inner_id != b2_inner_id);
-                    manager_->overlaps_.possibly_added_.push_back(b2_inner_id);
+                    cands.possibly_added_.push_back(b2_inner_id);
+                    SAP_STAT(++cands.stats_.candidates);
                 }
             }
-            points[from_id] = tmp_point;
         }
-        points[from_id].setValue(new_value);
+        points.setValue(u32(from_id), new_value);
         return u32(point_id);
     }
 
     SEG_TPL
-    inline u32 SEG_TYPE::moveMaxLeft_(i32 point_id, f32 new_value, u32 axis) {
-        SAP::Points& points = points_[axis];
+    inline u32 SEG_TYPE::moveMaxLeft_(i32 point_id, f32 new_value, u32 axis, SAP::Candidates& cands) {
+        Points& points = points_[axis];
 
         i32 from_id = point_id;
-        for (--point_id; point_id >=0; --point_id) {
-            SAP::EndPoint& p = points[point_id];
-            if (new_value >= p.getValue())
-                break;
-        }
-
-        ++point_id;
+        point_id = points.findLastLessEq(u32(point_id), new_value) + 1;
         i32 count = from_id-point_id;
         if (count>0) {
-#ifdef DEBUG_BUILD
-            u32 b_inner_id = points[from_id].getBoxId();
-#endif
-            SAP::EndPoint tmp_point = points[from_id];
-            memmove(&points[point_id+1], &points[point_id], sizeof(SAP::EndPoint)*count);
+            SAP_STAT(cands.stats_.endpoint_swaps[axis] += u32(count));
+            u32 b_inner_id = points.getBoxId(u32(from_id));
+            points.movePoint(u32(from_id), u32(point_id));
             for (; from_id>point_id; --from_id) {
-                SAP::EndPoint& p = points[from_id];
-                u32 b2_inner_id = p.getBoxId();
+                u32 b2_inner_id = points.getBoxId(u32(from_id));
+                u32 b2_is_max = points.getIsMax(u32(from_id));
+#ifndef SAP_LAZY_ENDPOINT_IDS
                 Box& b2 = manager_->boxes_.accItemWithInnerIndex(b2_inner_id);
-                b2.setEndPointId(this, axis, (u32)from_id, p.getIsMax());
+                b2.setEndPointId(this, axis, (u32)from_id, b2_is_max);
+#endif
 
-                if (!p.getIsMax()) {
+                if (!b2_is_max && manager_->canCollide_(b_inner_id, b2_inner_id)) {
                     ASSERT(b_inner_id != b2_inner_id);
-                    manager_->overlaps_.removed_.push_back(b2_inner_id);
+                    cands.removed_.push_back(b2_inner_id);
+                    SAP_STAT(++cands.stats_.candidates);
                 }
             }
-            points[from_id] = tmp_point;
         }
-        points[from_id].setValue(new_value);
+        points.setValue(u32(from_id), new_value);
         return u32(point_id);
     }
 
     SEG_TPL
-    inline void SEG_TYPE::moveMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, f32* move_vec, u32 axis, f32 low, f32 high, bool& crossing_out, bool& oos_out) {
+    inline void SEG_TYPE::moveMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, const f32* move_vec, u32 axis, f32 low, f32 high, SAP::Candidates& cands, bool& crossing_out, bool& oos_out) {
         f32 new_min = box.getMinValue(axis);
         f32 new_max = box.getMaxValue(axis);
 
         u32 min_id = old_min_max_ids[axis].v[0];
-        SAP::EndPoint& old_min = points_[axis][min_id];
+        f32 old_min = points_[axis].getValue(min_id);
         u32 max_id = old_min_max_ids[axis].v[1];
-        SAP::EndPoint& old_max = points_[axis][max_id];
+        f32 old_max = points_[axis].getValue(max_id);
 
         u32 new_min_id;
         u32 new_max_id;
 
         if (move_vec[axis] > 0) {
-            if (new_max > high) {
-                if (old_max.getValue()<=high) {
+            // box touching border belongs to both sides (see addBoxTree_())
+            if (new_max >= high) {
+                if (old_max<high) {
                     crossing_out = true;
                 }
                 if (new_min > high) {
                     oos_out = true;
                 }
             }
-            new_max_id = moveMaxRight_(max_id, new_max, axis);
-            new_min_id = moveMinRight_(min_id, new_min, axis);
+            new_max_id = moveMaxRight_(max_id, new_max, axis, cands);
+            new_min_id = moveMinRight_(min_id, new_min, axis, cands);
         }
         else {
-            if (new_min < low) {
-                if (old_min.getValue()>=low) {
+            if (new_min <= low) {
+                if (old_min>low) {
                     crossing_out = true;
                 }
                 if (new_max < low) {
                     oos_out = true;
                 }
             }
-            new_min_id = moveMinLeft_(min_id, new_min, axis);
-            new_max_id = moveMaxLeft_(max_id, new_max, axis);
+            new_min_id = moveMinLeft_(min_id, new_min, axis, cands);
+            new_max_id = moveMaxLeft_(max_id, new_max, axis, cands);
         }
 
         if (min_id != new_min_id || max_id != new_max_id) {
@@ -571,47 +846,47 @@ namespace grynca {
     }
 
     SEG_TPL
-    inline void SEG_TYPE::updateMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, u32 axis, f32 low, f32 high, bool& crossing_out) {
+    inline void SEG_TYPE::updateMinMaxPoints_(Box& box, Index box_id, SAP::MinMax* old_min_max_ids, u32 axis, f32 low, f32 high, SAP::Candidates& cands, bool& crossing_out) {
         f32 new_min = box.getMinValue(axis);
         f32 new_max = box.getMaxValue(axis);
 
         u32 min_id = old_min_max_ids[axis].v[0];
-        SAP::EndPoint& old_min = points_[axis][min_id];
+        f32 old_min = points_[axis].getValue(min_id);
         u32 max_id = old_min_max_ids[axis].v[1];
-        SAP::EndPoint& old_max = points_[axis][max_id];
+        f32 old_max = points_[axis].getValue(max_id);
 
         u32 new_min_id;
         u32 new_max_id;
-        if (old_min.getValue() > new_min) {
-            if (new_min < low && old_min.getValue()>=low ) {
+        if (old_min > new_min) {
+            if (new_min <= low && old_min>low ) {
                 crossing_out = true;
             }
-            new_min_id = moveMinLeft_(min_id, new_min, axis);
+            new_min_id = moveMinLeft_(min_id, new_min, axis, cands);
 
             // max
-            if (old_max.getValue() < new_max) {
-                if (new_max > high && old_max.getValue()<=high ) {
+            if (old_max < new_max) {
+                if (new_max >= high && old_max<high ) {
                     crossing_out = true;
                 }
-                new_max_id = moveMaxRight_(max_id, new_max, axis);
+                new_max_id = moveMaxRight_(max_id, new_max, axis, cands);
             }
             else {
-                new_max_id = moveMaxLeft_(max_id, new_max, axis);
+                new_max_id = moveMaxLeft_(max_id, new_max, axis, cands);
             }
         }
         else {
             // max
-            if (old_max.getValue() < new_max) {
-                if (new_max > high && old_max.getValue()<=high ) {
+            if (old_max < new_max) {
+                if (new_max >= high && old_max<high ) {
                     crossing_out = true;
                 }
-                new_max_id = moveMaxRight_(max_id, new_max, axis);
+                new_max_id = moveMaxRight_(max_id, new_max, axis, cands);
             }
             else {
-                new_max_id = moveMaxLeft_(max_id, new_max, axis);
+                new_max_id = moveMaxLeft_(max_id, new_max, axis, cands);
             }
 
-            new_min_id = moveMinRight_(min_id, new_min, axis);
+            new_min_id = moveMinRight_(min_id, new_min, axis, cands);
         }
 
         if (min_id != new_min_id || max_id != new_max_id) {
@@ -620,10 +895,24 @@ namespace grynca {
     };
 
     SEG_TPL
-    inline void SEG_TYPE::split_() {
+    inline u32 SEG_TYPE::getWeightedBoxesCount_() {
+        return getBoxesCount() + getSleepingBoxesCount()/Policy::SLEEPING_BOXES_PER_BOX;
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::split_(bool bulk) {
         ASSERT(!isSplit());
+#ifdef SAP_LAZY_ENDPOINT_IDS
+        refreshEndPointIds_();
+#endif
 
         u32 boxes_count = getBoxesCount();
+        u32 sleeping_count = getSleepingBoxesCount();
+        // counts are weighted, awake box counts as SLEEPING_BOXES_PER_BOX sleeping ones
+        const u32 awake_w = Policy::SLEEPING_BOXES_PER_BOX;
+        u32 total_w = boxes_count*awake_w + sleeping_count;
+        // cleared when split succeeds
+        split_failed_count_ = getWeightedBoxesCount_();
 
         enum {
             F_GO_TO_FIRST = 1,
@@ -634,23 +923,27 @@ namespace grynca {
         struct {
             f32 val;
             u32 axis;
-            u32 i;
+            bool found;
+            // split is between these values (low one is last in first child)
+            f32 low_val;
+            f32 high_val;
 
-            u32 split1_cnt;
-            u32 crossed_cnt;
-            fast_vector<u8> flags[AXES_COUNT];
+            u32 split1_w;
+            u32 crossed_w;
         } best;
+        fast_vector<u8>* flags = manager_->split_flags_;
 
         best.val = std::numeric_limits<f32>::max();
-        best.i = InvalidId();
         best.axis = 0;
+        best.found = false;
+        best.low_val = best.high_val = 0.0f;
+        best.split1_w = 0;
+        best.crossed_w = 0;
 
         u32 largest_r = 0;
         f32 ranges[AXES_COUNT];
 
         for (u32 a = 0; a < AXES_COUNT; ++a) {
-            best.flags[a].resize(boxes_count*2, u8(F_GO_TO_SECOND));
-
             f32 low, high;
             if (!getLowBorder(a, low)) {
                 low = findLowestPointRec_(a);
@@ -668,97 +961,178 @@ namespace grynca {
         }
 
         u8 parent_split = parent_?parent_->getSplitAxis(): SAP::InvalidAxis;
+        fast_vector<f32>& sleeping_mins = manager_->split_sleeping_[0];
+        fast_vector<f32>& sleeping_maxs = manager_->split_sleeping_[1];
         // find best split position
         for (u32 tested_a=0; tested_a<AXES_COUNT; ++tested_a) {
             if (best.val == 0 && best.axis != parent_split)
                 // value cant get better, dont check other axes
                 break;
 
-            SAP::Points& points = points_[tested_a];
-            u32 split1_cnt = 0;
-            u32 crossed_cnt = 0;
-
-            for (u32 i=1; i<points.size()-1; ++i) {
-                SAP::EndPoint& p = points[i];
-
-                if (!p.getIsMax()) {
-                    ++split1_cnt;
-                    ++crossed_cnt;
+            Points& points = points_[tested_a];
+            sleeping_mins.clear();
+            sleeping_maxs.clear();
+            for (u32 i=0; i<sleeping_count; ++i) {
+                Box& b = manager_->boxes_.accItemWithInnerIndex(sleeping_points_.getBoxId(i));
+                sleeping_mins.push_back(b.getMinValue(tested_a));
+                sleeping_maxs.push_back(b.getMaxValue(tested_a));
+            }
+            if (tested_a != 0)
+                // sleeping points are sorted by mins on axis 0
+                std::sort(sleeping_mins.begin(), sleeping_mins.end());
+            std::sort(sleeping_maxs.begin(), sleeping_maxs.end());
+
+            // endpoints are visited low to high from awake points, sleeping mins & maxes (in this order for equal values)
+            u32 pid = 0, min_id = 0, max_id = 0;
+            auto next_value = [&](u32& src_out) {
+                f32 v = 0.0f;
+                src_out = 3;
+                if (pid < points.size()) {
+                    v = points.getValue(pid);
+                    src_out = 0;
                 }
-                else {
-                    --crossed_cnt;
+                if (min_id < sleeping_mins.size() && (src_out == 3 || sleeping_mins[min_id] < v)) {
+                    v = sleeping_mins[min_id];
+                    src_out = 1;
                 }
-
-                int split2_cnt = boxes_count-split1_cnt+crossed_cnt;
-                int splits_dif = split1_cnt - split2_cnt;
-                f32 val = abs(splits_dif) + crossed_cnt*SAP::CROSSED_SPLIT_PENALTY_COEF;
-                val *= range_coeffs[tested_a];
-
-                bool better_split = (val < best.val)
-                                    || (val == best.val && (i32)tested_a != parent_split);       // prioritize different axis than parent's
-
-                if (better_split) {
-                    if (best.axis != tested_a) {
-                        // clear flags
-                        for (u32 a = 0; a < AXES_COUNT; ++a) {
-                            best.flags[a].assign(boxes_count*2, u8(F_GO_TO_SECOND));
-                        }
-                        best.i = InvalidId();
+                if (max_id < sleeping_maxs.size() && (src_out == 3 || sleeping_maxs[max_id] < v)) {
+                    v = sleeping_maxs[max_id];
+                    src_out = 2;
+                }
+                return v;
+            };
+
+            u32 split1_w = 0;
+            u32 crossed_w = 0;
+            u32 src;
+            f32 v = next_value(src);
+            while (src != 3) {
+                if (src == 0) {
+                    if (!points.getIsMax(pid)) {
+                        split1_w += awake_w;
+                        crossed_w += awake_w;
                     }
-
-                    for (u32 j=best.i+1; j<=i; ++j) {
-                        // update flags to new best state
-                        SAP::EndPoint& p2 = points[j];
-                        Box& b = manager_->boxes_.accItemWithInnerIndex(p2.getBoxId());
-                        if (!p2.getIsMax()) {
-                            for (u32 a=0; a<AXES_COUNT; ++a) {
-                                best.flags[a][b.getMinId(this, a)] = u8(F_GO_TO_BOTH);
-                                best.flags[a][b.getMaxId(this, a)] = u8(F_GO_TO_BOTH);
-                            }
-                        }
-                        else {
-                            for (u32 a=0; a<AXES_COUNT; ++a) {
-                                best.flags[a][b.getMinId(this, a)] = u8(F_GO_TO_FIRST);
-                                best.flags[a][b.getMaxId(this, a)] = u8(F_GO_TO_FIRST);
-                            }
-                        }
+                    else {
+                        crossed_w -= awake_w;
                     }
-
-                    best.i = i;
-                    best.axis = tested_a;
-                    best.val = val;
-                    best.split1_cnt = split1_cnt;
-                    best.crossed_cnt = crossed_cnt;
+                    ++pid;
+                }
+                else if (src == 1) {
+                    ++split1_w;
+                    ++crossed_w;
+                    ++min_id;
+                }
+                else {
+                    --crossed_w;
+                    ++max_id;
                 }
-                else if (splits_dif > best.val )
-                    // no need to test other positions, val would only get higher
+
+                u32 next_src;
+                f32 next_v = next_value(next_src);
+                if (next_src == 3)
                     break;
+                // equal values can't be separated
+                if (next_v != v) {
+                    int split2_w = total_w-split1_w+crossed_w;
+                    int splits_dif = split1_w - split2_w;
+                    f32 val = abs(splits_dif) + crossed_w*Policy::CROSSED_SPLIT_PENALTY_COEF;
+                    val *= range_coeffs[tested_a];
+
+                    bool better_split = (val < best.val)
+                                        || (val == best.val && (i32)tested_a != parent_split);       // prioritize different axis than parent's
+                    if (better_split) {
+                        best.found = true;
+                        best.axis = tested_a;
+                        best.val = val;
+                        best.low_val = v;
+                        best.high_val = next_v;
+                        best.split1_w = split1_w;
+                        best.crossed_w = crossed_w;
+                    }
+                    else if (splits_dif > best.val)
+                        // no need to test other positions, val would only get higher
+                        break;
+                }
+                v = next_v;
+                src = next_src;
             }
         }
 
-        u32 split1_boxes_cnt = best.split1_cnt;
-        u32 split2_boxes_cnt = boxes_count - best.split1_cnt +best.crossed_cnt;
+        if (!best.found) {
+            // all endpoints have equal values on each axis
+            dout("splitting: skipped - no position separates endpoints" << std::endl);
+            return;
+        }
 
-        f32 split_val = (points_[best.axis][best.i].getValue() + points_[best.axis][best.i+1].getValue())/2;
+        u32 split1_w = best.split1_w;
+        u32 split2_w = total_w - best.split1_w + best.crossed_w;
 
-        dout("splitting: VAL=" << split_val << ", F=" << best.split1_cnt << ", S=" << (boxes_count - best.split1_cnt +best.crossed_cnt) << ", C=" << best.crossed_cnt << std::endl);
-        if (split1_boxes_cnt>SAP::MAX_BOXES_IN_SEGMENT || split2_boxes_cnt>SAP::MAX_BOXES_IN_SEGMENT) {
+        f32 split_val = (best.low_val + best.high_val)/2;
+
+        dout("splitting: VAL=" << split_val << ", F=" << split1_w << ", S=" << split2_w << ", C=" << best.crossed_w << std::endl);
+        u32 max_child_w = Policy::MAX_BOXES_IN_SEGMENT*awake_w;
+        if (bulk && total_w*3/4 > max_child_w)
+            // bulk loaded leaf is split in more steps, each must reduce it by some part
+            max_child_w = total_w*3/4;
+        if (split1_w>max_child_w || split2_w>max_child_w) {
             dout(" skipped - would not reduce boxes count." << std::endl);
             return;
         }
 
-        f32 upper_limit;
-        if (getHighBorder((u32)best.axis, upper_limit) && split_val > upper_limit) {
-            //split point is inside some crossed box which is out of this segment (dont split there)
+        // awake box goes to first child when its min is at most best low value and to second one when its max is above it
+        for (u32 a = 0; a < AXES_COUNT; ++a) {
+            flags[a].resize(boxes_count*2);
+        }
+        Points& split_points = points_[best.axis];
+        for (u32 i=0; i<split_points.size(); ++i) {
+            if (split_points.getIsMax(i))
+                continue;
+            Box& b = manager_->boxes_.accItemWithInnerIndex(split_points.getBoxId(i));
+            f32 max_val = split_points.getValue(b.getMaxId(this, best.axis));
+            u8 f = u8(F_GO_TO_SECOND);
+            if (split_points.getValue(i) <= best.low_val)
+                f = (max_val > best.low_val)?u8(F_GO_TO_BOTH):u8(F_GO_TO_FIRST);
+            for (u32 a=0; a<AXES_COUNT; ++a) {
+                flags[a][b.getMinId(this, a)] = f;
+                flags[a][b.getMaxId(this, a)] = f;
+            }
+        }
+
+        f32 lower_limit, upper_limit;
+        if ((getHighBorder((u32)best.axis, upper_limit) && (split_val > upper_limit || (bulk && split_val == upper_limit)))
+            || (bulk && getLowBorder((u32)best.axis, lower_limit) && split_val <= lower_limit)) {
+            //split point is inside some crossed box which is out of this segment (dont split there),
+            // split on border of bulk loaded leaf would leave empty child
             dout(" skipped - split would be outside segment borders" << std::endl);
             return;
         }
 
+        for (u32 i=0; i<points_[0].size(); ++i) {
+            // crossed boxes get one more occurence
+            if (flags[0][i] == F_GO_TO_BOTH && !points_[0].getIsMax(i)) {
+                Box& b = manager_->boxes_.accItemWithInnerIndex(points_[0].getBoxId(i));
+                if (b.getOccurencesCount() >= Policy::MAX_BOX_OCCURENCES) {
+                    dout(" skipped - crossed box is in too many segments" << std::endl);
+                    return;
+                }
+            }
+        }
+        for (u32 i=0; i<sleeping_points_.size(); ++i) {
+            Box& b = manager_->boxes_.accItemWithInnerIndex(sleeping_points_.getBoxId(i));
+            if (b.getMinValue(best.axis) <= split_val && b.getMaxValue(best.axis) >= split_val
+                && b.getOccurencesCount() >= Policy::MAX_BOX_OCCURENCES) {
+                dout(" skipped - crossed box is in too many segments" << std::endl);
+                return;
+            }
+        }
+
         split_value_ = split_val;
         split_axis_ = (u8)best.axis;
+        split_failed_count_ = 0;
+        SAP_STAT(++manager_->overlaps_.stats_.splits);
 
-        children_[0] = new SEG_TYPE(*manager_, this);
-        children_[1] = new SEG_TYPE(*manager_, this);
+        children_[0] = manager_->newSegment_(this);
+        children_[1] = manager_->newSegment_(this);
         children_[0]->setDebugName_();
         children_[1]->setDebugName_();
         children_[0]->calcBorders_();
@@ -766,27 +1140,40 @@ namespace grynca {
 
         for (u32 i=0; i<points_[0].size(); ++i) {
             // remove boxes from splitted segment
-            if (!points_[0][i].getIsMax()) {
-                Box& b = manager_->boxes_.accItemWithInnerIndex(points_[0][i].getBoxId());
+            if (!points_[0].getIsMax(i)) {
+                Box& b = manager_->boxes_.accItemWithInnerIndex(points_[0].getBoxId(i));
                 b.removeOccurence(this);
             }
         }
 
         for (u32 a=0; a<AXES_COUNT; ++a) {
-            children_[0]->points_[a].reserve(split1_boxes_cnt*2);
-            children_[1]->points_[a].reserve(split2_boxes_cnt*2);
+            children_[0]->points_[a].reserve(split1_w/awake_w*2);
+            children_[1]->points_[a].reserve(split2_w/awake_w*2);
 
-            for (u32 i=0; i<best.flags[a].size(); ++i) {
-                if (best.flags[a][i] & F_GO_TO_FIRST) {
+            for (u32 i=0; i<flags[a].size(); ++i) {
+                if (flags[a][i] & F_GO_TO_FIRST) {
                     pointToChild_(children_[0], a, i);
                 }
-                if (best.flags[a][i] & F_GO_TO_SECOND) {
+                if (flags[a][i] & F_GO_TO_SECOND) {
                     pointToChild_(children_[1], a, i);
                 }
             }
             points_[a].clear();
             longest_sides_[a].length = 0.0f;
         }
+
+        // sleeping boxes go to children same as in addBoxTree_()
+        for (u32 i=0; i<sleeping_points_.size(); ++i) {
+            u32 box_inner_id = sleeping_points_.getBoxId(i);
+            Box& b = manager_->boxes_.accItemWithInnerIndex(box_inner_id);
+            b.removeOccurence(this);
+            if (b.getMinValue(split_axis_) <= split_value_)
+                children_[0]->addSleepingBox_(b, box_inner_id);
+            if (b.getMaxValue(split_axis_) >= split_value_)
+                children_[1]->addSleepingBox_(b, box_inner_id);
+        }
+        sleeping_points_.clear();
+        sleeping_longest_side_ = SAP::LongestSide();
     }
 
     SEG_TPL
@@ -797,6 +1184,7 @@ namespace grynca {
         std::cout << "merging " << debug_name_ << std::endl;
 #endif
 
+        SAP_STAT(++manager_->overlaps_.stats_.merges);
         Segment* other_child = (removed_child==children_[0])?children_[1]:children_[0];
 
         // move all relevant from other child to this
@@ -825,80 +1213,98 @@ namespace grynca {
 #endif
         }
         else {
+            // swapped -> other child keeps this segment's empty buffers for reuse
             for (u32 a=0; a<AXES_COUNT; ++a) {
-                points_[a] = std::move(other_child->points_[a]);
+                std::swap(points_[a], other_child->points_[a]);
                 longest_sides_[a] = other_child->longest_sides_[a];
             }
+            std::swap(sleeping_points_, other_child->sleeping_points_);
+            sleeping_longest_side_ = other_child->sleeping_longest_side_;
 
             for (u32 i=0; i<points_[0].size(); ++i) {
-                SAP::EndPoint& p = points_[0][i];
-                if (!p.getIsMax()) {
-                    Box& b = manager_->boxes_.accItemWithInnerIndex(p.getBoxId());
+                if (!points_[0].getIsMax(i)) {
+                    Box& b = manager_->boxes_.accItemWithInnerIndex(points_[0].getBoxId(i));
                     b.changeOccurence(other_child, this);
                 }
             }
+            for (u32 i=0; i<sleeping_points_.size(); ++i) {
+                Box& b = manager_->boxes_.accItemWithInnerIndex(sleeping_points_.getBoxId(i));
+                b.changeOccurence(other_child, this);
+            }
         }
 
-        delete other_child;
+        manager_->freeSegment_(other_child);
 
         // move boxes from removed child
         for (u32 i=0; i<removed_child->points_[0].size(); ++i) {
-            SAP::EndPoint& p = removed_child->points_[0][i];
-            if (!p.getIsMax()) {
-                u32 box_inner_id = p.getBoxId();
+            if (!removed_child->points_[0].getIsMax(i)) {
+                u32 box_inner_id = removed_child->points_[0].getBoxId(i);
                 Box& b = manager_->boxes_.accItemWithInnerIndex(box_inner_id);
                 b.removeOccurence(removed_child);
-
-                fast_vector<Segment*> segs{this};
-                while (!segs.empty()) {
-                    Segment *s = segs.back();
-                    segs.pop_back();
-
-                    if (!s->isSplit()) {
-                        if (b.findOccurence(s) == InvalidId()) {
-                            s->addBoxInner_(b, box_inner_id);
-                        }
-                    }
-                    else if (b.getMaxValue(s->getSplitAxis()) < s->getSplitValue()) {
-                        // put to first
-                        segs.push_back(s->getChild(0));
-                    }
-                    else if (b.getMinValue(s->getSplitAxis()) > s->getSplitValue()) {
-                        // put to second
-                        segs.push_back(s->getChild(1));
+                addBoxTree_(b.bounds_, [&b, box_inner_id](Segment* s) {
+                    if (b.findOccurence(s) == InvalidId()) {
+                        s->addBoxInner_(b, box_inner_id);
                     }
-                    else {
-                        // put to both
-                        segs.push_back(s->getChild(0));
-                        segs.push_back(s->getChild(1));
-                    }
-                }
+                });
             }
         }
 
-        delete removed_child;
+        for (u32 i=0; i<removed_child->sleeping_points_.size(); ++i) {
+            u32 box_inner_id = removed_child->sleeping_points_.getBoxId(i);
+            Box& b = manager_->boxes_.accItemWithInnerIndex(box_inner_id);
+            b.removeOccurence(removed_child);
+            addBoxTree_(b.bounds_, [&b, box_inner_id](Segment* s) {
+                if (b.findOccurence(s) == InvalidId()) {
+                    s->addSleepingBox_(b, box_inner_id);
+                }
+            });
+        }
 
-        // recalc borders for subtree
-        fast_vector<Segment*> segs{this};
-        while (!segs.empty()) {
-            Segment *s = segs.back();
-            segs.pop_back();
+        manager_->freeSegment_(removed_child);
 
-            s->calcBorders_();
-            if (s->isSplit()) {
-                segs.push_back(s->getChild(0));
-                segs.push_back(s->getChild(1));
-            }
-        }
+        calcBordersRec_();
+    }
+
+    SEG_TPL
+    inline bool SEG_TYPE::needsSplit_() {
+        u32 boxes_count = getWeightedBoxesCount_();
+        if (isSplit() || boxes_count <= Policy::MAX_BOXES_IN_SEGMENT)
+            return false;
+        // failed split is retried only when content changed enough
+        return !split_failed_count_
+               || boxes_count >= split_failed_count_ + Policy::SPLIT_RETRY_BOXES
+               || boxes_count + Policy::SPLIT_RETRY_BOXES <= split_failed_count_;
+    }
+
+    SEG_TPL
+    inline bool SEG_TYPE::needsMerge_() {
+        static_assert(Policy::MERGE_HYSTERESIS < Policy::MAX_BOXES_IN_SEGMENT, "MERGE_HYSTERESIS must be < MAX_BOXES_IN_SEGMENT");
+        if (isSplit() || !parent_ || getWeightedBoxesCount_() >= Policy::MIN_BOXES_IN_SEGMENT)
+            return false;
+        Segment* sn = getSplitNeighbor();
+        if (sn->isSplit())
+            return true;
+        // boxes in both leafs are counted twice -> may skip merge that would be ok
+        return getWeightedBoxesCount_() + sn->getWeightedBoxesCount_() <= Policy::MAX_BOXES_IN_SEGMENT - Policy::MERGE_HYSTERESIS;
+    }
+
+    SEG_TPL
+    inline void SEG_TYPE::splitIfNeeded_() {
+        if (!needsSplit_())
+            return;
+        if (manager_->deferred_maintenance_)
+            manager_->scheduleMaintenance_(this);
+        else
+            split_();
     }
 
     SEG_TPL
     inline void SEG_TYPE::pointToChild_(Segment* child, u32 a, u32 point_id) {
-        SAP::EndPoint& p = points_[a][point_id];
+        SAP::EndPoint p = points_[a].get(point_id);
         Box& b = manager_->boxes_.accItemWithInnerIndex(p.getBoxId());
 
         u32 child_point_id = child->points_[a].size();
-        child->points_[a].push_back(p);
+        child->points_[a].pushBack(p);
         b.setEndPointId(child, a, child_point_id, p.getIsMax());
         if (p.getIsMax()) {
             f32 side_len = p.getValue() - b.getMinValue(a);
@@ -909,6 +1315,43 @@ namespace grynca {
         }
     }
 
+    SEG_TPL
+    inline void SEG_TYPE::writeSnapshot_(SAP::SnapshotWriter& w) {
+        w.write(split_axis_);
+        w.write(split_value_);
+        w.write(u8(maintenance_queued_));
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            points_[a].writeSnapshot(w);
+            w.write(longest_sides_[a]);
+        }
+        sleeping_points_.writeSnapshot(w);
+        w.write(sleeping_longest_side_);
+    }
+
+    SEG_TPL
+    inline bool SEG_TYPE::readSnapshot_(SAP::SnapshotReader& r, const fast_vector<u32>& box_ids_map) {
+        // longest side may refer to already removed box (length is then only conservative)
+        auto map_longest_side = [&box_ids_map](SAP::LongestSide& ls) {
+            ls.box_id = (ls.box_id < box_ids_map.size()) ? box_ids_map[ls.box_id] : u32(InvalidId());
+        };
+
+        u8 queued;
+        if (!r.read(split_axis_) || !r.read(split_value_) || !r.read(queued))
+            return false;
+        if (split_axis_ != SAP::InvalidAxis && split_axis_ >= AXES_COUNT)
+            return false;
+        maintenance_queued_ = (queued != 0);
+        for (u32 a=0; a<AXES_COUNT; ++a) {
+            if (!points_[a].readSnapshot(r, box_ids_map) || !r.read(longest_sides_[a]))
+                return false;
+            map_longest_side(longest_sides_[a]);
+        }
+        if (!sleeping_points_.readSnapshot(r, box_ids_map) || !r.read(sleeping_longest_side_))
+            return false;
+        map_longest_side(sleeping_longest_side_);
+        return true;
+    }
+
     SEG_TPL
     inline void SEG_TYPE::setDebugName_() {
 #ifdef DEBUG_BUILD
@@ -929,6 +1372,15 @@ namespace grynca {
         }
     };
 
+    SEG_TPL
+    inline void SEG_TYPE::calcBordersRec_() {
+        calcBorders_();
+        if (isSplit()) {
+            children_[0]->calcBordersRec_();
+            children_[1]->calcBordersRec_();
+        }
+    }
+
     SEG_TPL
     inline bool SEG_TYPE::calcLowBorder_(u32 axis, f32& val) {
         Segment* n = getPrevNeighbor(axis);
@@ -959,7 +1411,12 @@ namespace grynca {
                 return std::min(getChild(0)->findLowestPointRec_(a), getChild(1)->findLowestPointRec_(a));
         }
         // else
-        return points_[a][0].getValue();
+        f32 lowest = points_[a].empty()?std::numeric_limits<f32>::max():points_[a].getValue(0);
+        for (u32 i=0; i<sleeping_points_.size(); ++i) {
+            Box& b = manager_->boxes_.accItemWithInnerIndex(sleeping_points_.getBoxId(i));
+            lowest = std::min(lowest, b.getMinValue(a));
+        }
+        return lowest;
     }
 
     SEG_TPL
@@ -972,7 +1429,12 @@ namespace grynca {
                 return std::max(getChild(0)->findHighestPointRec_(a), getChild(1)->findHighestPointRec_(a));
         }
         // else
-        return points_[a].back().getValue();
+        f32 highest = points_[a].empty()?-std::numeric_limits<f32>::max():points_[a].getValue(points_[a].size()-1);
+        for (u32 i=0; i<sleeping_points_.size(); ++i) {
+            Box& b = manager_->boxes_.accItemWithInnerIndex(sleeping_points_.getBoxId(i));
+            highest = std::max(highest, b.getMaxValue(a));
+        }
+        return highest;
     }
 
 }
@@ -0,0 +1,104 @@
+#ifndef SAPTRACE_H
+#define SAPTRACE_H
+
+#include "SAP_internal.h"
+#include <fstream>
+
+namespace grynca {
+
+    namespace SAP {
+        // trace file: "SAPT", u32 version, u32 axes count, then ops (u8 type + payload) in native byte order,
+        // boxes are referenced by their inner ids at recording time
+        enum TraceOpType {
+            toAdd,              // id, filter, bounds
+            toAddStatic,        // id, filter, bounds
+            toAddBoxes,         // count, ids, filters, bounds
+            toRemove,           // id
+            toSleep,            // id
+            toWake,             // id
+            toSetFilter,        // id, filter
+            toUpdate,           // id, bounds
+            toMove,             // id, move vec
+            toUpdateBoxes,      // count, ids, bounds
+            toMoveBoxes,        // count, ids, move vecs
+            toSetFatMargin,     // margin
+            toClear,
+            toFrameEnd,
+            toSetReportFatOverlaps,     // u8 fat
+            toCount
+        };
+
+        static const u32 TRACE_VERSION = 1;
+    }
+
+    // streams manager operations to file (see SAPManagerBase::startRecording())
+    class SAPTraceWriter {
+    public:
+        SAPTraceWriter(u32 axes_count);
+
+        // writes header
+        bool open(const char* path);
+        // false when some write failed
+        bool isGood()const;
+
+        void writeAdd(SAP::TraceOpType op, u32 box_id, const f32* bounds, const SAP::CollisionFilter& filter);
+        // filters: boxes_count filters or NULL for default
+        void writeAddBoxes(const Index* box_ids, const f32* bounds, const SAP::CollisionFilter* filters, u32 boxes_count);
+        // remove, sleep, wake
+        void writeBoxOp(SAP::TraceOpType op, u32 box_id);
+        void writeSetFilter(u32 box_id, const SAP::CollisionFilter& filter);
+        // update (bounds) or move (move vec)
+        void writeUpdate(SAP::TraceOpType op, u32 box_id, const f32* bounds_or_move_vec);
+        void writeUpdates(SAP::TraceOpType op, const Index* box_ids, const f32* bounds_or_move_vecs, u32 boxes_count);
+        void writeSetFatMargin(f32 margin);
+        void writeSetReportFatOverlaps(bool fat);
+        void writeOp(SAP::TraceOpType op);
+    private:
+        template <typename T>
+        void write_(const T& v);
+        void writeBytes_(const void* data, size_t size);
+        void writeIds_(const Index* box_ids, u32 boxes_count);
+
+        std::ofstream file_;
+        u32 axes_count_;
+    };
+
+    // drives manager with recorded operations
+    class SAPTraceReader {
+    public:
+        SAPTraceReader();
+
+        // loads whole trace to memory, fails for missing file or wrong header
+        bool open(const char* path);
+        u32 getAxesCount()const;
+        // false when trace ended with truncated or unknown op
+        bool isComplete()const;
+
+        // replays ops up to next frame end, returns false when there are no more ops,
+        // boxes get default client data
+        template <typename Manager>
+        bool replayFrame(Manager& mgr, u32* ops_count_out = NULL);
+    private:
+        template <typename T>
+        bool read_(T& v);
+        bool readBytes_(void* data_out, size_t size);
+        // reads count & ids and maps them to ids in replaying manager
+        bool readIds_(u32& count_out);
+        template <typename Manager>
+        bool replayOp_(Manager& mgr, u8 op);
+
+        fast_vector<u8> data_;
+        size_t pos_;
+        u32 axes_count_;
+        bool complete_;
+        fast_vector<Index> ids_;        // replay ids by recorded inner ids
+        // scratch
+        fast_vector<Index> batch_ids_;
+        fast_vector<u32> recorded_ids_;
+        fast_vector<f32> floats_;
+        fast_vector<SAP::CollisionFilter> filters_;
+    };
+}
+
+#include "SAPTrace.inl"
+#endif //SAPTRACE_H
@@ -0,0 +1,301 @@
+#include "SAPTrace.h"
+#include <cstring>
+
+namespace grynca {
+
+    namespace SAP {
+        static const char TRACE_MAGIC[4] = {'S', 'A', 'P', 'T'};
+    }
+
+    inline SAPTraceWriter::SAPTraceWriter(u32 axes_count)
+     : axes_count_(axes_count)
+    {}
+
+    inline bool SAPTraceWriter::open(const char* path) {
+        file_.open(path, std::ios::binary | std::ios::trunc);
+        if (!file_.is_open())
+            return false;
+        writeBytes_(SAP::TRACE_MAGIC, sizeof(SAP::TRACE_MAGIC));
+        write_(SAP::TRACE_VERSION);
+        write_(axes_count_);
+        return isGood();
+    }
+
+    inline bool SAPTraceWriter::isGood()const {
+        return file_.good();
+    }
+
+    inline void SAPTraceWriter::writeAdd(SAP::TraceOpType op, u32 box_id, const f32* bounds, const SAP::CollisionFilter& filter) {
+        ASSERT(op == SAP::toAdd || op == SAP::toAddStatic);
+        write_(u8(op));
+        write_(box_id);
+        write_(filter);
+        writeBytes_(bounds, axes_count_*2*sizeof(f32));
+    }
+
+    inline void SAPTraceWriter::writeAddBoxes(const Index* box_ids, const f32* bounds, const SAP::CollisionFilter* filters, u32 boxes_count) {
+        write_(u8(SAP::toAddBoxes));
+        writeIds_(box_ids, boxes_count);
+        if (filters) {
+            writeBytes_(filters, boxes_count*sizeof(SAP::CollisionFilter));
+        }
+        else {
+            SAP::CollisionFilter default_filter;
+            for (u32 i=0; i<boxes_count; ++i) {
+                write_(default_filter);
+            }
+        }
+        writeBytes_(bounds, boxes_count*axes_count_*2*sizeof(f32));
+    }
+
+    inline void SAPTraceWriter::writeBoxOp(SAP::TraceOpType op, u32 box_id) {
+        ASSERT(op == SAP::toRemove || op == SAP::toSleep || op == SAP::toWake);
+        write_(u8(op));
+        write_(box_id);
+    }
+
+    inline void SAPTraceWriter::writeSetFilter(u32 box_id, const SAP::CollisionFilter& filter) {
+        write_(u8(SAP::toSetFilter));
+        write_(box_id);
+        write_(filter);
+    }
+
+    inline void SAPTraceWriter::writeUpdate(SAP::TraceOpType op, u32 box_id, const f32* bounds_or_move_vec) {
+        ASSERT(op == SAP::toUpdate || op == SAP::toMove);
+        write_(u8(op));
+        write_(box_id);
+        writeBytes_(bounds_or_move_vec, (op == SAP::toUpdate?2:1)*axes_count_*sizeof(f32));
+    }
+
+    inline void SAPTraceWriter::writeUpdates(SAP::TraceOpType op, const Index* box_ids, const f32* bounds_or_move_vecs, u32 boxes_count) {
+        ASSERT(op == SAP::toUpdateBoxes || op == SAP::toMoveBoxes);
+        write_(u8(op));
+        writeIds_(box_ids, boxes_count);
+        writeBytes_(bounds_or_move_vecs, (op == SAP::toUpdateBoxes?2:1)*boxes_count*axes_count_*sizeof(f32));
+    }
+
+    inline void SAPTraceWriter::writeSetFatMargin(f32 margin) {
+        write_(u8(SAP::toSetFatMargin));
+        write_(margin);
+    }
+
+    inline void SAPTraceWriter::writeSetReportFatOverlaps(bool fat) {
+        write_(u8(SAP::toSetReportFatOverlaps));
+        write_(u8(fat));
+    }
+
+    inline void SAPTraceWriter::writeOp(SAP::TraceOpType op) {
+        ASSERT(op == SAP::toClear || op == SAP::toFrameEnd);
+        write_(u8(op));
+    }
+
+    template <typename T>
+    inline void SAPTraceWriter::write_(const T& v) {
+        writeBytes_(&v, sizeof(T));
+    }
+
+    inline void SAPTraceWriter::writeBytes_(const void* data, size_t size) {
+        file_.write((const char*)data, std::streamsize(size));
+    }
+
+    inline void SAPTraceWriter::writeIds_(const Index* box_ids, u32 boxes_count) {
+        write_(boxes_count);
+        for (u32 i=0; i<boxes_count; ++i) {
+            write_(box_ids[i].getIndex());
+        }
+    }
+
+    inline SAPTraceReader::SAPTraceReader()
+     : pos_(0), axes_count_(0), complete_(true)
+    {}
+
+    inline bool SAPTraceReader::open(const char* path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open())
+            return false;
+        std::streamoff size = file.tellg();
+        if (size < 0)
+            return false;
+        data_.resize(size_t(size));
+        file.seekg(0);
+        if (size && !file.read((char*)data_.data(), size))
+            return false;
+
+        pos_ = 0;
+        complete_ = true;
+        ids_.clear();
+        char magic[sizeof(SAP::TRACE_MAGIC)];
+        u32 version;
+        if (!readBytes_(magic, sizeof(magic)) || memcmp(magic, SAP::TRACE_MAGIC, sizeof(magic)) != 0)
+            return false;
+        if (!read_(version) || version != SAP::TRACE_VERSION)
+            return false;
+        return read_(axes_count_);
+    }
+
+    inline u32 SAPTraceReader::getAxesCount()const {
+        return axes_count_;
+    }
+
+    inline bool SAPTraceReader::isComplete()const {
+        return complete_;
+    }
+
+    template <typename Manager>
+    inline bool SAPTraceReader::replayFrame(Manager& mgr, u32* ops_count_out) {
+        ASSERT_M(axes_count_ == Manager::AXES_COUNT, "Trace recorded with different axes count.");
+        u32 ops_count = 0;
+        bool frame_end = false;
+        while (complete_ && pos_ < data_.size()) {
+            u8 op = data_[pos_++];
+            if (op == SAP::toFrameEnd) {
+                frame_end = true;
+                break;
+            }
+            if (!replayOp_(mgr, op)) {
+                complete_ = false;
+                break;
+            }
+            ++ops_count;
+        }
+        if (ops_count_out)
+            *ops_count_out = ops_count;
+        // frames without ops are still frames
+        return ops_count > 0 || frame_end;
+    }
+
+    template <typename T>
+    inline bool SAPTraceReader::read_(T& v) {
+        return readBytes_(&v, sizeof(T));
+    }
+
+    inline bool SAPTraceReader::readBytes_(void* data_out, size_t size) {
+        if (data_.size() - pos_ < size)
+            return false;
+        memcpy(data_out, &data_[pos_], size);
+        pos_ += size;
+        return true;
+    }
+
+    inline bool SAPTraceReader::readIds_(u32& count_out) {
+        if (!read_(count_out))
+            return false;
+        recorded_ids_.resize(count_out);
+        batch_ids_.resize(count_out);
+        if (!readBytes_(recorded_ids_.data(), count_out*sizeof(u32)))
+            return false;
+        for (u32 i=0; i<count_out; ++i) {
+            if (recorded_ids_[i] >= ids_.size())
+                return false;
+            batch_ids_[i] = ids_[recorded_ids_[i]];
+        }
+        return true;
+    }
+
+    template <typename Manager>
+    inline bool SAPTraceReader::replayOp_(Manager& mgr, u8 op) {
+        typedef typename Manager::BoxDataT BoxDataT;
+
+        const u32 bounds_size = axes_count_*2;
+        u32 id, count;
+        SAP::CollisionFilter filter;
+        switch (op) {
+            case SAP::toAdd:
+            case SAP::toAddStatic: {
+                floats_.resize(bounds_size);
+                if (!read_(id) || !read_(filter) || !readBytes_(floats_.data(), bounds_size*sizeof(f32)))
+                    return false;
+                if (id >= ids_.size())
+                    ids_.resize(id+1);
+                if (op == SAP::toAdd)
+                    mgr.addBox(ids_[id], floats_.data(), BoxDataT(), filter);
+                else
+                    mgr.addStaticBox(ids_[id], floats_.data(), BoxDataT(), filter);
+                return true;
+            }
+            case SAP::toAddBoxes: {
+                if (!read_(count))
+                    return false;
+                recorded_ids_.resize(count);
+                filters_.resize(count);
+                floats_.resize(count*bounds_size);
+                if (!readBytes_(recorded_ids_.data(), count*sizeof(u32))
+                    || !readBytes_(filters_.data(), count*sizeof(SAP::CollisionFilter))
+                    || !readBytes_(floats_.data(), count*bounds_size*sizeof(f32)))
+                    return false;
+                fast_vector<BoxDataT> boxes_data(count);
+                batch_ids_.resize(count);
+                mgr.addBoxes(floats_.data(), boxes_data.data(), count, batch_ids_.data(), filters_.data());
+                for (u32 i=0; i<count; ++i) {
+                    if (recorded_ids_[i] >= ids_.size())
+                        ids_.resize(recorded_ids_[i]+1);
+                    ids_[recorded_ids_[i]] = batch_ids_[i];
+                }
+                return true;
+            }
+            case SAP::toRemove:
+            case SAP::toSleep:
+            case SAP::toWake:
+                if (!read_(id) || id >= ids_.size())
+                    return false;
+                if (op == SAP::toRemove)
+                    mgr.removeBox(ids_[id]);
+                else if (op == SAP::toSleep)
+                    mgr.sleepBox(ids_[id]);
+                else
+                    mgr.wakeBox(ids_[id]);
+                return true;
+            case SAP::toSetFilter:
+                if (!read_(id) || id >= ids_.size() || !read_(filter))
+                    return false;
+                mgr.setCollisionFilter(ids_[id], filter);
+                return true;
+            case SAP::toUpdate:
+            case SAP::toMove: {
+                u32 size = (op == SAP::toUpdate)?bounds_size:axes_count_;
+                floats_.resize(size);
+                if (!read_(id) || id >= ids_.size() || !readBytes_(floats_.data(), size*sizeof(f32)))
+                    return false;
+                if (op == SAP::toUpdate)
+                    mgr.updateBox(ids_[id], floats_.data());
+                else
+                    mgr.moveBox(ids_[id], floats_.data());
+                return true;
+            }
+            case SAP::toUpdateBoxes:
+            case SAP::toMoveBoxes: {
+                if (!readIds_(count))
+                    return false;
+                u32 size = count*((op == SAP::toUpdateBoxes)?bounds_size:axes_count_);
+                floats_.resize(size);
+                if (!readBytes_(floats_.data(), size*sizeof(f32)))
+                    return false;
+                if (op == SAP::toUpdateBoxes)
+                    mgr.updateBoxes(batch_ids_.data(), floats_.data(), count);
+                else
+                    mgr.moveBoxes(batch_ids_.data(), floats_.data(), count);
+                return true;
+            }
+            case SAP::toSetFatMargin: {
+                f32 margin;
+                if (!read_(margin))
+                    return false;
+                mgr.setFatMargin(margin);
+                return true;
+            }
+            case SAP::toSetReportFatOverlaps: {
+                u8 fat;
+                if (!read_(fat))
+                    return false;
+                mgr.setReportFatOverlaps(fat != 0);
+                return true;
+            }
+            case SAP::toClear:
+                mgr.clear();
+                ids_.clear();
+                return true;
+            default:
+                return false;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef SAPWORKERPOOL_H
+#define SAPWORKERPOOL_H
+
+#include "types/Type.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+namespace grynca {
+
+    // persistent threads for parallel batch updates
+    class SAPWorkerPool {
+    public:
+        // workers_count includes calling thread
+        SAPWorkerPool(u32 workers_count);
+        ~SAPWorkerPool();
+
+        u32 getWorkersCount()const;
+
+        // runs job on all workers (calling thread is worker 0), returns when all are finished
+        // void job(u32 worker_id)
+        template <typename Job>
+        void run(const Job& job);
+
+    private:
+        template <typename Job>
+        static void callJob_(const void* job, u32 worker_id);
+        void workerLoop_(u32 worker_id);
+
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable start_cv_;
+        std::condition_variable done_cv_;
+
+        void (*job_fn_)(const void*, u32);
+        const void* job_;
+        u32 generation_;
+        u32 running_;
+        bool quit_;
+    };
+
+}
+
+#include "SAPWorkerPool.inl"
+#endif //SAPWORKERPOOL_H
@@ -0,0 +1,86 @@
+#include "SAPWorkerPool.h"
+
+namespace grynca {
+
+    inline SAPWorkerPool::SAPWorkerPool(u32 workers_count)
+     : job_fn_(NULL), job_(NULL), generation_(0), running_(0), quit_(false)
+    {
+        ASSERT(workers_count > 0);
+        threads_.reserve(workers_count-1);
+        for (u32 i=1; i<workers_count; ++i) {
+            threads_.emplace_back(&SAPWorkerPool::workerLoop_, this, i);
+        }
+    }
+
+    inline SAPWorkerPool::~SAPWorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        start_cv_.notify_all();
+        for (u32 i=0; i<threads_.size(); ++i) {
+            threads_[i].join();
+        }
+    }
+
+    inline u32 SAPWorkerPool::getWorkersCount()const {
+        return u32(threads_.size()) + 1;
+    }
+
+    template <typename Job>
+    inline void SAPWorkerPool::run(const Job& job) {
+        if (threads_.empty()) {
+            job(0);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_fn_ = &callJob_<Job>;
+            job_ = &job;
+            running_ = u32(threads_.size());
+            ++generation_;
+        }
+        start_cv_.notify_all();
+
+        job(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return running_ == 0; });
+        job_fn_ = NULL;
+        job_ = NULL;
+    }
+
+    template <typename Job>
+    inline void SAPWorkerPool::callJob_(const void* job, u32 worker_id) {
+    //static
+        (*(const Job*)job)(worker_id);
+    }
+
+    inline void SAPWorkerPool::workerLoop_(u32 worker_id) {
+        u32 done_generation = 0;
+        for (;;) {
+            void (*job_fn)(const void*, u32);
+            const void* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                start_cv_.wait(lock, [this, done_generation]() { return quit_ || generation_ != done_generation; });
+                if (quit_)
+                    return;
+                done_generation = generation_;
+                job_fn = job_fn_;
+                job = job_;
+            }
+
+            job_fn(job, worker_id);
+
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                last = (--running_ == 0);
+            }
+            if (last)
+                done_cv_.notify_one();
+        }
+    }
+}
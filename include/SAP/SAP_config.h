@@ -5,15 +5,33 @@
 
 //#define SAP_VALIDATE_ALL_THE_TIME
 //#define SAP_VALIDATE_OVERLAPS
+// endpoint ids in box occurences are not kept up to date when points shift (no O(n) fixups on insert/remove),
+// they are resolved with bisect on box bounds when needed (slower with many equal endpoint values)
+//#define SAP_LAZY_ENDPOINT_IDS
+// compiles out counters of SAP::Stats (SAPManagerBase::getStats() then reports only tree gauges)
+//#define SAP_NO_STATS
 
 namespace grynca{
 
     namespace SAP {
-        static const u32 MAX_BOXES_IN_SEGMENT = 100;
-        static const u32 MIN_BOXES_IN_SEGMENT = 20;
-        static const f32 CROSSED_SPLIT_PENALTY_COEF = 20.0f;
-        static const u32 PM_INITIAL_SIZE = 1024;   // must be 2^x
-        static const u32 MAX_BOX_OCCURENCES = 8;
+        // tuning constants carried by domain (see SAP_domain.h),
+        // custom policy can derive from this one and override some of them
+        struct DefaultPolicy {
+            static constexpr u32 MAX_BOXES_IN_SEGMENT = 100;
+            static constexpr u32 MIN_BOXES_IN_SEGMENT = 20;
+            // under-full leaf is merged only when merged leaf would have at most MAX_BOXES_IN_SEGMENT - MERGE_HYSTERESIS boxes,
+            // so boxes hovering around split border don't cause repeated split/merge (must be < MAX_BOXES_IN_SEGMENT)
+            static constexpr u32 MERGE_HYSTERESIS = 10;
+            // leaf that could not be split (e.g. boxes with equal bounds) is tried again only after its boxes count
+            // changed by this much (not on each added box or frame)
+            static constexpr u32 SPLIT_RETRY_BOXES = 10;
+            // sleeping box counts as 1/SLEEPING_BOXES_PER_BOX of awake box in split & merge criteria (it costs only
+            // queries of awake boxes), so leaf with dense static clutter is split too
+            static constexpr u32 SLEEPING_BOXES_PER_BOX = 4;
+            static constexpr f32 CROSSED_SPLIT_PENALTY_COEF = 20.0f;
+            static constexpr u32 PM_INITIAL_SIZE = 1024;   // must be 2^x
+            static constexpr u32 MAX_BOX_OCCURENCES = 8;
+        };
     }
 
 }
@@ -7,9 +7,12 @@
     static constexpr u32 AXES_COUNT = DOMAIN::AXES_COUNT; \
     typedef typename DOMAIN::BoxDataT BoxDataT; \
     typedef typename DOMAIN::OverlapDataT OverlapDataT; \
+    typedef typename DOMAIN::PointsT Points; \
+    typedef typename DOMAIN::PolicyT Policy; \
     typedef SAPManagerBase<DOMAIN> Manager; \
     typedef SAPSegment<DOMAIN> Segment; \
     typedef SAPRaycaster<DOMAIN> Raycaster; \
+    typedef SAPReadView<DOMAIN> ReadView; \
     typedef SAP::SAPBox<DOMAIN> Box;
 
 namespace grynca {
@@ -18,20 +21,28 @@ namespace grynca {
     template <typename> class SAPManagerBase;
     template <typename> class SAPSegment;
     template <typename> class SAPRaycaster;
-    namespace SAP { template <typename> class SAPBox; }
+    template <typename> class SAPReadView;
+    namespace SAP { template <typename> class SAPBox; class PointsAoS; class PointsSoA; struct DefaultPolicy; }
 
-    template <typename BoxData, typename OverlapData = DummyType>
+    // PointsLayout: SAP::PointsAoS (default) or SAP::PointsSoA (endpoint values and box ids in separate arrays)
+    // Policy: tuning constants (see SAP::DefaultPolicy in SAP_config.h)
+
+    template <typename BoxData, typename OverlapData = DummyType, typename PointsLayout = SAP::PointsAoS, typename Policy = SAP::DefaultPolicy>
     struct SAPDomain2D {
         enum { AXES_COUNT = 2 };
         typedef BoxData BoxDataT;
         typedef OverlapData OverlapDataT;
+        typedef PointsLayout PointsT;
+        typedef Policy PolicyT;
     };
 
-    template <typename BoxData, typename OverlapData = DummyType>
+    template <typename BoxData, typename OverlapData = DummyType, typename PointsLayout = SAP::PointsAoS, typename Policy = SAP::DefaultPolicy>
     struct SAPDomain3D {
         enum { AXES_COUNT = 3 };
         typedef BoxData BoxDataT;
         typedef OverlapData OverlapDataT;
+        typedef PointsLayout PointsT;
+        typedef Policy PolicyT;
     };
 }
 
@@ -3,9 +3,12 @@
 
 #include <stdint.h>
 #include <bitset>
+#include <ostream>
+#include <type_traits>
 #include "types/containers/HashMap.h"
 #include "SAP_config.h"
 #include "SAP_domain.h"
+#include "SAP_simd.h"
 
 namespace grynca {
 
@@ -13,31 +16,199 @@ namespace grynca {
 
         static const u8 InvalidAxis = u8(-1);
 
+#ifdef SAP_NO_STATS
+#   define SAP_STAT(STATEMENT)
+#else
+#   define SAP_STAT(STATEMENT) STATEMENT
+#endif
+
+        static const u32 SNAPSHOT_VERSION = 1;
+
+        // binary snapshot streams (native byte order, see SAPManagerBase::saveSnapshot())
+        class SnapshotWriter {
+        public:
+            SnapshotWriter(std::ostream& os);
+
+            template <typename T>
+            void write(const T& v);
+            void write(const void* data, size_t size);
+            bool isGood()const;
+        private:
+            std::ostream& os_;
+        };
+
+        // reads from memory (single bulk read or mmapped file), all reads are bounds checked
+        class SnapshotReader {
+        public:
+            SnapshotReader(const void* data, size_t size);
+
+            template <typename T>
+            bool read(T& v_out);
+            bool read(void* data_out, size_t size);
+            // pointer to next size bytes (may be unaligned), NULL when there is not enough data
+            const u8* skip(size_t size);
+        private:
+            const u8* data_;
+            size_t size_;
+            size_t pos_;
+        };
+
+        // client data are stored only when trivially copyable (default constructed otherwise)
+        template <typename T, bool = std::is_trivially_copyable<T>::value>
+        struct SnapshotData {
+            static u32 getSize() { return 0; }
+            static void write(SnapshotWriter&, const T&) {}
+            static bool read(SnapshotReader&, T&) { return true; }
+        };
+
+        template <typename T>
+        struct SnapshotData<T, true> {
+            static u32 getSize() { return sizeof(T); }
+            static void write(SnapshotWriter& w, const T& v) { w.write(v); }
+            static bool read(SnapshotReader& r, T& v) { return r.read(v); }
+        };
+
         class EndPoint {
         public:
             EndPoint(u32 box_id, bool is_max, f32 value);
 
-            u32 getIsMax();
+            u32 getIsMax()const;
             void setIsMax(bool v);
 
-            u32 getBoxId();
+            u32 getBoxId()const;
 
-            f32 getValue();
+            f32 getValue()const;
             void setValue(f32 v);
-            u32 getPackData();
+            u32 getPackData()const;
 
             static bool compareDesc(EndPoint& ep1, EndPoint& ep2);
+            static bool compareAsc(EndPoint& ep1, EndPoint& ep2);     // min points before max points on equal values
 
         private:
             u32 pack_data_;        // 1b isMax, 31b boxId
             f32 value_;
         };
 
+        // endpoints of one axis sorted from low to high,
+        // layouts are selectable with domain (see SAP_domain.h)
+
+        // interleaved box ids and values
+        class PointsAoS {
+        public:
+            u32 size()const;
+            bool empty()const;
+            void reserve(u32 n);
+            void clear();
+            u32 getMemoryUsage()const;     // bytes
+
+            f32 getValue(u32 id)const;
+            void setValue(u32 id, f32 v);
+            u32 getBoxId(u32 id)const;
+            u32 getIsMax(u32 id)const;
+            EndPoint get(u32 id)const;
+
+            void insert(u32 id, const EndPoint& ep);
+            void erase(u32 id);
+            void pushBack(const EndPoint& ep);
+            // moves point to new position, points in between are shifted by one
+            void movePoint(u32 from_id, u32 to_id);
+            void sort();
+            // first id with value >= val (bisect), size() when none
+            u32 lowerBound(f32 val)const;
+            // first id with value > val (bisect), size() when none
+            u32 upperBound(f32 val)const;
+
+            // scans (SIMD kernels from SAP_simd.h)
+            // first id >= from with value >= val, size() when none
+            u32 findFirstGreaterEq(u32 from, f32 val)const;
+            // first id >= from with value > val, size() when none
+            u32 findFirstGreater(u32 from, f32 val)const;
+            // last id < to with value <= val, -1 when none
+            i32 findLastLessEq(u32 to, f32 val)const;
+            // last id < to with value < val, -1 when none
+            i32 findLastLess(u32 to, f32 val)const;
+            // last id in [1, to) with origin-value > dist, 0 when none
+            u32 findLastFurther(u32 to, f32 origin, f32 dist)const;
+            // appends box ids of min points in [from, to)
+            void gatherMinBoxIds(u32 from, u32 to, fast_vector<u32>& ids_out)const;
+
+            // count, values, pack data (same for both layouts),
+            // box ids are mapped with box_ids_map when read (fails for unmapped ones)
+            void writeSnapshot(SnapshotWriter& w)const;
+            bool readSnapshot(SnapshotReader& r, const fast_vector<u32>& box_ids_map);
+        private:
+            const f32* rawData_()const;
+
+            fast_vector<EndPoint> points_;
+        };
+
+        // separate contiguous arrays for values and box ids (value scans touch only values)
+        class PointsSoA {
+        public:
+            u32 size()const;
+            bool empty()const;
+            void reserve(u32 n);
+            void clear();
+            u32 getMemoryUsage()const;     // bytes
+
+            f32 getValue(u32 id)const;
+            void setValue(u32 id, f32 v);
+            u32 getBoxId(u32 id)const;
+            u32 getIsMax(u32 id)const;
+            EndPoint get(u32 id)const;
+
+            void insert(u32 id, const EndPoint& ep);
+            void erase(u32 id);
+            void pushBack(const EndPoint& ep);
+            // moves point to new position, points in between are shifted by one
+            void movePoint(u32 from_id, u32 to_id);
+            void sort();
+            // first id with value >= val (bisect), size() when none
+            u32 lowerBound(f32 val)const;
+            // first id with value > val (bisect), size() when none
+            u32 upperBound(f32 val)const;
+
+            // scans (SIMD kernels from SAP_simd.h)
+            // first id >= from with value >= val, size() when none
+            u32 findFirstGreaterEq(u32 from, f32 val)const;
+            // first id >= from with value > val, size() when none
+            u32 findFirstGreater(u32 from, f32 val)const;
+            // last id < to with value <= val, -1 when none
+            i32 findLastLessEq(u32 to, f32 val)const;
+            // last id < to with value < val, -1 when none
+            i32 findLastLess(u32 to, f32 val)const;
+            // last id in [1, to) with origin-value > dist, 0 when none
+            u32 findLastFurther(u32 to, f32 origin, f32 dist)const;
+            // appends box ids of min points in [from, to)
+            void gatherMinBoxIds(u32 from, u32 to, fast_vector<u32>& ids_out)const;
+
+            // count, values, pack data (same for both layouts),
+            // box ids are mapped with box_ids_map when read (fails for unmapped ones)
+            void writeSnapshot(SnapshotWriter& w)const;
+            bool readSnapshot(SnapshotReader& r, const fast_vector<u32>& box_ids_map);
+        private:
+            const f32* rawValues_()const;
+            const u32* rawPackData_()const;
+
+            fast_vector<f32> values_;
+            fast_vector<u32> pack_data_;        // 1b isMax, 31b boxId
+        };
+
+        // shared by both points layouts
+        // first id with value >= val (> val when !OR_EQUAL) (bisect), size() when none
+        template <bool OR_EQUAL, typename Points>
+        u32 lowerBoundPoints(const Points& ps, f32 val);
+        // id of box's end point, value is its stored value (run of equal values is scanned),
+        //  whole points are scanned when it doesn't match (e.g. NaN bounds), box must have point there
+        template <typename Points>
+        u32 findPointId(const Points& ps, u32 box_id, u32 is_max, f32 val);
+
         struct CollPair {
             CollPair();
             CollPair(u32 i1, u32 i2);
 
             bool operator==(const CollPair& cp)const;
+            bool operator<(const CollPair& cp)const;
 
             struct Hasher {
                 u32 operator()(const CollPair& cp)const;
@@ -52,6 +223,86 @@ namespace grynca {
             };
         };
 
+        // boxes collide when category of each is in mask of other (default: everything collides)
+        struct CollisionFilter {
+            CollisionFilter();
+            CollisionFilter(u32 cat, u32 msk);
+
+            bool canCollide(const CollisionFilter& f)const;
+
+            u32 category;
+            u32 mask;
+        };
+
+        // contiguous read-only range
+        template <typename T>
+        struct Span {
+            Span(const T* d, u32 s) : data(d), size(s) {}
+
+            const T* begin()const { return data; }
+            const T* end()const { return data+size; }
+            const T& operator[](u32 id)const { return data[id]; }
+            bool empty()const { return size == 0; }
+
+            const T* data;
+            u32 size;
+        };
+
+        struct OverlapPair {
+            Index box1_id;
+            Index box2_id;
+        };
+
+        struct OverlapEvents {
+            OverlapEvents() : enabled_(false), dirty_(false) {}
+
+            struct Record {
+                OverlapPair pair;       // ordered by inner ids
+                bool began;
+
+                // by pair, versions differ when inner id was reused
+                static bool compare(const Record& r1, const Record& r2);
+                bool samePair(const Record& r)const;
+            };
+
+            void record(Index b1_id, Index b2_id, bool began);
+            // computes began & ended pairs from records (in order of records for each pair)
+            void resolve();
+            void clear();
+
+            bool enabled_;
+            bool dirty_;
+            fast_vector<Record> records_;
+            fast_vector<OverlapPair> began_;
+            fast_vector<OverlapPair> ended_;
+        };
+
+        // counters are accumulated since SAPManagerBase::resetStats() (see SAP_NO_STATS),
+        // gauges are computed by SAPManagerBase::getStats()
+        struct Stats {
+            Stats();
+
+            void reset();
+            // adds counters of other
+            void add(const Stats& s);
+
+            u64 endpoint_swaps[3];      // per axis
+            u64 candidates;             // candidate pairs from endpoint swaps
+            u64 overlap_tests;          // box vs. box tests
+            u64 overlap_hits;
+            u64 pairs_added;
+            u64 pairs_removed;
+            u64 crossings;              // boxes crossing segment borders
+            u64 splits;
+            u64 merges;
+
+            u32 segments_count;
+            u32 leafs_count;
+            u32 max_leaf_boxes;
+            u32 tree_depth;
+            u64 bytes_allocated;        // approximate (segments, endpoints, boxes, pairs)
+        };
+
         struct MinMax {
             u32& accMin() { return v[0]; }
             u32& accMax() { return v[1]; }
@@ -78,9 +329,15 @@ namespace grynca {
             const BoxDataT& getClientData()const;
             BoxDataT& accClientData();
 
+            // bounds as set by client
             const f32* getBounds()const;
+            // bounds enlarged with fat margin (stored in segments, same as tight bounds without margin)
+            const f32* getFatBounds()const;
+            // fat bounds
             f32 getMinValue(u32 a);
             f32 getMaxValue(u32 a);
+            // static or put to sleep (see SAPManagerC::sleepBox())
+            bool isSleeping()const;
         protected:
             friend Segment;
             friend Manager;
@@ -93,6 +350,8 @@ namespace grynca {
             u32 getOccurencesCount();
             Occurence& getOccurence(u32 id);
             u32 findOccurence(Segment* segment);
+            // occurence without endpoint ids (sleeping box)
+            void addOccurence(Segment* segment);
             void removeOccurence(u32 id);
             void removeOccurence(Segment* segment);
             void changeOccurence(Segment* old_seg, Segment* new_seg);
@@ -102,24 +361,71 @@ namespace grynca {
             u32 getMaxId(Segment* segment, u32 a);
             void getMinsMaxs(Segment* segment, MinMax* mins_maxs_out);
 
-            f32 bounds_[2*AXES_COUNT];
+            f32 bounds_[2*AXES_COUNT];          // fat
+            f32 tight_bounds_[2*AXES_COUNT];
             BoxDataT client_data_;
-            Occurence occurences_[SAP::MAX_BOX_OCCURENCES];
+            Occurence occurences_[Policy::MAX_BOX_OCCURENCES];
             u32 occurences_count_;
+            bool sleeping_;
         };
 
-        template <typename ClientDataCollision>
-        struct Overlaps {
-            Overlaps() : pm(PM_INITIAL_SIZE) {}
-
-            // temp ids
+        // temp ids of boxes found during update of single box
+        struct Candidates {
             fast_vector<u32> possibly_added_;
             fast_vector<u32> removed_;
+#ifndef SAP_NO_STATS
+            Stats stats_;       // of thread filling these candidates
+#endif
+        };
+
+        // overlapping pair is node in two doubly linked lists (one for each box of pair)
+        template <typename OverlapData>
+        class Adjacency {
+        public:
+            struct Node {
+                OverlapData data;
+                u32 box_ids[2];     // inner ids
+                u32 prev[2];        // for each box of pair
+                u32 next[2];
+            };
 
-            HashMap<ClientDataCollision, CollPair, CollPair::Hasher> pm;
+            // returns node id, node's data is default constructed
+            u32 addPair(u32 b1_inner_id, u32 b2_inner_id);
+            void removePair(u32 node_id);
+            Node& accNode(u32 node_id);
+            const Node& getNode(u32 node_id)const;
+
+            u32 getMemoryUsage()const;     // bytes
+
+            // iteration over box's pairs, returns InvalidId() at the end
+            u32 getFirst(u32 box_inner_id)const;
+            u32 getNext(u32 node_id, u32 box_inner_id)const;
+            u32 getOther(u32 node_id, u32 box_inner_id)const;
+            u32 getCount(u32 box_inner_id)const;
+
+            void clear();
+        private:
+            u32 getSide_(const Node& n, u32 box_inner_id)const;
+
+            fast_vector<Node> nodes_;
+            fast_vector<u32> free_nodes_;
+            fast_vector<u32> firsts_;       // indexed by box inner id
+            fast_vector<u32> counts_;
         };
 
-        typedef fast_vector<EndPoint> Points;
+        template <typename ClientDataCollision, typename Policy>
+        struct Overlaps : public Candidates {
+            Overlaps() : pm(Policy::PM_INITIAL_SIZE), fat_pm(Policy::PM_INITIAL_SIZE) {}
+
+            // candidates gathered during batch update (both added & removed)
+            fast_vector<CollPair> candidate_pairs_;
+
+            HashMap<u32, CollPair, CollPair::Hasher> pm;     // node ids in adjacency
+            Adjacency<ClientDataCollision> adjacency;
+            // pairs overlapping on fat bounds, kept only when tight pairs are reported (pm pairs are their subset)
+            HashMap<u32, CollPair, CollPair::Hasher> fat_pm;     // node ids in fat_adjacency
+            Adjacency<u8> fat_adjacency;
+        };
     }
 }
 
@@ -1,12 +1,103 @@
 #include "SAP_internal.h"
 #include "SAPSegment.h"
+#include <algorithm>
+#include <cstring>
 
 #define BOX_TPL template <typename SAPDomain>
 #define BOX_TYPE SAPBox<SAPDomain>
+#define ADJ_TPL template <typename OverlapData>
+#define ADJ_TYPE Adjacency<OverlapData>
 
 namespace grynca {
     namespace SAP {
 
+        static const char SNAPSHOT_MAGIC[4] = {'S', 'A', 'P', 'S'};
+
+        inline SnapshotWriter::SnapshotWriter(std::ostream& os)
+         : os_(os)
+        {}
+
+        template <typename T>
+        inline void SnapshotWriter::write(const T& v) {
+            write(&v, sizeof(T));
+        }
+
+        inline void SnapshotWriter::write(const void* data, size_t size) {
+            if (size)
+                os_.write((const char*)data, std::streamsize(size));
+        }
+
+        inline bool SnapshotWriter::isGood()const {
+            return os_.good();
+        }
+
+        inline SnapshotReader::SnapshotReader(const void* data, size_t size)
+         : data_((const u8*)data), size_(size), pos_(0)
+        {}
+
+        template <typename T>
+        inline bool SnapshotReader::read(T& v_out) {
+            return read(&v_out, sizeof(T));
+        }
+
+        inline bool SnapshotReader::read(void* data_out, size_t size) {
+            const u8* src = skip(size);
+            if (!src)
+                return false;
+            if (size)
+                memcpy(data_out, src, size);
+            return true;
+        }
+
+        inline const u8* SnapshotReader::skip(size_t size) {
+            if (size_ - pos_ < size)
+                return NULL;
+            const u8* rslt = data_ + pos_;
+            pos_ += size;
+            return rslt;
+        }
+
+        // maps box id in endpoint's pack data, false when unmapped
+        static inline bool mapSnapshotPackData(u32& pack_data, const fast_vector<u32>& box_ids_map) {
+            u32 box_id = pack_data & ~(1u<<31);
+            if (box_id >= box_ids_map.size() || box_ids_map[box_id] == InvalidId())
+                return false;
+            pack_data = (pack_data & (1u<<31)) | box_ids_map[box_id];
+            return true;
+        }
+
+        template <bool OR_EQUAL, typename Points>
+        inline u32 lowerBoundPoints(const Points& ps, f32 val) {
+            u32 from = 0;
+            u32 count = ps.size();
+            while (count) {
+                u32 step = count/2;
+                if (OR_EQUAL ? ps.getValue(from+step) < val : ps.getValue(from+step) <= val) {
+                    from += step+1;
+                    count -= step+1;
+                }
+                else {
+                    count = step;
+                }
+            }
+            return from;
+        }
+
+        template <typename Points>
+        inline u32 findPointId(const Points& ps, u32 box_id, u32 is_max, f32 val) {
+            for (u32 i=lowerBoundPoints<true>(ps, val); i<ps.size() && ps.getValue(i) == val; ++i) {
+                if (ps.getBoxId(i) == box_id && ps.getIsMax(i) == is_max)
+                    return i;
+            }
+            for (u32 i=0; i<ps.size(); ++i) {
+                if (ps.getBoxId(i) == box_id && ps.getIsMax(i) == is_max)
+                    return i;
+            }
+            ASSERT_M(false, "End point not found");
+            // unreachable, box has occurence in points' segment
+            return 0;
+        }
+
         inline EndPoint::EndPoint(u32 box_id, bool is_max, f32 value)
          : pack_data_(box_id), value_(value)
         {
@@ -14,7 +105,7 @@ namespace grynca {
             setIsMax(is_max);
         }
 
-        inline u32 EndPoint::getIsMax() {
+        inline u32 EndPoint::getIsMax()const {
             return (pack_data_>>31)&1;
         }
 
@@ -22,11 +113,11 @@ namespace grynca {
             pack_data_ = SET_BITV(pack_data_, 31, v);
         }
 
-        inline u32 EndPoint::getBoxId() {
+        inline u32 EndPoint::getBoxId()const {
             return pack_data_ & ~(1<<31);
         }
 
-        inline f32 EndPoint::getValue() {
+        inline f32 EndPoint::getValue()const {
             return value_;
         }
 
@@ -34,7 +125,7 @@ namespace grynca {
             value_ = v;
         }
 
-        inline u32 EndPoint::getPackData() {
+        inline u32 EndPoint::getPackData()const {
             return pack_data_;
         }
 
@@ -43,6 +134,320 @@ namespace grynca {
             return ep1.getValue()>ep2.getValue();
         }
 
+        inline bool EndPoint::compareAsc(EndPoint& ep1, EndPoint& ep2) {
+        //static
+            if (ep1.getValue() != ep2.getValue())
+                return ep1.getValue()<ep2.getValue();
+            return ep1.getIsMax()<ep2.getIsMax();
+        }
+
+        inline u32 PointsAoS::size()const {
+            return u32(points_.size());
+        }
+
+        inline bool PointsAoS::empty()const {
+            return points_.empty();
+        }
+
+        inline void PointsAoS::reserve(u32 n) {
+            points_.reserve(n);
+        }
+
+        inline void PointsAoS::clear() {
+            points_.clear();
+        }
+
+        inline u32 PointsAoS::getMemoryUsage()const {
+            return u32(points_.capacity()*sizeof(EndPoint));
+        }
+
+        inline f32 PointsAoS::getValue(u32 id)const {
+            return points_[id].getValue();
+        }
+
+        inline void PointsAoS::setValue(u32 id, f32 v) {
+            points_[id].setValue(v);
+        }
+
+        inline u32 PointsAoS::getBoxId(u32 id)const {
+            return points_[id].getBoxId();
+        }
+
+        inline u32 PointsAoS::getIsMax(u32 id)const {
+            return points_[id].getIsMax();
+        }
+
+        inline EndPoint PointsAoS::get(u32 id)const {
+            return points_[id];
+        }
+
+        inline void PointsAoS::insert(u32 id, const EndPoint& ep) {
+            points_.insert(points_.begin()+id, ep);
+        }
+
+        inline void PointsAoS::erase(u32 id) {
+            points_.erase(points_.begin()+id);
+        }
+
+        inline void PointsAoS::pushBack(const EndPoint& ep) {
+            points_.push_back(ep);
+        }
+
+        inline void PointsAoS::movePoint(u32 from_id, u32 to_id) {
+            EndPoint tmp_point = points_[from_id];
+            if (from_id < to_id)
+                memmove(&points_[from_id], &points_[from_id+1], sizeof(EndPoint)*(to_id-from_id));
+            else
+                memmove(&points_[to_id+1], &points_[to_id], sizeof(EndPoint)*(from_id-to_id));
+            points_[to_id] = tmp_point;
+        }
+
+        inline void PointsAoS::sort() {
+            std::sort(points_.begin(), points_.end(), EndPoint::compareAsc);
+        }
+
+        inline u32 PointsAoS::lowerBound(f32 val)const {
+            return lowerBoundPoints<true>(*this, val);
+        }
+
+        inline u32 PointsAoS::upperBound(f32 val)const {
+            return lowerBoundPoints<false>(*this, val);
+        }
+
+        inline u32 PointsAoS::findFirstGreaterEq(u32 from, f32 val)const {
+            return simd::findFirstGreater<2, 1, true>(rawData_(), from, size(), val);
+        }
+
+        inline u32 PointsAoS::findFirstGreater(u32 from, f32 val)const {
+            return simd::findFirstGreater<2, 1, false>(rawData_(), from, size(), val);
+        }
+
+        inline i32 PointsAoS::findLastLessEq(u32 to, f32 val)const {
+            return simd::findLastLess<2, 1, true>(rawData_(), 0, to, val);
+        }
+
+        inline i32 PointsAoS::findLastLess(u32 to, f32 val)const {
+            return simd::findLastLess<2, 1, false>(rawData_(), 0, to, val);
+        }
+
+        inline u32 PointsAoS::findLastFurther(u32 to, f32 origin, f32 dist)const {
+            if (to < 2)
+                return 0;
+            return u32(simd::findLastFurther<2, 1>(rawData_(), 1, to, origin, dist));
+        }
+
+        inline void PointsAoS::gatherMinBoxIds(u32 from, u32 to, fast_vector<u32>& ids_out)const {
+            if (from >= to)
+                return;
+            u32 prev_size = u32(ids_out.size());
+            ids_out.resize(prev_size + (to-from) + 8);
+            const u32* base = reinterpret_cast<const u32*>(rawData_());
+            u32 cnt = simd::gatherMinBoxIds<2, 0>(base, from, to, &ids_out[prev_size]);
+            ids_out.resize(prev_size + cnt);
+        }
+
+        inline void PointsAoS::writeSnapshot(SnapshotWriter& w)const {
+            u32 n = size();
+            fast_vector<f32> values(n);
+            fast_vector<u32> pack_data(n);
+            for (u32 i=0; i<n; ++i) {
+                values[i] = points_[i].getValue();
+                pack_data[i] = points_[i].getPackData();
+            }
+            w.write(n);
+            w.write(values.data(), n*sizeof(f32));
+            w.write(pack_data.data(), n*sizeof(u32));
+        }
+
+        inline bool PointsAoS::readSnapshot(SnapshotReader& r, const fast_vector<u32>& box_ids_map) {
+            u32 n;
+            if (!r.read(n))
+                return false;
+            const u8* values = r.skip(size_t(n)*sizeof(f32));
+            const u8* pack_data = r.skip(size_t(n)*sizeof(u32));
+            if (!values || !pack_data)
+                return false;
+            points_.clear();
+            points_.reserve(n);
+            for (u32 i=0; i<n; ++i) {
+                f32 v;
+                u32 pd;
+                memcpy(&v, values + i*sizeof(f32), sizeof(f32));
+                memcpy(&pd, pack_data + i*sizeof(u32), sizeof(u32));
+                if (!mapSnapshotPackData(pd, box_ids_map))
+                    return false;
+                points_.push_back(EndPoint(pd & ~(1u<<31), (pd>>31) != 0, v));
+            }
+            return true;
+        }
+
+        inline const f32* PointsAoS::rawData_()const {
+            // EndPoint is {u32 pack_data_, f32 value_}
+            return points_.empty()?NULL:reinterpret_cast<const f32*>(&points_[0]);
+        }
+
+        inline u32 PointsSoA::size()const {
+            return u32(values_.size());
+        }
+
+        inline bool PointsSoA::empty()const {
+            return values_.empty();
+        }
+
+        inline void PointsSoA::reserve(u32 n) {
+            values_.reserve(n);
+            pack_data_.reserve(n);
+        }
+
+        inline void PointsSoA::clear() {
+            values_.clear();
+            pack_data_.clear();
+        }
+
+        inline u32 PointsSoA::getMemoryUsage()const {
+            return u32(values_.capacity()*sizeof(f32) + pack_data_.capacity()*sizeof(u32));
+        }
+
+        inline f32 PointsSoA::getValue(u32 id)const {
+            return values_[id];
+        }
+
+        inline void PointsSoA::setValue(u32 id, f32 v) {
+            values_[id] = v;
+        }
+
+        inline u32 PointsSoA::getBoxId(u32 id)const {
+            return pack_data_[id] & ~(1<<31);
+        }
+
+        inline u32 PointsSoA::getIsMax(u32 id)const {
+            return (pack_data_[id]>>31)&1;
+        }
+
+        inline EndPoint PointsSoA::get(u32 id)const {
+            return EndPoint(getBoxId(id), bool(getIsMax(id)), values_[id]);
+        }
+
+        inline void PointsSoA::insert(u32 id, const EndPoint& ep) {
+            values_.insert(values_.begin()+id, ep.getValue());
+            pack_data_.insert(pack_data_.begin()+id, ep.getPackData());
+        }
+
+        inline void PointsSoA::erase(u32 id) {
+            values_.erase(values_.begin()+id);
+            pack_data_.erase(pack_data_.begin()+id);
+        }
+
+        inline void PointsSoA::pushBack(const EndPoint& ep) {
+            values_.push_back(ep.getValue());
+            pack_data_.push_back(ep.getPackData());
+        }
+
+        inline void PointsSoA::movePoint(u32 from_id, u32 to_id) {
+            f32 tmp_value = values_[from_id];
+            u32 tmp_pack_data = pack_data_[from_id];
+            if (from_id < to_id) {
+                u32 count = to_id-from_id;
+                memmove(&values_[from_id], &values_[from_id+1], sizeof(f32)*count);
+                memmove(&pack_data_[from_id], &pack_data_[from_id+1], sizeof(u32)*count);
+            }
+            else {
+                u32 count = from_id-to_id;
+                memmove(&values_[to_id+1], &values_[to_id], sizeof(f32)*count);
+                memmove(&pack_data_[to_id+1], &pack_data_[to_id], sizeof(u32)*count);
+            }
+            values_[to_id] = tmp_value;
+            pack_data_[to_id] = tmp_pack_data;
+        }
+
+        inline void PointsSoA::sort() {
+            fast_vector<EndPoint> tmp;
+            tmp.reserve(size());
+            for (u32 i=0; i<size(); ++i) {
+                tmp.push_back(get(i));
+            }
+            std::sort(tmp.begin(), tmp.end(), EndPoint::compareAsc);
+            for (u32 i=0; i<tmp.size(); ++i) {
+                values_[i] = tmp[i].getValue();
+                pack_data_[i] = tmp[i].getPackData();
+            }
+        }
+
+        inline u32 PointsSoA::lowerBound(f32 val)const {
+            return lowerBoundPoints<true>(*this, val);
+        }
+
+        inline u32 PointsSoA::upperBound(f32 val)const {
+            return lowerBoundPoints<false>(*this, val);
+        }
+
+        inline u32 PointsSoA::findFirstGreaterEq(u32 from, f32 val)const {
+            return simd::findFirstGreater<1, 0, true>(rawValues_(), from, size(), val);
+        }
+
+        inline u32 PointsSoA::findFirstGreater(u32 from, f32 val)const {
+            return simd::findFirstGreater<1, 0, false>(rawValues_(), from, size(), val);
+        }
+
+        inline i32 PointsSoA::findLastLessEq(u32 to, f32 val)const {
+            return simd::findLastLess<1, 0, true>(rawValues_(), 0, to, val);
+        }
+
+        inline i32 PointsSoA::findLastLess(u32 to, f32 val)const {
+            return simd::findLastLess<1, 0, false>(rawValues_(), 0, to, val);
+        }
+
+        inline u32 PointsSoA::findLastFurther(u32 to, f32 origin, f32 dist)const {
+            if (to < 2)
+                return 0;
+            return u32(simd::findLastFurther<1, 0>(rawValues_(), 1, to, origin, dist));
+        }
+
+        inline void PointsSoA::gatherMinBoxIds(u32 from, u32 to, fast_vector<u32>& ids_out)const {
+            if (from >= to)
+                return;
+            u32 prev_size = u32(ids_out.size());
+            ids_out.resize(prev_size + (to-from) + 8);
+            u32 cnt = simd::gatherMinBoxIds<1, 0>(rawPackData_(), from, to, &ids_out[prev_size]);
+            ids_out.resize(prev_size + cnt);
+        }
+
+        inline void PointsSoA::writeSnapshot(SnapshotWriter& w)const {
+            u32 n = size();
+            w.write(n);
+            w.write(rawValues_(), n*sizeof(f32));
+            w.write(rawPackData_(), n*sizeof(u32));
+        }
+
+        inline bool PointsSoA::readSnapshot(SnapshotReader& r, const fast_vector<u32>& box_ids_map) {
+            u32 n;
+            if (!r.read(n))
+                return false;
+            const u8* values = r.skip(size_t(n)*sizeof(f32));
+            const u8* pack_data = r.skip(size_t(n)*sizeof(u32));
+            if (!values || !pack_data)
+                return false;
+            values_.resize(n);
+            pack_data_.resize(n);
+            if (n) {
+                memcpy(&values_[0], values, n*sizeof(f32));
+                memcpy(&pack_data_[0], pack_data, n*sizeof(u32));
+            }
+            for (u32 i=0; i<n; ++i) {
+                if (!mapSnapshotPackData(pack_data_[i], box_ids_map))
+                    return false;
+            }
+            return true;
+        }
+
+        inline const f32* PointsSoA::rawValues_()const {
+            return values_.empty()?NULL:&values_[0];
+        }
+
+        inline const u32* PointsSoA::rawPackData_()const {
+            return pack_data_.empty()?NULL:&pack_data_[0];
+        }
+
         inline CollPair::CollPair()
 #ifdef DEBUG_BUILD
          : id1(InvalidId())
@@ -60,12 +465,107 @@ namespace grynca {
             return id1==cp.id1 && id2==cp.id2;
         }
 
+        inline bool CollPair::operator<(const CollPair& cp)const {
+            return id<cp.id;
+        }
+
         inline u32 CollPair::Hasher::operator()(const CollPair& cp)const {
             return calcHash32(cp.id);
         }
 
+        inline CollisionFilter::CollisionFilter()
+         : category(1), mask(u32(-1))
+        {}
+
+        inline CollisionFilter::CollisionFilter(u32 cat, u32 msk)
+         : category(cat), mask(msk)
+        {}
+
+        inline bool CollisionFilter::canCollide(const CollisionFilter& f)const {
+            return (category & f.mask) && (f.category & mask);
+        }
+
+        inline bool OverlapEvents::Record::compare(const Record& r1, const Record& r2) {
+            if (r1.pair.box1_id.getIndex() != r2.pair.box1_id.getIndex())
+                return r1.pair.box1_id.getIndex() < r2.pair.box1_id.getIndex();
+            if (r1.pair.box2_id.getIndex() != r2.pair.box2_id.getIndex())
+                return r1.pair.box2_id.getIndex() < r2.pair.box2_id.getIndex();
+            if (r1.pair.box1_id.getVersion() != r2.pair.box1_id.getVersion())
+                return r1.pair.box1_id.getVersion() < r2.pair.box1_id.getVersion();
+            return r1.pair.box2_id.getVersion() < r2.pair.box2_id.getVersion();
+        }
+
+        inline bool OverlapEvents::Record::samePair(const Record& r)const {
+            return pair.box1_id == r.pair.box1_id && pair.box2_id == r.pair.box2_id;
+        }
+
+        inline void OverlapEvents::record(Index b1_id, Index b2_id, bool began) {
+            if (b1_id.getIndex() > b2_id.getIndex())
+                std::swap(b1_id, b2_id);
+            records_.push_back(Record{OverlapPair{b1_id, b2_id}, began});
+            dirty_ = true;
+        }
+
+        inline void OverlapEvents::resolve() {
+            if (!dirty_)
+                return;
+            began_.clear();
+            ended_.clear();
+            // stable -> records of same pair stay in order in which they happened
+            std::stable_sort(records_.begin(), records_.end(), Record::compare);
+            for (u32 i=0; i<records_.size(); ) {
+                u32 last = i;
+                while (last+1 < records_.size() && records_[last+1].samePair(records_[i]))
+                    ++last;
+
+                // first event tells if pair existed before, last if it exists now
+                // (when both, pair ended and began again -> reported in both)
+                if (!records_[i].began)
+                    ended_.push_back(records_[i].pair);
+                if (records_[last].began)
+                    began_.push_back(records_[i].pair);
+                i = last+1;
+            }
+            // resolved records are kept compacted (ended first, began second for re-created pairs)
+            records_.clear();
+            for (u32 i=0; i<ended_.size(); ++i)
+                records_.push_back(Record{ended_[i], false});
+            for (u32 i=0; i<began_.size(); ++i)
+                records_.push_back(Record{began_[i], true});
+            dirty_ = false;
+        }
+
+        inline void OverlapEvents::clear() {
+            records_.clear();
+            began_.clear();
+            ended_.clear();
+            dirty_ = false;
+        }
+
+        inline Stats::Stats() {
+            reset();
+        }
+
+        inline void Stats::reset() {
+            memset(this, 0, sizeof(Stats));
+        }
+
+        inline void Stats::add(const Stats& s) {
+            for (u32 a=0; a<3; ++a) {
+                endpoint_swaps[a] += s.endpoint_swaps[a];
+            }
+            candidates += s.candidates;
+            overlap_tests += s.overlap_tests;
+            overlap_hits += s.overlap_hits;
+            pairs_added += s.pairs_added;
+            pairs_removed += s.pairs_removed;
+            crossings += s.crossings;
+            splits += s.splits;
+            merges += s.merges;
+        }
+
         BOX_TPL
-        inline BOX_TYPE::SAPBox() : occurences_count_(0) {}
+        inline BOX_TYPE::SAPBox() : occurences_count_(0), sleeping_(false) {}
 
         BOX_TPL
         inline void BOX_TYPE::setClientData(const BoxDataT& cd) {
@@ -84,6 +584,11 @@ namespace grynca {
 
         BOX_TPL
         inline const f32* BOX_TYPE::getBounds()const {
+            return tight_bounds_;
+        }
+
+        BOX_TPL
+        inline const f32* BOX_TYPE::getFatBounds()const {
             return bounds_;
         }
 
@@ -97,6 +602,11 @@ namespace grynca {
             return bounds_[AXES_COUNT+a];
         }
 
+        BOX_TPL
+        inline bool BOX_TYPE::isSleeping()const {
+            return sleeping_;
+        }
+
         BOX_TPL
         inline u32 BOX_TYPE::getOccurencesCount() {
             return occurences_count_;
@@ -117,6 +627,14 @@ namespace grynca {
             return InvalidId();
         }
 
+        BOX_TPL
+        inline void BOX_TYPE::addOccurence(Segment* segment) {
+            ASSERT(findOccurence(segment) == InvalidId());
+            ASSERT(occurences_count_ < Policy::MAX_BOX_OCCURENCES);
+            occurences_[occurences_count_].segment_ = segment;
+            ++occurences_count_;
+        }
+
         BOX_TPL
         inline void BOX_TYPE::removeOccurence(u32 id) {
             ASSERT(getOccurencesCount());
@@ -147,7 +665,7 @@ namespace grynca {
                     return;
                 }
             }
-            ASSERT(occurences_count_ < SAP::MAX_BOX_OCCURENCES);
+            ASSERT(occurences_count_ < Policy::MAX_BOX_OCCURENCES);
             occurences_[occurences_count_].segment_ = segment;
             occurences_[occurences_count_].min_max_ids_[a].v[0] = min_id;
             occurences_[occurences_count_].min_max_ids_[a].v[1] = max_id;
@@ -163,7 +681,7 @@ namespace grynca {
                 }
             }
 
-            ASSERT(occurences_count_ < SAP::MAX_BOX_OCCURENCES);
+            ASSERT(occurences_count_ < Policy::MAX_BOX_OCCURENCES);
             occurences_[occurences_count_].segment_ = segment;
             occurences_[occurences_count_].min_max_ids_[a].v[min_or_max] = epid;
             ++occurences_count_;
@@ -190,8 +708,123 @@ namespace grynca {
             memcpy(mins_maxs_out, occurences_[id].min_max_ids_, sizeof(MinMax)*AXES_COUNT);
         }
 
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::addPair(u32 b1_inner_id, u32 b2_inner_id) {
+            ASSERT(b1_inner_id != b2_inner_id);
+            u32 node_id;
+            if (!free_nodes_.empty()) {
+                node_id = free_nodes_.back();
+                free_nodes_.pop_back();
+            }
+            else {
+                node_id = u32(nodes_.size());
+                nodes_.push_back(Node());
+            }
+
+            u32 max_id = std::max(b1_inner_id, b2_inner_id);
+            if (max_id >= firsts_.size()) {
+                firsts_.resize(max_id+1, u32(InvalidId()));
+                counts_.resize(max_id+1, 0);
+            }
+
+            Node& n = nodes_[node_id];
+            n.box_ids[0] = b1_inner_id;
+            n.box_ids[1] = b2_inner_id;
+            for (u32 s=0; s<2; ++s) {
+                u32 bid = n.box_ids[s];
+                n.prev[s] = InvalidId();
+                n.next[s] = firsts_[bid];
+                if (firsts_[bid] != InvalidId()) {
+                    Node& first = nodes_[firsts_[bid]];
+                    first.prev[getSide_(first, bid)] = node_id;
+                }
+                firsts_[bid] = node_id;
+                ++counts_[bid];
+            }
+            return node_id;
+        }
+
+        ADJ_TPL
+        inline void ADJ_TYPE::removePair(u32 node_id) {
+            Node& n = nodes_[node_id];
+            for (u32 s=0; s<2; ++s) {
+                u32 bid = n.box_ids[s];
+                if (n.prev[s] != InvalidId()) {
+                    Node& prev = nodes_[n.prev[s]];
+                    prev.next[getSide_(prev, bid)] = n.next[s];
+                }
+                else {
+                    firsts_[bid] = n.next[s];
+                }
+                if (n.next[s] != InvalidId()) {
+                    Node& next = nodes_[n.next[s]];
+                    next.prev[getSide_(next, bid)] = n.prev[s];
+                }
+                --counts_[bid];
+            }
+            n.data = OverlapData();
+            free_nodes_.push_back(node_id);
+        }
+
+        ADJ_TPL
+        inline typename ADJ_TYPE::Node& ADJ_TYPE::accNode(u32 node_id) {
+            return nodes_[node_id];
+        }
+
+        ADJ_TPL
+        inline const typename ADJ_TYPE::Node& ADJ_TYPE::getNode(u32 node_id)const {
+            return nodes_[node_id];
+        }
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::getFirst(u32 box_inner_id)const {
+            if (box_inner_id >= firsts_.size())
+                return InvalidId();
+            return firsts_[box_inner_id];
+        }
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::getNext(u32 node_id, u32 box_inner_id)const {
+            const Node& n = nodes_[node_id];
+            return n.next[getSide_(n, box_inner_id)];
+        }
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::getOther(u32 node_id, u32 box_inner_id)const {
+            const Node& n = nodes_[node_id];
+            return n.box_ids[1-getSide_(n, box_inner_id)];
+        }
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::getCount(u32 box_inner_id)const {
+            if (box_inner_id >= counts_.size())
+                return 0;
+            return counts_[box_inner_id];
+        }
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::getMemoryUsage()const {
+            return u32(nodes_.capacity()*sizeof(Node) + (free_nodes_.capacity() + firsts_.capacity() + counts_.capacity())*sizeof(u32));
+        }
+
+        ADJ_TPL
+        inline void ADJ_TYPE::clear() {
+            nodes_.clear();
+            free_nodes_.clear();
+            firsts_.clear();
+            counts_.clear();
+        }
+
+        ADJ_TPL
+        inline u32 ADJ_TYPE::getSide_(const Node& n, u32 box_inner_id)const {
+            ASSERT(n.box_ids[0] == box_inner_id || n.box_ids[1] == box_inner_id);
+            return u32(n.box_ids[1] == box_inner_id);
+        }
     }
 }
 
 #undef BOX_TPL
-#undef BOX_TYPE
\ No newline at end of file
+#undef BOX_TYPE
+#undef ADJ_TPL
+#undef ADJ_TYPE
\ No newline at end of file
@@ -0,0 +1,332 @@
+#ifndef SAP_SIMD_H
+#define SAP_SIMD_H
+
+#include "types/Type.h"
+#include <cfloat>
+#include <algorithm>
+
+// endpoint scanning kernels, instruction set is selected at compile time:
+//  AVX2 (-mavx2), SSE2 (default on x86-64), scalar otherwise
+//  define SAP_NO_SIMD to force scalar code
+#if !defined(SAP_NO_SIMD) && defined(__AVX2__)
+#   define SAP_SIMD_AVX2
+#endif
+#if !defined(SAP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#   define SAP_SIMD_SSE2
+#endif
+
+#if defined(SAP_SIMD_AVX2)
+#   include <immintrin.h>
+#elif defined(SAP_SIMD_SSE2)
+#   include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+namespace grynca {
+    namespace SAP {
+        namespace simd {
+
+            // kernels work on lanes of strided arrays: lane i is base[i*STRIDE + OFFSET]
+            // (SoA values: <1, 0>, AoS EndPoint values: <2, 1>, AoS pack data: <2, 0>)
+
+            // bit scans expect nonzero mask
+            inline u32 lowestBit(u32 mask) {
+#ifdef _MSC_VER
+                unsigned long id;
+                _BitScanForward(&id, mask);
+                return u32(id);
+#else
+                return u32(__builtin_ctz(mask));
+#endif
+            }
+
+            inline u32 highestBit(u32 mask) {
+#ifdef _MSC_VER
+                unsigned long id;
+                _BitScanReverse(&id, mask);
+                return u32(id);
+#else
+                return 31 - u32(__builtin_clz(mask));
+#endif
+            }
+
+            inline u32 bitsCount(u32 mask) {
+#ifdef _MSC_VER
+                return u32(__popcnt(mask));
+#else
+                return u32(__builtin_popcount(mask));
+#endif
+            }
+
+            inline u32 lowestBit64(u64 mask) {
+#if defined(_MSC_VER) && defined(_M_X64)
+                unsigned long id;
+                _BitScanForward64(&id, mask);
+                return u32(id);
+#elif defined(_MSC_VER)
+                if (u32(mask))
+                    return lowestBit(u32(mask));
+                return 32 + lowestBit(u32(mask >> 32));
+#else
+                return u32(__builtin_ctzll(mask));
+#endif
+            }
+
+#ifdef SAP_SIMD_SSE2
+            template <u32 STRIDE, u32 OFFSET>
+            inline __m128 load4(const f32* base, u32 i) {
+                if (STRIDE == 1)
+                    return _mm_loadu_ps(base + i + OFFSET);
+                __m128 a = _mm_loadu_ps(base + i*2);
+                __m128 b = _mm_loadu_ps(base + i*2 + 4);
+                if (OFFSET)
+                    return _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+                return _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+            }
+#endif
+
+#ifdef SAP_SIMD_AVX2
+            template <u32 STRIDE, u32 OFFSET>
+            inline __m256 load8(const f32* base, u32 i) {
+                if (STRIDE == 1)
+                    return _mm256_loadu_ps(base + i + OFFSET);
+                __m256 a = _mm256_loadu_ps(base + i*2);
+                __m256 b = _mm256_loadu_ps(base + i*2 + 8);
+                // shuffle works within 128b lanes -> [0 1 4 5 | 2 3 6 7], fix order with permute
+                __m256 s;
+                if (OFFSET)
+                    s = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+                else
+                    s = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+                return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(s), _MM_SHUFFLE(3, 1, 2, 0)));
+            }
+
+            // permutations moving selected lanes to front, indexed with 8b mask
+            struct CompressTable {
+                CompressTable() {
+                    for (u32 m=0; m<256; ++m) {
+                        u32 cnt = 0;
+                        for (u32 l=0; l<8; ++l) {
+                            if (m & (1<<l))
+                                idx[m][cnt++] = l;
+                        }
+                        for (; cnt<8; ++cnt)
+                            idx[m][cnt] = 0;
+                    }
+                }
+
+                static const CompressTable& get() {
+                    static CompressTable table;
+                    return table;
+                }
+
+                u32 idx[256][8];
+            };
+#endif
+
+            // first id in [from, to) with lane > val (>= with OR_EQUAL), to when none
+            template <u32 STRIDE, u32 OFFSET, bool OR_EQUAL>
+            inline u32 findFirstGreater(const f32* base, u32 from, u32 to, f32 val) {
+                // most moves end at the first tested point, check it before vector loop
+                if (from < to && (OR_EQUAL ? base[from*STRIDE + OFFSET] >= val : base[from*STRIDE + OFFSET] > val))
+                    return from;
+                u32 i = from;
+#ifdef SAP_SIMD_AVX2
+                __m256 v8 = _mm256_set1_ps(val);
+                for (; i+8<=to; i+=8) {
+                    u32 mask = u32(_mm256_movemask_ps(_mm256_cmp_ps(load8<STRIDE, OFFSET>(base, i), v8, OR_EQUAL ? _CMP_GE_OQ : _CMP_GT_OQ)));
+                    if (mask)
+                        return i + lowestBit(mask);
+                }
+#endif
+#ifdef SAP_SIMD_SSE2
+                __m128 v4 = _mm_set1_ps(val);
+                for (; i+4<=to; i+=4) {
+                    __m128 lanes = load4<STRIDE, OFFSET>(base, i);
+                    u32 mask = u32(_mm_movemask_ps(OR_EQUAL ? _mm_cmpge_ps(lanes, v4) : _mm_cmpgt_ps(lanes, v4)));
+                    if (mask)
+                        return i + lowestBit(mask);
+                }
+#endif
+                for (; i<to; ++i) {
+                    if (OR_EQUAL ? base[i*STRIDE + OFFSET] >= val : base[i*STRIDE + OFFSET] > val)
+                        return i;
+                }
+                return to;
+            }
+
+            // last id in [from, to) with lane < val (<= with OR_EQUAL), from-1 when none
+            template <u32 STRIDE, u32 OFFSET, bool OR_EQUAL>
+            inline i32 findLastLess(const f32* base, u32 from, u32 to, f32 val) {
+                if (from < to && (OR_EQUAL ? base[(to-1)*STRIDE + OFFSET] <= val : base[(to-1)*STRIDE + OFFSET] < val))
+                    return i32(to-1);
+                u32 i = to;
+#ifdef SAP_SIMD_AVX2
+                __m256 v8 = _mm256_set1_ps(val);
+                for (; i>=from+8; i-=8) {
+                    u32 mask = u32(_mm256_movemask_ps(_mm256_cmp_ps(load8<STRIDE, OFFSET>(base, i-8), v8, OR_EQUAL ? _CMP_LE_OQ : _CMP_LT_OQ)));
+                    if (mask)
+                        return i32(i - 8 + highestBit(mask));
+                }
+#endif
+#ifdef SAP_SIMD_SSE2
+                __m128 v4 = _mm_set1_ps(val);
+                for (; i>=from+4; i-=4) {
+                    __m128 lanes = load4<STRIDE, OFFSET>(base, i-4);
+                    u32 mask = u32(_mm_movemask_ps(OR_EQUAL ? _mm_cmple_ps(lanes, v4) : _mm_cmplt_ps(lanes, v4)));
+                    if (mask)
+                        return i32(i - 4 + highestBit(mask));
+                }
+#endif
+                for (; i>from; --i) {
+                    if (OR_EQUAL ? base[(i-1)*STRIDE + OFFSET] <= val : base[(i-1)*STRIDE + OFFSET] < val)
+                        return i32(i-1);
+                }
+                return i32(from)-1;
+            }
+
+            // last id in [from, to) with origin - lane > dist, from-1 when none
+            template <u32 STRIDE, u32 OFFSET>
+            inline i32 findLastFurther(const f32* base, u32 from, u32 to, f32 origin, f32 dist) {
+                u32 i = to;
+#ifdef SAP_SIMD_AVX2
+                __m256 o8 = _mm256_set1_ps(origin);
+                __m256 d8 = _mm256_set1_ps(dist);
+                for (; i>=from+8; i-=8) {
+                    __m256 lens = _mm256_sub_ps(o8, load8<STRIDE, OFFSET>(base, i-8));
+                    u32 mask = u32(_mm256_movemask_ps(_mm256_cmp_ps(lens, d8, _CMP_GT_OQ)));
+                    if (mask)
+                        return i32(i - 8 + highestBit(mask));
+                }
+#endif
+#ifdef SAP_SIMD_SSE2
+                __m128 o4 = _mm_set1_ps(origin);
+                __m128 d4 = _mm_set1_ps(dist);
+                for (; i>=from+4; i-=4) {
+                    __m128 lens = _mm_sub_ps(o4, load4<STRIDE, OFFSET>(base, i-4));
+                    u32 mask = u32(_mm_movemask_ps(_mm_cmpgt_ps(lens, d4)));
+                    if (mask)
+                        return i32(i - 4 + highestBit(mask));
+                }
+#endif
+                for (; i>from; --i) {
+                    if (origin - base[(i-1)*STRIDE + OFFSET] > dist)
+                        return i32(i-1);
+                }
+                return i32(from)-1;
+            }
+
+            // writes box ids of min endpoints (isMax bit not set) in [from, to) to ids_out, returns their count
+            // ids_out must have space for to-from+8 ids
+            template <u32 STRIDE, u32 OFFSET>
+            inline u32 gatherMinBoxIds(const u32* base, u32 from, u32 to, u32* ids_out) {
+#if defined(SAP_SIMD_AVX2) || defined(SAP_SIMD_SSE2)
+                // isMax bits are sign bits of pack data loaded as floats
+                const f32* fbase = reinterpret_cast<const f32*>(base);
+#endif
+                u32 cnt = 0;
+                u32 i = from;
+#ifdef SAP_SIMD_AVX2
+                const CompressTable& ct = CompressTable::get();
+                for (; i+8<=to; i+=8) {
+                    __m256 packs = load8<STRIDE, OFFSET>(fbase, i);
+                    u32 mask = u32(~_mm256_movemask_ps(packs)) & 0xFF;
+                    __m256i perm = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ct.idx[mask]));
+                    __m256i ids = _mm256_permutevar8x32_epi32(_mm256_castps_si256(packs), perm);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(ids_out + cnt), ids);
+                    cnt += bitsCount(mask);
+                }
+#endif
+#ifdef SAP_SIMD_SSE2
+                for (; i+4<=to; i+=4) {
+                    u32 mask = u32(~_mm_movemask_ps(load4<STRIDE, OFFSET>(fbase, i))) & 0xF;
+                    while (mask) {
+                        ids_out[cnt++] = base[(i + lowestBit(mask))*STRIDE + OFFSET];
+                        mask &= mask-1;
+                    }
+                }
+#endif
+                for (; i<to; ++i) {
+                    u32 pack = base[i*STRIDE + OFFSET];
+                    if (!(pack>>31))
+                        ids_out[cnt++] = pack;
+                }
+                return cnt;
+            }
+
+            // slab test of one box against packet of rays (lane i is ray i), origins & inv_dirs are AXES arrays
+            // of lanes_stride lanes (readable up to rays_count rounded up to 8), returns mask of hit rays and writes
+            // their ray params to t_out (as SAPRaycaster::overlapBox_(): exit param when ray starts inside box,
+            // with ENTRY as SAPRaycaster::enterBounds_(): 0 when ray starts inside box)
+            template <u32 AXES, bool ENTRY = false>
+            inline u64 raysBoxHits(const f32* origins, const f32* inv_dirs, u32 lanes_stride, u32 rays_count, const f32* bounds, f32* t_out) {
+                u64 hits = 0;
+                u32 i = 0;
+#ifdef SAP_SIMD_AVX2
+                const __m256 zero8 = _mm256_setzero_ps();
+                const __m256 one8 = _mm256_set1_ps(1.0f);
+                for (; i<rays_count; i+=8) {
+                    __m256 tmin = _mm256_set1_ps(-FLT_MAX);
+                    __m256 tmax = _mm256_set1_ps(FLT_MAX);
+                    for (u32 a=0; a<AXES; ++a) {
+                        __m256 o = _mm256_loadu_ps(origins + a*lanes_stride + i);
+                        __m256 inv = _mm256_loadu_ps(inv_dirs + a*lanes_stride + i);
+                        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[a]), o), inv);
+                        __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[AXES+a]), o), inv);
+                        tmin = _mm256_max_ps(tmin, _mm256_min_ps(t1, t2));
+                        tmax = _mm256_min_ps(tmax, _mm256_max_ps(t1, t2));
+                    }
+                    __m256 t = ENTRY ? _mm256_max_ps(tmin, zero8) : _mm256_blendv_ps(tmin, tmax, _mm256_cmp_ps(tmin, zero8, _CMP_LT_OQ));
+                    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+                                               _mm256_and_ps(_mm256_cmp_ps(tmax, zero8, _CMP_GE_OQ), _mm256_cmp_ps(tmin, one8, _CMP_LE_OQ)));
+                    _mm256_storeu_ps(t_out + i, t);
+                    hits |= u64(u32(_mm256_movemask_ps(hit))) << i;
+                }
+#elif defined(SAP_SIMD_SSE2)
+                const __m128 zero4 = _mm_setzero_ps();
+                const __m128 one4 = _mm_set1_ps(1.0f);
+                for (; i<rays_count; i+=4) {
+                    __m128 tmin = _mm_set1_ps(-FLT_MAX);
+                    __m128 tmax = _mm_set1_ps(FLT_MAX);
+                    for (u32 a=0; a<AXES; ++a) {
+                        __m128 o = _mm_loadu_ps(origins + a*lanes_stride + i);
+                        __m128 inv = _mm_loadu_ps(inv_dirs + a*lanes_stride + i);
+                        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[a]), o), inv);
+                        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[AXES+a]), o), inv);
+                        tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+                        tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+                    }
+                    __m128 inside = _mm_cmplt_ps(tmin, zero4);
+                    __m128 t = ENTRY ? _mm_max_ps(tmin, zero4) : _mm_or_ps(_mm_and_ps(inside, tmax), _mm_andnot_ps(inside, tmin));
+                    __m128 hit = _mm_and_ps(_mm_cmple_ps(tmin, tmax), _mm_and_ps(_mm_cmpge_ps(tmax, zero4), _mm_cmple_ps(tmin, one4)));
+                    _mm_storeu_ps(t_out + i, t);
+                    hits |= u64(u32(_mm_movemask_ps(hit))) << i;
+                }
+#endif
+                for (; i<rays_count; ++i) {
+                    f32 tmin = -FLT_MAX;
+                    f32 tmax = FLT_MAX;
+                    for (u32 a=0; a<AXES; ++a) {
+                        f32 o = origins[a*lanes_stride + i];
+                        f32 inv = inv_dirs[a*lanes_stride + i];
+                        f32 t1 = (bounds[a] - o)*inv;
+                        f32 t2 = (bounds[AXES+a] - o)*inv;
+                        tmin = std::max(tmin, std::min(t1, t2));
+                        tmax = std::min(tmax, std::max(t1, t2));
+                    }
+                    t_out[i] = (tmin < 0) ? (ENTRY ? 0.0f : tmax) : tmin;
+                    if (tmin <= tmax && tmax >= 0 && tmin <= 1.0f)
+                        hits |= u64(1) << i;
+                }
+                // lanes past rays_count
+                if (rays_count < 64)
+                    hits &= (u64(1) << rays_count) - 1;
+                return hits;
+            }
+        }
+    }
+}
+
+#endif //SAP_SIMD_H
@@ -0,0 +1,1799 @@
+// headless benchmark (no SDL) of fixed-seed scenarios, prints one JSON object per run:
+//   sap_bench [--sizes 1000,10000,100000] [--frames 60] [--seed 1] [--scenario name] [--dims 2|3]
+//             [--layout aos|soa|both] [--batch] [--workers n] [--check]
+// --check compares bulk loaded tree with boxes added one by one and pairs with brute force, runs feature checks
+// (exit code 2 on mismatch)
+
+#include "base.h"
+using namespace grynca;
+#include "SAP.h"
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::duration<f64, std::nano> Ns;
+    typedef std::chrono::duration<f64, std::milli> Ms;
+
+    static const f32 BOX_SIZE_MAX = 10.0f;
+    static const f32 SPEED_MAX = 1.0f;          // per frame
+    static const f32 FAST_SPEED_MAX = 20.0f;    // teleport scenario
+    static const f32 TELEPORTED_PART = 0.05f;
+    static const f32 CHURN_PART = 0.02f;
+    static const f32 HUGE_PART = 0.01f;
+    static const u32 BOXES_IN_CLUSTER = 500;
+    static const u32 CHECK_QUERIES = 64;
+
+    enum ScenarioType {
+        stUniform,          // random boxes moving in random directions
+        stClustered,        // crowds moving together
+        stMixed,            // few huge boxes among tiny ones
+        stTeleport,         // fast moves and part of boxes teleported each frame
+        stChurn,            // part of boxes removed and spawned again each frame
+        stCount
+    };
+
+    static const char* SCENARIO_NAMES[stCount] = {"uniform", "clustered", "mixed", "teleport", "churn"};
+
+    struct Options {
+        Options() : frames(60), seed(1), scenario(stCount), dims(0), aos(true), soa(false), batch(false), workers(1), check(false) {}
+
+        fast_vector<u32> sizes;
+        u32 frames;
+        u32 seed;
+        u32 scenario;       // stCount = all
+        u32 dims;           // 0 = both
+        bool aos, soa;
+        bool batch;
+        u32 workers;
+        bool check;
+    };
+
+    // same sequence on all platforms (unlike rand())
+    class Random {
+    public:
+        Random(u32 seed) : state_(seed*2654435761u + 1) {}
+
+        u32 next() {
+            state_ ^= state_ << 13;
+            state_ ^= state_ >> 17;
+            state_ ^= state_ << 5;
+            return state_;
+        }
+
+        f32 get(f32 min, f32 max) {
+            return min + (f32(next()&0xffffff)/f32(0xffffff))*(max-min);
+        }
+
+        // roughly normal, in (-1, 1)
+        f32 getCentered() {
+            return (get(-1, 1) + get(-1, 1) + get(-1, 1))/3;
+        }
+    private:
+        u32 state_;
+    };
+
+    template <u32 AXES>
+    class Scene {
+    public:
+        Scene(ScenarioType type, u32 boxes_count, u32 seed)
+         : type_(type), rnd_(seed)
+        {
+            // constant density across sizes
+            space_ = 2*BOX_SIZE_MAX*std::pow(f32(boxes_count), 1.0f/AXES);
+            clusters_.resize(std::max(boxes_count/BOXES_IN_CLUSTER, 1u)*AXES*2);
+            for (u32 i=0; i<clusters_.size(); i+=AXES*2) {
+                for (u32 a=0; a<AXES; ++a) {
+                    clusters_[i+a] = rnd_.get(0, space_);
+                    clusters_[i+AXES+a] = rnd_.get(-SPEED_MAX, SPEED_MAX);
+                }
+            }
+            bounds_.resize(boxes_count*AXES*2);
+            speeds_.resize(boxes_count*AXES);
+            for (u32 i=0; i<boxes_count; ++i) {
+                spawn(i);
+            }
+        }
+
+        // new bounds & speed of box
+        void spawn(u32 i) {
+            f32* b = &bounds_[i*AXES*2];
+            f32* s = &speeds_[i*AXES];
+            bool huge = (type_ == stMixed && rnd_.get(0, 1) < HUGE_PART);
+            u32 cluster = (rnd_.next()%u32(clusters_.size()/(AXES*2)))*AXES*2;
+            for (u32 a=0; a<AXES; ++a) {
+                f32 size;
+                if (huge)
+                    size = rnd_.get(0.05f, 0.2f)*space_;
+                else if (type_ == stMixed)
+                    size = rnd_.get(0.1f, 1.0f);
+                else
+                    size = rnd_.get(0.1f, BOX_SIZE_MAX);
+
+                switch (type_) {
+                    case stClustered:
+                        b[a] = clusters_[cluster+a] + rnd_.getCentered()*BOX_SIZE_MAX*std::sqrt(f32(BOXES_IN_CLUSTER));
+                        s[a] = clusters_[cluster+AXES+a] + rnd_.get(-0.1f, 0.1f)*SPEED_MAX;
+                        break;
+                    case stTeleport:
+                        b[a] = rnd_.get(0, space_);
+                        s[a] = rnd_.get(-FAST_SPEED_MAX, FAST_SPEED_MAX);
+                        break;
+                    default:
+                        b[a] = rnd_.get(0, space_);
+                        s[a] = huge?0.0f:rnd_.get(-SPEED_MAX, SPEED_MAX);
+                        break;
+                }
+                b[AXES+a] = b[a] + size;
+            }
+        }
+
+        // move vector for this frame, bounces from space borders
+        const f32* getMove(u32 i) {
+            f32* b = &bounds_[i*AXES*2];
+            f32* s = &speeds_[i*AXES];
+            for (u32 a=0; a<AXES; ++a) {
+                if ((b[a] < 0 && s[a] < 0) || (b[AXES+a] > space_ && s[a] > 0))
+                    s[a] = -s[a];
+                b[a] += s[a];
+                b[AXES+a] += s[a];
+            }
+            return s;
+        }
+
+        const f32* getBounds(u32 i) { return &bounds_[i*AXES*2]; }
+        Random& accRandom() { return rnd_; }
+    private:
+        ScenarioType type_;
+        Random rnd_;
+        f32 space_;
+        fast_vector<f32> clusters_;     // center & speed
+        fast_vector<f32> bounds_;
+        fast_vector<f32> speeds_;
+    };
+
+    struct Result {
+        f64 create_ms;
+        f64 update_ns;
+        u64 moved;
+        u64 pairs_sum;      // over frames
+        u32 pairs;
+        SAP::Stats stats;   // counters over all frames, gauges at end
+        u32 check_errors;
+    };
+
+    static u64 pairKey(u32 i1, u32 i2) {
+        return (i1 < i2)?(u64(i1)<<32 | i2):(u64(i2)<<32 | i1);
+    }
+
+    // box ids -> positions in scene
+    template <typename Manager>
+    static void mapInnerIds(const fast_vector<Index>& box_ids, fast_vector<u32>& scene_ids_out) {
+        scene_ids_out.clear();
+        for (u32 i=0; i<box_ids.size(); ++i) {
+            if (box_ids[i].getIndex() >= scene_ids_out.size())
+                scene_ids_out.resize(box_ids[i].getIndex()+1, InvalidId());
+            scene_ids_out[box_ids[i].getIndex()] = i;
+        }
+    }
+
+    // sorted pair keys of scene positions
+    template <typename Manager>
+    static void getPairs(const Manager& sap, const fast_vector<Index>& box_ids, fast_vector<u64>& pairs_out) {
+        fast_vector<u32> scene_ids;
+        mapInnerIds<Manager>(box_ids, scene_ids);
+        pairs_out.clear();
+        for (u32 i=0; i<sap.getOverlapsCount(); ++i) {
+            Index b1_id, b2_id;
+            sap.getOverlap(i, b1_id, b2_id);
+            pairs_out.push_back(pairKey(scene_ids[b1_id.getIndex()], scene_ids[b2_id.getIndex()]));
+        }
+        std::sort(pairs_out.begin(), pairs_out.end());
+    }
+
+    // sweep on axis 0 over bounds stored in manager, pairs filtered out by collision filters
+    // and pairs of two sleeping boxes are skipped
+    template <typename Manager, u32 AXES>
+    static void getBruteForcePairs(const Manager& sap, const fast_vector<Index>& box_ids, fast_vector<u64>& pairs_out) {
+        u32 boxes_count = u32(box_ids.size());
+        fast_vector<const f32*> bounds(boxes_count);
+        fast_vector<u32> order(boxes_count);
+        for (u32 i=0; i<boxes_count; ++i) {
+            bounds[i] = sap.getReportFatOverlaps()?sap.getBox(box_ids[i]).getFatBounds():sap.getBox(box_ids[i]).getBounds();
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&bounds](u32 i1, u32 i2) { return bounds[i1][0] < bounds[i2][0]; });
+
+        pairs_out.clear();
+        for (u32 i=0; i<boxes_count; ++i) {
+            const f32* b1 = bounds[order[i]];
+            for (u32 j=i+1; j<boxes_count && bounds[order[j]][0] <= b1[AXES]; ++j) {
+                const f32* b2 = bounds[order[j]];
+                bool overlap = true;
+                for (u32 a=1; a<AXES; ++a) {
+                    if (b2[a] > b1[AXES+a] || b2[AXES+a] < b1[a])
+                        overlap = false;
+                }
+                if (overlap && !(sap.getBox(box_ids[order[i]]).isSleeping() && sap.getBox(box_ids[order[j]]).isSleeping())
+                    && sap.getCollisionFilter(box_ids[order[i]]).canCollide(sap.getCollisionFilter(box_ids[order[j]])))
+                    pairs_out.push_back(pairKey(order[i], order[j]));
+            }
+        }
+        std::sort(pairs_out.begin(), pairs_out.end());
+    }
+
+    typedef std::vector<std::vector<f32> > PairsBounds;
+
+    // sorted pairs as bounds of both boxes (for managers with different box ids)
+    template <typename Manager, u32 AXES>
+    static void getPairsBounds(const Manager& sap, PairsBounds& pairs_out) {
+        pairs_out.clear();
+        for (u32 i=0; i<sap.getOverlapsCount(); ++i) {
+            Index b1_id, b2_id;
+            sap.getOverlap(i, b1_id, b2_id);
+            const f32* b1 = sap.getBox(b1_id).getBounds();
+            const f32* b2 = sap.getBox(b2_id).getBounds();
+            if (std::lexicographical_compare(b2, b2+AXES*2, b1, b1+AXES*2))
+                std::swap(b1, b2);
+            std::vector<f32> pair(b1, b1+AXES*2);
+            pair.insert(pair.end(), b2, b2+AXES*2);
+            pairs_out.push_back(pair);
+        }
+        std::sort(pairs_out.begin(), pairs_out.end());
+    }
+
+    template <typename Manager, u32 AXES>
+    static u32 checkPairs(const Manager& sap, const fast_vector<Index>& box_ids, const char* what) {
+        fast_vector<u64> pairs, expected;
+        getPairs(sap, box_ids, pairs);
+        getBruteForcePairs<Manager, AXES>(sap, box_ids, expected);
+        if (pairs == expected)
+            return 0;
+        std::cerr << what << ": " << pairs.size() << " pairs, brute force " << expected.size() << std::endl;
+        return 1;
+    }
+
+    // bulk loaded tree must index same boxes & pairs as tree built by adding boxes one by one
+    // (shapes of trees differ, so they are compared through queries)
+    template <typename Manager, u32 AXES>
+    static u32 checkBulkLoad(Manager& bulk, const fast_vector<Index>& bulk_ids, Scene<AXES>& scene, const fast_vector<typename Manager::BoxDataT>& boxes_data, u32 seed, bool add_one_by_one) {
+        bulk.validate();
+        u32 errors = checkPairs<Manager, AXES>(bulk, bulk_ids, "bulk load");
+        if (!add_one_by_one)
+            return errors;
+
+        u32 boxes_count = u32(bulk_ids.size());
+        Manager* inc = new Manager();
+        fast_vector<Index> inc_ids(boxes_count);
+        for (u32 i=0; i<boxes_count; ++i) {
+            inc->addBox(inc_ids[i], (f32*)scene.getBounds(i), boxes_data[i]);
+        }
+        inc->validate();
+
+        fast_vector<u64> bulk_pairs, inc_pairs;
+        getPairs(bulk, bulk_ids, bulk_pairs);
+        getPairs(*inc, inc_ids, inc_pairs);
+        if (bulk_pairs != inc_pairs) {
+            std::cerr << "bulk load: " << bulk_pairs.size() << " pairs, added one by one " << inc_pairs.size() << std::endl;
+            ++errors;
+        }
+
+        fast_vector<u32> bulk_scene_ids, inc_scene_ids;
+        mapInnerIds<Manager>(bulk_ids, bulk_scene_ids);
+        mapInnerIds<Manager>(inc_ids, inc_scene_ids);
+        Random rnd(seed);
+        fast_vector<u32> bulk_found, inc_found;
+        for (u32 q=0; q<CHECK_QUERIES; ++q) {
+            // random box from scene enlarged to cover its surroundings
+            const f32* b = scene.getBounds(rnd.next()%boxes_count);
+            f32 query[AXES*2];
+            for (u32 a=0; a<AXES; ++a) {
+                f32 enlarge = rnd.get(0, 4*BOX_SIZE_MAX);
+                query[a] = b[a] - enlarge;
+                query[AXES+a] = b[AXES+a] + enlarge;
+            }
+            bulk_found.clear();
+            inc_found.clear();
+            bulk.queryAABB(query, [&](Index id) { bulk_found.push_back(bulk_scene_ids[id.getIndex()]); });
+            inc->queryAABB(query, [&](Index id) { inc_found.push_back(inc_scene_ids[id.getIndex()]); });
+            std::sort(bulk_found.begin(), bulk_found.end());
+            std::sort(inc_found.begin(), inc_found.end());
+            if (bulk_found != inc_found) {
+                std::cerr << "bulk load: query found " << bulk_found.size() << " boxes, added one by one " << inc_found.size() << std::endl;
+                ++errors;
+            }
+        }
+        delete inc;
+        return errors;
+    }
+
+    // boxes with equal bounds can't be separated by split (leafs stay over-full), added one by one & bulk loaded
+    template <typename Manager, u32 AXES>
+    static u32 checkDegenerate() {
+        static const u32 BOXES_COUNT = 150;
+        enum { dgPoint, dgEqual, dgFlat, dgCount };
+        static const char* CASE_NAMES[dgCount] = {"zero-size boxes at one point", "equal boxes", "boxes flat on axis 0"};
+
+        u32 errors = 0;
+        Random rnd(1);
+        fast_vector<f32> bounds(BOXES_COUNT*AXES*2);
+        fast_vector<typename Manager::BoxDataT> boxes_data(BOXES_COUNT);
+        for (u32 c=0; c<dgCount; ++c) {
+            for (u32 i=0; i<BOXES_COUNT; ++i) {
+                f32* b = &bounds[i*AXES*2];
+                for (u32 a=0; a<AXES; ++a) {
+                    if (c == dgPoint || (c == dgFlat && a == 0)) {
+                        b[a] = b[AXES+a] = 5.0f;
+                    }
+                    else if (c == dgEqual) {
+                        b[a] = 5.0f;
+                        b[AXES+a] = 6.0f;
+                    }
+                    else {
+                        b[a] = rnd.get(0, 10*BOX_SIZE_MAX);
+                        b[AXES+a] = b[a] + rnd.get(0, BOX_SIZE_MAX);
+                    }
+                }
+            }
+            for (u32 bulk=0; bulk<2; ++bulk) {
+                Manager* sap = new Manager();
+                fast_vector<Index> box_ids(BOXES_COUNT);
+                if (bulk) {
+                    sap->addBoxes(bounds.data(), boxes_data.data(), BOXES_COUNT, box_ids.data());
+                }
+                else {
+                    for (u32 i=0; i<BOXES_COUNT; ++i) {
+                        sap->addBox(box_ids[i], &bounds[i*AXES*2], boxes_data[i]);
+                    }
+                }
+                sap->validate();
+                errors += checkPairs<Manager, AXES>(*sap, box_ids, CASE_NAMES[c]);
+
+                // same move keeps bounds equal
+                f32 move_vec[AXES];
+                std::fill(move_vec, move_vec+AXES, 0.5f);
+                for (u32 f=0; f<3; ++f) {
+                    for (u32 i=0; i<BOXES_COUNT; ++i) {
+                        sap->moveBox(box_ids[i], move_vec);
+                    }
+                }
+                for (u32 i=0; i<BOXES_COUNT; i+=2) {
+                    sap->removeBox(box_ids[i]);
+                }
+                fast_vector<Index> remaining;
+                for (u32 i=1; i<BOXES_COUNT; i+=2) {
+                    remaining.push_back(box_ids[i]);
+                }
+                sap->validate();
+                errors += checkPairs<Manager, AXES>(*sap, remaining, CASE_NAMES[c]);
+                delete sap;
+            }
+        }
+        return errors;
+    }
+
+    static const u32 CHECK_BOXES = 2000;
+    static const u32 CHECK_FRAMES = 10;
+
+    // one frame of scene moves, every other frame as batch
+    template <typename Manager, u32 AXES>
+    static void moveAll(Manager& sap, const fast_vector<Index>& box_ids, Scene<AXES>& scene, u32 frame) {
+        u32 boxes_count = u32(box_ids.size());
+        if (frame%2) {
+            fast_vector<f32> move_vecs(boxes_count*AXES);
+            for (u32 i=0; i<boxes_count; ++i) {
+                memcpy(&move_vecs[i*AXES], scene.getMove(i), AXES*sizeof(f32));
+            }
+            sap.moveBoxes(box_ids.data(), move_vecs.data(), boxes_count);
+        }
+        else {
+            for (u32 i=0; i<boxes_count; ++i) {
+                sap.moveBox(box_ids[i], (f32*)scene.getMove(i));
+            }
+        }
+    }
+
+    // part of boxes removed and spawned again
+    template <typename Manager, u32 AXES>
+    static void churnSome(Manager& sap, fast_vector<Index>& box_ids, const fast_vector<typename Manager::BoxDataT>& boxes_data, Scene<AXES>& scene) {
+        u32 boxes_count = u32(box_ids.size());
+        for (u32 i=0; i<u32(boxes_count*CHURN_PART); ++i) {
+            u32 id = scene.accRandom().next()%boxes_count;
+            scene.spawn(id);
+            sap.removeBox(box_ids[id]);
+            sap.addBox(box_ids[id], (f32*)scene.getBounds(id), boxes_data[id]);
+        }
+    }
+
+    // began & ended events applied to pairs of previous frame must give current pairs
+    template <typename Manager, u32 AXES>
+    static u32 checkEvents() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 3);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+        sap->setOverlapEventsEnabled(true);
+
+        u32 errors = 0;
+        fast_vector<u64> pairs;
+        getPairs(*sap, box_ids, pairs);
+        std::set<u64> tracked(pairs.begin(), pairs.end());
+        fast_vector<u32> prev_scene_ids, scene_ids;
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            // ended pairs of removed boxes are mapped by ids before frame
+            mapInnerIds<Manager>(box_ids, prev_scene_ids);
+            churnSome(*sap, box_ids, boxes_data, scene);
+            moveAll(*sap, box_ids, scene, f);
+            mapInnerIds<Manager>(box_ids, scene_ids);
+
+            u32 wrong_events = 0;
+            for (const SAP::OverlapPair& p : sap->getEndedOverlaps()) {
+                if (!tracked.erase(pairKey(prev_scene_ids[p.box1_id.getIndex()], prev_scene_ids[p.box2_id.getIndex()])))
+                    ++wrong_events;
+            }
+            for (const SAP::OverlapPair& p : sap->getBeganOverlaps()) {
+                if (!tracked.insert(pairKey(scene_ids[p.box1_id.getIndex()], scene_ids[p.box2_id.getIndex()])).second)
+                    ++wrong_events;
+            }
+            sap->clearOverlapEvents();
+            if (wrong_events) {
+                std::cerr << "events: " << wrong_events << " events of missing or already existing pairs" << std::endl;
+                ++errors;
+            }
+
+            getPairs(*sap, box_ids, pairs);
+            if (fast_vector<u64>(tracked.begin(), tracked.end()) != pairs) {
+                std::cerr << "events: " << tracked.size() << " pairs from events, " << pairs.size() << " pairs" << std::endl;
+                ++errors;
+            }
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, box_ids, "events");
+        delete sap;
+        return errors;
+    }
+
+    // overlaps of each box must give same pairs (each from both sides) as pair list
+    template <typename Manager, u32 AXES>
+    static u32 checkAdjacency() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 4);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+
+        u32 errors = 0;
+        fast_vector<u32> scene_ids;
+        fast_vector<u64> pairs, adjacent;
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            churnSome(*sap, box_ids, boxes_data, scene);
+            moveAll(*sap, box_ids, scene, f);
+            if (f == CHECK_FRAMES/2) {
+                // holes in adjacency lists
+                for (u32 i=0; i<CHECK_BOXES/10; ++i) {
+                    u32 id = scene.accRandom().next()%u32(box_ids.size());
+                    sap->removeBox(box_ids[id]);
+                    box_ids[id] = box_ids.back();
+                    box_ids.pop_back();
+                }
+            }
+
+            mapInnerIds<Manager>(box_ids, scene_ids);
+            adjacent.clear();
+            u32 wrong_counts = 0;
+            for (u32 i=0; i<box_ids.size(); ++i) {
+                u32 count = 0;
+                sap->forEachOverlapOf(box_ids[i], [&](Index other_id, typename Manager::OverlapDataT&) {
+                    adjacent.push_back(pairKey(i, scene_ids[other_id.getIndex()]));
+                    ++count;
+                });
+                if (count != sap->getOverlapsCount(box_ids[i]))
+                    ++wrong_counts;
+            }
+            if (wrong_counts) {
+                std::cerr << "adjacency: " << wrong_counts << " boxes with wrong overlaps count" << std::endl;
+                ++errors;
+            }
+            std::sort(adjacent.begin(), adjacent.end());
+            getPairs(*sap, box_ids, pairs);
+            fast_vector<u64> doubled;
+            for (u32 i=0; i<pairs.size(); ++i) {
+                doubled.push_back(pairs[i]);
+                doubled.push_back(pairs[i]);
+            }
+            if (adjacent != doubled) {
+                std::cerr << "adjacency: " << adjacent.size() << " adjacent boxes, " << pairs.size() << " pairs" << std::endl;
+                ++errors;
+            }
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, box_ids, "adjacency");
+        delete sap;
+        return errors;
+    }
+
+    // box data is scene id, overlap data is pair key + 1 (0 for pairs that began after data was last set)
+    template <typename Domain>
+    class PairDataManager : public SAPManagerC<PairDataManager<Domain>, Domain> {
+        typedef SAPManagerC<PairDataManager<Domain>, Domain> Base;
+    public:
+        PairDataManager() : ended_with_data(0), wrong_data(0) {}
+
+        // data of ended pair must still be readable
+        void afterBoxesOverlap_(typename Base::Box& b1, typename Base::Box& b2) {
+            const u64* data = this->findOverlap(b1, b2);
+            if (!data || (*data && *data != pairKey(b1.getClientData(), b2.getClientData()) + 1))
+                ++wrong_data;
+            else if (*data)
+                ++ended_with_data;
+        }
+
+        u32 ended_with_data;
+        u32 wrong_data;
+    };
+
+    template <typename Manager>
+    static void setPairData(Manager& sap) {
+        for (u32 i=0; i<sap.getOverlapsCount(); ++i) {
+            Index b1_id, b2_id;
+            u64* data;
+            sap.getOverlapWithData(i, b1_id, b2_id, data);
+            *data = pairKey(sap.getBox(b1_id).getClientData(), sap.getBox(b2_id).getClientData()) + 1;
+        }
+    }
+
+    // pairs ended by moves, batches and removed boxes report their data to afterBoxesOverlap_
+    template <typename Manager, u32 AXES>
+    static u32 checkPairDataHook() {
+        typedef typename std::conditional<AXES == 2,
+                                          SAPDomain2D<u32, u64, typename Manager::Points, typename Manager::Policy>,
+                                          SAPDomain3D<u32, u64, typename Manager::Points, typename Manager::Policy> >::type Domain;
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 19);
+        PairDataManager<Domain>* sap = new PairDataManager<Domain>();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<u32> boxes_data(CHECK_BOXES);
+        for (u32 i=0; i<CHECK_BOXES; ++i) {
+            boxes_data[i] = i;
+        }
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            setPairData(*sap);
+            churnSome(*sap, box_ids, boxes_data, scene);
+            moveAll(*sap, box_ids, scene, f);
+        }
+        setPairData(*sap);
+        for (u32 i=0; i<CHECK_BOXES; i+=2) {
+            sap->removeBox(box_ids[i]);
+        }
+
+        u32 errors = 0;
+        if (sap->wrong_data || !sap->ended_with_data) {
+            std::cerr << "pair data hook: " << sap->wrong_data << " ended pairs with missing or wrong data ("
+                      << sap->ended_with_data << " right)" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    static SAP::CollisionFilter randomFilter(Random& rnd) {
+        // few categories, so both allowed & filtered pairs are common
+        return SAP::CollisionFilter(1u << (rnd.next()%4), rnd.next()%16);
+    }
+
+    // filters set when adding and changed while boxes move (also in parallel batches)
+    template <typename Manager, u32 AXES>
+    static u32 checkFilters() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 5);
+        Manager* sap = new Manager();
+        sap->setWorkersCount(4);
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        fast_vector<SAP::CollisionFilter> filters(CHECK_BOXES);
+        Random& rnd = scene.accRandom();
+        for (u32 i=0; i<CHECK_BOXES; ++i) {
+            filters[i] = randomFilter(rnd);
+        }
+        // half bulk loaded, half added one by one
+        u32 bulk_count = CHECK_BOXES/2;
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), bulk_count, box_ids.data(), filters.data());
+        for (u32 i=bulk_count; i<CHECK_BOXES; ++i) {
+            sap->addBox(box_ids[i], (f32*)scene.getBounds(i), boxes_data[i], filters[i]);
+        }
+        sap->validate();
+        u32 errors = checkPairs<Manager, AXES>(*sap, box_ids, "filters added");
+
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            for (u32 i=0; i<CHECK_BOXES/20; ++i) {
+                u32 id = rnd.next()%CHECK_BOXES;
+                sap->setCollisionFilter(box_ids[id], randomFilter(rnd));
+            }
+            errors += checkPairs<Manager, AXES>(*sap, box_ids, "filters changed");
+            moveAll(*sap, box_ids, scene, f);
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, box_ids, "filters");
+        delete sap;
+        return errors;
+    }
+
+    // tight & fat reporting with fat margin, switched while boxes move
+    template <typename Manager, u32 AXES>
+    static u32 checkFatMargin() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 2);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+        sap->setFatMargin(2.0f);
+
+        u32 errors = 0;
+        for (u32 f=0; f<CHECK_FRAMES*3; ++f) {
+            if (f == CHECK_FRAMES || f == CHECK_FRAMES*2) {
+                sap->setReportFatOverlaps(!sap->getReportFatOverlaps());
+                sap->validate();
+                errors += checkPairs<Manager, AXES>(*sap, box_ids, "fat margin switched");
+            }
+            moveAll(*sap, box_ids, scene, f);
+            // teleport leaves fat bounds
+            u32 id = scene.accRandom().next()%CHECK_BOXES;
+            scene.spawn(id);
+            sap->updateBox(box_ids[id], (f32*)scene.getBounds(id));
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, box_ids, "fat margin");
+        delete sap;
+        return errors;
+    }
+
+    // leafs count & boxes (awake and sleeping) in fullest leaf
+    template <typename Segment>
+    static void getLeafsInfo(Segment* seg, u32& leafs_count, u32& max_leaf_boxes) {
+        if (seg->isSplit()) {
+            getLeafsInfo(seg->getChild(0), leafs_count, max_leaf_boxes);
+            getLeafsInfo(seg->getChild(1), leafs_count, max_leaf_boxes);
+            return;
+        }
+        ++leafs_count;
+        max_leaf_boxes = std::max(max_leaf_boxes, seg->getBoxesCount() + seg->getSleepingBoxesCount());
+    }
+
+    // static boxes among moving ones, moving boxes put to sleep & woken (or woken by update)
+    template <typename Manager, u32 AXES>
+    static u32 checkSleeping() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 6);
+        Scene<AXES> static_scene(stUniform, CHECK_BOXES/2, 7);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+        // static boxes are last in all ids
+        fast_vector<Index> all_ids = box_ids;
+        for (u32 i=0; i<CHECK_BOXES/2; ++i) {
+            Index id;
+            sap->addStaticBox(id, (f32*)static_scene.getBounds(i), boxes_data[i]);
+            all_ids.push_back(id);
+        }
+        sap->validate();
+        u32 errors = checkPairs<Manager, AXES>(*sap, all_ids, "static boxes added");
+
+        Random& rnd = scene.accRandom();
+        fast_vector<Index> awake_ids;
+        fast_vector<f32> move_vecs;
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            for (u32 i=0; i<CHECK_BOXES/20; ++i) {
+                u32 id = rnd.next()%CHECK_BOXES;
+                if (sap->getBox(box_ids[id]).isSleeping())
+                    sap->wakeBox(box_ids[id]);
+                else
+                    sap->sleepBox(box_ids[id]);
+            }
+            // update wakes box
+            u32 id = rnd.next()%CHECK_BOXES;
+            scene.spawn(id);
+            sap->updateBox(box_ids[id], (f32*)scene.getBounds(id));
+
+            awake_ids.clear();
+            move_vecs.clear();
+            for (u32 i=0; i<CHECK_BOXES; ++i) {
+                if (sap->getBox(box_ids[i]).isSleeping())
+                    continue;
+                awake_ids.push_back(box_ids[i]);
+                const f32* mv = scene.getMove(i);
+                move_vecs.insert(move_vecs.end(), mv, mv+AXES);
+            }
+            if (f%2) {
+                sap->moveBoxes(awake_ids.data(), move_vecs.data(), u32(awake_ids.size()));
+            }
+            else {
+                for (u32 i=0; i<awake_ids.size(); ++i) {
+                    sap->moveBox(awake_ids[i], &move_vecs[i*AXES]);
+                }
+            }
+            errors += checkPairs<Manager, AXES>(*sap, all_ids, "sleeping");
+        }
+        sap->validate();
+        delete sap;
+
+        // only static boxes, leafs are split by weighted counts and merged again when boxes are removed
+        sap = new Manager();
+        fast_vector<Index> static_ids(CHECK_BOXES);
+        Scene<AXES> clutter(stUniform, CHECK_BOXES, 8);
+        for (u32 i=0; i<CHECK_BOXES; ++i) {
+            sap->addStaticBox(static_ids[i], (f32*)clutter.getBounds(i), boxes_data[i]);
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, static_ids, "static clutter");
+        u32 max_leaf_boxes = SAP::DefaultPolicy::MAX_BOXES_IN_SEGMENT*SAP::DefaultPolicy::SLEEPING_BOXES_PER_BOX;
+        u32 leafs_count = 0, fullest_leaf = 0;
+        getLeafsInfo(sap->getRootSegment(), leafs_count, fullest_leaf);
+        if (leafs_count < 2 || fullest_leaf > 2*max_leaf_boxes) {
+            std::cerr << "static clutter: " << leafs_count << " leafs, " << fullest_leaf << " boxes in largest one" << std::endl;
+            ++errors;
+        }
+        for (u32 i=0; i<CHECK_BOXES*3/4; ++i) {
+            sap->removeBox(static_ids.back());
+            static_ids.pop_back();
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, static_ids, "static clutter removed");
+        u32 removed_leafs_count = 0;
+        fullest_leaf = 0;
+        getLeafsInfo(sap->getRootSegment(), removed_leafs_count, fullest_leaf);
+        if (removed_leafs_count >= leafs_count) {
+            std::cerr << "static clutter removed: leafs were not merged" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    // leafs restructured in small budgets between frames (queued ones stay over/under-full meanwhile)
+    template <typename Manager, u32 AXES>
+    static u32 checkDeferredMaintenance() {
+        Scene<AXES> scene(stClustered, CHECK_BOXES, 9);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->setDeferredTreeMaintenance(true);
+        // added one by one so splits get queued
+        for (u32 i=0; i<CHECK_BOXES; ++i) {
+            sap->addBox(box_ids[i], (f32*)scene.getBounds(i), boxes_data[i]);
+        }
+        u32 errors = 0;
+        if (!sap->getQueuedMaintenanceCount()) {
+            std::cerr << "deferred maintenance: no leafs queued" << std::endl;
+            ++errors;
+        }
+        errors += checkPairs<Manager, AXES>(*sap, box_ids, "deferred maintenance added");
+
+        for (u32 f=0; f<CHECK_FRAMES*3; ++f) {
+            churnSome(*sap, box_ids, boxes_data, scene);
+            moveAll(*sap, box_ids, scene, f);
+            if (f%2)
+                sap->maintainTree(2);
+            else
+                sap->maintainTree(0, 50);
+            sap->validate();
+            errors += checkPairs<Manager, AXES>(*sap, box_ids, "deferred maintenance");
+        }
+        sap->maintainTree(0);
+        if (sap->getQueuedMaintenanceCount()) {
+            std::cerr << "deferred maintenance: " << sap->getQueuedMaintenanceCount() << " leafs queued after unlimited budget" << std::endl;
+            ++errors;
+        }
+        // disabling restructures what got queued meanwhile
+        moveAll(*sap, box_ids, scene, 0);
+        sap->setDeferredTreeMaintenance(false);
+        if (sap->getQueuedMaintenanceCount()) {
+            std::cerr << "deferred maintenance: " << sap->getQueuedMaintenanceCount() << " leafs queued after disabling" << std::endl;
+            ++errors;
+        }
+        sap->validate();
+        errors += checkPairs<Manager, AXES>(*sap, box_ids, "deferred maintenance disabled");
+        delete sap;
+        return errors;
+    }
+
+    // file in working dir not shared with other sap_bench processes (ctest runs check variants in parallel)
+    static std::string checkFilePath(const char* ext) {
+        return "sap_bench_check_" + std::to_string(Clock::now().time_since_epoch().count()) + "_"
+               + std::to_string(std::random_device()()) + ext;
+    }
+
+    // all recorded operation types, replayed frame by frame into fresh manager must give same pairs
+    template <typename Manager, u32 AXES>
+    static u32 checkTrace() {
+        const std::string trace_path = checkFilePath(".trace");
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 10);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        fast_vector<SAP::CollisionFilter> filters(CHECK_BOXES);
+        Random& rnd = scene.accRandom();
+        for (u32 i=0; i<CHECK_BOXES; ++i) {
+            filters[i] = randomFilter(rnd);
+        }
+        // boxes already in manager are recorded as added
+        u32 first_count = CHECK_BOXES/2;
+        sap->setFatMargin(1.0f);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), first_count, box_ids.data(), filters.data());
+        u32 errors = 0;
+        if (!sap->startRecording(trace_path.c_str())) {
+            std::cerr << "trace: can't record to " << trace_path << std::endl;
+            delete sap;
+            return 1;
+        }
+        for (u32 i=first_count; i<CHECK_BOXES; ++i) {
+            sap->addBox(box_ids[i], (f32*)scene.getBounds(i), boxes_data[i], filters[i]);
+        }
+        fast_vector<Index> static_ids(CHECK_BOXES/20);
+        Scene<AXES> static_scene(stUniform, u32(static_ids.size()), 11);
+        for (u32 i=0; i<static_ids.size(); ++i) {
+            sap->addStaticBox(static_ids[i], (f32*)static_scene.getBounds(i), boxes_data[i], filters[i]);
+        }
+
+        std::vector<PairsBounds> frames_pairs(CHECK_FRAMES);
+        fast_vector<Index> updated_ids;
+        fast_vector<f32> updated_bounds;
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            churnSome(*sap, box_ids, boxes_data, scene);
+            for (u32 i=0; i<CHECK_BOXES/50; ++i) {
+                u32 id = rnd.next()%CHECK_BOXES;
+                sap->setCollisionFilter(box_ids[id], randomFilter(rnd));
+                sap->sleepBox(box_ids[rnd.next()%CHECK_BOXES]);
+                // move wakes it again
+            }
+            updated_ids.clear();
+            updated_bounds.clear();
+            for (u32 i=0; i<CHECK_BOXES/50; ++i) {
+                u32 id = rnd.next()%CHECK_BOXES;
+                scene.spawn(id);
+                updated_ids.push_back(box_ids[id]);
+                updated_bounds.insert(updated_bounds.end(), scene.getBounds(id), scene.getBounds(id)+AXES*2);
+            }
+            if (f == CHECK_FRAMES/2) {
+                sap->setFatMargin(2.0f);
+                sap->setReportFatOverlaps(true);
+            }
+            sap->updateBoxes(updated_ids.data(), updated_bounds.data(), u32(updated_ids.size()));
+            moveAll(*sap, box_ids, scene, f);
+            getPairsBounds<Manager, AXES>(*sap, frames_pairs[f]);
+            sap->recordFrameEnd();
+        }
+        if (!sap->stopRecording()) {
+            std::cerr << "trace: write failed" << std::endl;
+            ++errors;
+        }
+
+        SAPTraceReader reader;
+        if (!reader.open(trace_path.c_str()) || reader.getAxesCount() != AXES || !reader.isComplete()) {
+            std::cerr << "trace: can't open recorded trace" << std::endl;
+            ++errors;
+        }
+        else {
+            Manager* replayed = new Manager();
+            PairsBounds pairs;
+            u32 frames = 0;
+            while (reader.replayFrame(*replayed)) {
+                if (frames < CHECK_FRAMES) {
+                    getPairsBounds<Manager, AXES>(*replayed, pairs);
+                    if (pairs != frames_pairs[frames]) {
+                        std::cerr << "trace: frame " << frames << " replayed with " << pairs.size() << " pairs, recorded " << frames_pairs[frames].size() << std::endl;
+                        ++errors;
+                    }
+                }
+                ++frames;
+            }
+            if (frames != CHECK_FRAMES) {
+                std::cerr << "trace: replayed " << frames << " frames, recorded " << CHECK_FRAMES << std::endl;
+                ++errors;
+            }
+            if (replayed->getBoxesCount() != sap->getBoxesCount() || replayed->getReportFatOverlaps() != sap->getReportFatOverlaps()
+                || replayed->getFatMargin() != sap->getFatMargin()) {
+                std::cerr << "trace: replayed manager differs in boxes count or fat settings" << std::endl;
+                ++errors;
+            }
+            replayed->validate();
+            delete replayed;
+        }
+        std::remove(trace_path.c_str());
+        delete sap;
+        return errors;
+    }
+
+    // loaded manager (from file & memory) must have same pairs & query results and keep working same as saved one
+    template <typename Manager, u32 AXES>
+    static u32 checkSnapshot() {
+        const std::string snapshot_path = checkFilePath(".snapshot");
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 12);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        fast_vector<SAP::CollisionFilter> filters(CHECK_BOXES);
+        Random& rnd = scene.accRandom();
+        for (u32 i=0; i<CHECK_BOXES; ++i) {
+            filters[i] = randomFilter(rnd);
+            boxes_data[i] = typename Manager::BoxDataT(i);
+        }
+        sap->setFatMargin(1.0f);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data(), filters.data());
+        for (u32 f=0; f<CHECK_FRAMES/2; ++f) {
+            churnSome(*sap, box_ids, boxes_data, scene);
+            moveAll(*sap, box_ids, scene, f);
+        }
+        for (u32 i=0; i<CHECK_BOXES/20; ++i) {
+            sap->sleepBox(box_ids[rnd.next()%CHECK_BOXES]);
+        }
+
+        u32 errors = 0;
+        if (!sap->saveSnapshot(snapshot_path.c_str())) {
+            std::cerr << "snapshot: can't save to " << snapshot_path << std::endl;
+            delete sap;
+            return 1;
+        }
+        Manager* loaded[2] = {new Manager(), new Manager()};
+        fast_vector<Index> ids_map[2];
+        bool ok = loaded[0]->loadSnapshot(snapshot_path.c_str(), &ids_map[0]);
+        std::ifstream file(snapshot_path.c_str(), std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        ok = ok && loaded[1]->loadSnapshot(data.data(), data.size(), &ids_map[1]);
+        file.close();
+        std::remove(snapshot_path.c_str());
+        // missing file leaves manager unchanged
+        ok = ok && !loaded[0]->loadSnapshot(snapshot_path.c_str()) && loaded[0]->getBoxesCount() == sap->getBoxesCount();
+        if (!ok) {
+            std::cerr << "snapshot: load failed" << std::endl;
+            delete loaded[0];
+            delete loaded[1];
+            delete sap;
+            return 1;
+        }
+
+        fast_vector<Index> loaded_ids[2];
+        Scene<AXES> loaded_scenes[2] = {scene, scene};
+        fast_vector<u64> pairs, loaded_pairs;
+        fast_vector<u32> found, loaded_found;
+        for (u32 l=0; l<2; ++l) {
+            u32 wrong_boxes = 0;
+            for (u32 i=0; i<CHECK_BOXES; ++i) {
+                Index id = ids_map[l][box_ids[i].getIndex()];
+                loaded_ids[l].push_back(id);
+                const typename Manager::Box& b = loaded[l]->getBox(id);
+                const typename Manager::Box& orig = sap->getBox(box_ids[i]);
+                if (b.getClientData() != orig.getClientData() || b.isSleeping() != orig.isSleeping()
+                    || memcmp(b.getBounds(), orig.getBounds(), AXES*2*sizeof(f32))
+                    || loaded[l]->getCollisionFilter(id).category != sap->getCollisionFilter(box_ids[i]).category
+                    || loaded[l]->getCollisionFilter(id).mask != sap->getCollisionFilter(box_ids[i]).mask)
+                    ++wrong_boxes;
+            }
+            if (wrong_boxes) {
+                std::cerr << "snapshot: " << wrong_boxes << " boxes differ after load" << std::endl;
+                ++errors;
+            }
+            loaded[l]->validate();
+            errors += checkPairs<Manager, AXES>(*loaded[l], loaded_ids[l], "snapshot loaded");
+
+            fast_vector<u32> scene_ids, loaded_scene_ids;
+            mapInnerIds<Manager>(box_ids, scene_ids);
+            mapInnerIds<Manager>(loaded_ids[l], loaded_scene_ids);
+            for (u32 q=0; q<CHECK_QUERIES; ++q) {
+                const f32* b = scene.getBounds(rnd.next()%CHECK_BOXES);
+                f32 query[AXES*2];
+                for (u32 a=0; a<AXES; ++a) {
+                    query[a] = b[a] - 2*BOX_SIZE_MAX;
+                    query[AXES+a] = b[AXES+a] + 2*BOX_SIZE_MAX;
+                }
+                found.clear();
+                loaded_found.clear();
+                sap->queryAABB(query, [&](Index id) { found.push_back(scene_ids[id.getIndex()]); });
+                loaded[l]->queryAABB(query, [&](Index id) { loaded_found.push_back(loaded_scene_ids[id.getIndex()]); });
+                std::sort(found.begin(), found.end());
+                std::sort(loaded_found.begin(), loaded_found.end());
+                if (found != loaded_found) {
+                    std::cerr << "snapshot: query found " << loaded_found.size() << " boxes, " << found.size() << " before save" << std::endl;
+                    ++errors;
+                }
+            }
+        }
+
+        // all keep moving same way
+        for (u32 f=0; f<CHECK_FRAMES/2; ++f) {
+            moveAll(*sap, box_ids, scene, f);
+            getPairs(*sap, box_ids, pairs);
+            for (u32 l=0; l<2; ++l) {
+                moveAll(*loaded[l], loaded_ids[l], loaded_scenes[l], f);
+                getPairs(*loaded[l], loaded_ids[l], loaded_pairs);
+                if (pairs != loaded_pairs) {
+                    std::cerr << "snapshot: " << loaded_pairs.size() << " pairs after load & move, " << pairs.size() << " without save" << std::endl;
+                    ++errors;
+                }
+            }
+        }
+        for (u32 l=0; l<2; ++l) {
+            loaded[l]->validate();
+            errors += checkPairs<Manager, AXES>(*loaded[l], loaded_ids[l], "snapshot moved");
+            delete loaded[l];
+        }
+        delete sap;
+        return errors;
+    }
+
+    typedef std::vector<std::pair<u32, f32> > RayHits;     // scene ids & t
+
+    // slab test of segment origin + t*dir (t in [0, 1]) with bounds independent of raycaster, reports entry t
+    // (exit t when origin is inside), box with extents is swept as its min corner against bounds with mins lowered
+    // by extents (t is 0 when it overlaps at start)
+    template <u32 AXES>
+    static bool bruteForceHit(const f32* origin, const f32* dir, const f32* extents, const f32* bounds, f32& t_out) {
+        f32 t_from = -FLT_MAX, t_to = FLT_MAX;
+        for (u32 a=0; a<AXES; ++a) {
+            f32 low = bounds[a] - (extents?extents[a]:0.0f);
+            f32 high = bounds[AXES+a];
+            if (dir[a] == 0.0f) {
+                if (origin[a] < low || origin[a] > high)
+                    return false;
+                continue;
+            }
+            f32 t1 = (low - origin[a])/dir[a];
+            f32 t2 = (high - origin[a])/dir[a];
+            t_from = std::max(t_from, std::min(t1, t2));
+            t_to = std::min(t_to, std::max(t1, t2));
+        }
+        if (t_from > t_to || t_to < 0 || t_from > 1.0f)
+            return false;
+        t_out = (t_from >= 0)?t_from:(extents?0.0f:t_to);
+        return true;
+    }
+
+    // all hits sorted by scene ids
+    template <typename Manager, u32 AXES>
+    static void getBruteForceHits(const Manager& sap, const fast_vector<Index>& box_ids, const f32* origin, const f32* dir, const f32* extents, RayHits& hits_out) {
+        hits_out.clear();
+        for (u32 i=0; i<box_ids.size(); ++i) {
+            f32 t;
+            if (bruteForceHit<AXES>(origin, dir, extents, sap.getBox(box_ids[i]).getBounds(), t))
+                hits_out.push_back(std::make_pair(i, t));
+        }
+    }
+
+    // same boxes (each once) with t up to rounding
+    static bool sameHits(RayHits hits, const RayHits& expected) {
+        std::sort(hits.begin(), hits.end());
+        if (hits.size() != expected.size())
+            return false;
+        for (u32 i=0; i<hits.size(); ++i) {
+            if (hits[i].first != expected[i].first || std::fabs(hits[i].second - expected[i].second) > 1e-4f)
+                return false;
+        }
+        return true;
+    }
+
+    static bool hitsCloser(const std::pair<u32, f32>& h1, const std::pair<u32, f32>& h2) {
+        return h1.second < h2.second;
+    }
+
+    // split tree with moved & sleeping boxes for ray queries
+    template <typename Manager, u32 AXES>
+    static Manager* createRayScene(Scene<AXES>& scene, fast_vector<Index>& box_ids) {
+        Manager* sap = new Manager();
+        box_ids.resize(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->setFatMargin(0.5f);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+        for (u32 f=0; f<CHECK_FRAMES/2; ++f) {
+            moveAll(*sap, box_ids, scene, f);
+        }
+        for (u32 i=0; i<CHECK_BOXES/20; ++i) {
+            sap->sleepBox(box_ids[scene.accRandom().next()%CHECK_BOXES]);
+        }
+        return sap;
+    }
+
+    // rays long enough to cross many leafs, starting at boxes centers
+    template <u32 AXES>
+    static void randomRays(Scene<AXES>& scene, u32 rays_count, fast_vector<f32>& origins_out, fast_vector<f32>& dirs_out) {
+        Random& rnd = scene.accRandom();
+        origins_out.resize(rays_count*AXES);
+        dirs_out.resize(rays_count*AXES);
+        for (u32 r=0; r<rays_count; ++r) {
+            const f32* b = scene.getBounds(rnd.next()%CHECK_BOXES);
+            for (u32 a=0; a<AXES; ++a) {
+                origins_out[r*AXES + a] = (b[a] + b[AXES+a])/2 + rnd.get(-BOX_SIZE_MAX, BOX_SIZE_MAX);
+                dirs_out[r*AXES + a] = rnd.get(-30*BOX_SIZE_MAX, 30*BOX_SIZE_MAX);
+            }
+        }
+    }
+
+    // packet hits of each ray (in more packets) vs brute force, buffered ones must be nearest
+    template <typename Manager, u32 AXES>
+    static u32 checkPacketRaycast() {
+        static const u32 RAYS_COUNT = 150;
+        static const u32 MAX_HITS = 3;
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 14);
+        fast_vector<Index> box_ids;
+        Manager* sap = createRayScene<Manager, AXES>(scene, box_ids);
+        fast_vector<f32> origins, dirs;
+        randomRays(scene, RAYS_COUNT, origins, dirs);
+
+        fast_vector<u32> scene_ids;
+        mapInnerIds<Manager>(box_ids, scene_ids);
+        typename Manager::Raycaster rc = sap->getRayCaster();
+        rc.setRays(origins.data(), dirs.data(), RAYS_COUNT);
+        std::vector<RayHits> hits(RAYS_COUNT);
+        // hits of each ray must come near to far across all leaves
+        u32 unordered_hits = 0;
+        rc.getPacketHits([&](u32 ray_id, u32 box_id, f32 t) {
+            if (!hits[ray_id].empty() && t < hits[ray_id].back().second)
+                ++unordered_hits;
+            hits[ray_id].push_back(std::make_pair(scene_ids[box_id], t));
+            return true;
+        });
+        fast_vector<typename Manager::Raycaster::RayHit> nearest;
+        rc.getPacketHits(nearest, MAX_HITS);
+
+        u32 errors = 0;
+        u32 wrong_rays = 0, wrong_nearest = 0, hits_count = 0;
+        RayHits expected;
+        u32 nearest_id = 0;
+        for (u32 r=0; r<RAYS_COUNT; ++r) {
+            getBruteForceHits<Manager, AXES>(*sap, box_ids, &origins[r*AXES], &dirs[r*AXES], NULL, expected);
+            hits_count += u32(expected.size());
+            if (!sameHits(hits[r], expected))
+                ++wrong_rays;
+
+            std::sort(expected.begin(), expected.end(), hitsCloser);
+            expected.resize(std::min(u32(expected.size()), MAX_HITS));
+            RayHits ray_nearest;
+            for (; nearest_id<nearest.size() && nearest[nearest_id].ray_id == r; ++nearest_id) {
+                ray_nearest.push_back(std::make_pair(scene_ids[nearest[nearest_id].box_id], nearest[nearest_id].t));
+                if (ray_nearest.size() > 1 && ray_nearest.back().second < ray_nearest[ray_nearest.size()-2].second)
+                    ++wrong_nearest;
+            }
+            // equal t could swap boxes, compare only t
+            bool same = (ray_nearest.size() == expected.size());
+            for (u32 i=0; same && i<expected.size(); ++i) {
+                same = std::fabs(ray_nearest[i].second - expected[i].second) <= 1e-4f;
+            }
+            if (!same)
+                ++wrong_nearest;
+        }
+        if (wrong_rays || wrong_nearest || unordered_hits || nearest_id != nearest.size() || !hits_count) {
+            std::cerr << "packet raycast: " << wrong_rays << " rays with wrong hits, " << wrong_nearest << " with wrong nearest hits, "
+                      << unordered_hits << " hits out of order (" << hits_count << " hits)" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    // nearest hit must have lowest brute force t (other box with same t could be reported)
+    static bool rightClosestHit(const RayHits& expected, bool hit, u32 scene_id, f32 t) {
+        if (expected.empty())
+            return !hit;
+        f32 t_min = std::min_element(expected.begin(), expected.end(), hitsCloser)->second;
+        RayHits::const_iterator it = std::lower_bound(expected.begin(), expected.end(), std::make_pair(hit?scene_id:0, -FLT_MAX));
+        return hit && it != expected.end() && it->first == scene_id && std::fabs(t - t_min) <= 1e-4f;
+    }
+
+    // any hit must be one of brute force hits
+    static bool rightAnyHit(const RayHits& expected, bool hit, u32 scene_id) {
+        if (expected.empty())
+            return !hit;
+        RayHits::const_iterator it = std::lower_bound(expected.begin(), expected.end(), std::make_pair(hit?scene_id:0, -FLT_MAX));
+        return hit && it != expected.end() && it->first == scene_id;
+    }
+
+    template <typename Manager, u32 AXES>
+    static u32 checkClosestAnyHit() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 15);
+        fast_vector<Index> box_ids;
+        Manager* sap = createRayScene<Manager, AXES>(scene, box_ids);
+        fast_vector<f32> origins, dirs;
+        randomRays(scene, CHECK_QUERIES, origins, dirs);
+
+        fast_vector<u32> scene_ids;
+        mapInnerIds<Manager>(box_ids, scene_ids);
+        typename Manager::Raycaster rc = sap->getRayCaster();
+        u32 wrong_closest = 0, wrong_any = 0, hit_rays = 0;
+        RayHits expected;
+        for (u32 r=0; r<CHECK_QUERIES; ++r) {
+            getBruteForceHits<Manager, AXES>(*sap, box_ids, &origins[r*AXES], &dirs[r*AXES], NULL, expected);
+            rc.setRay(&origins[r*AXES], &dirs[r*AXES]);
+            u32 box_id = InvalidId();
+            f32 t = 0.0f;
+            bool closest = rc.getClosestHit(box_id, t);
+            if (!rightClosestHit(expected, closest, closest?scene_ids[box_id]:0, t))
+                ++wrong_closest;
+            bool any = rc.anyHit(&box_id);
+            if (!rightAnyHit(expected, any, any?scene_ids[box_id]:0))
+                ++wrong_any;
+            hit_rays += u32(!expected.empty());
+        }
+        u32 errors = 0;
+        if (wrong_closest || wrong_any || !hit_rays) {
+            std::cerr << "closest & any hit: " << wrong_closest << " wrong closest, " << wrong_any << " wrong any hits ("
+                      << hit_rays << " rays hit)" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    // huge boxes in many leafs must be reported once, hits near to far, stopped query reports nearest ones
+    template <typename Manager, u32 AXES>
+    static u32 checkRayHits() {
+        static const u32 STOP_AFTER = 2;
+        Scene<AXES> scene(stMixed, CHECK_BOXES, 16);
+        fast_vector<Index> box_ids;
+        Manager* sap = createRayScene<Manager, AXES>(scene, box_ids);
+        fast_vector<f32> origins, dirs;
+        randomRays(scene, CHECK_QUERIES, origins, dirs);
+
+        fast_vector<u32> scene_ids;
+        mapInnerIds<Manager>(box_ids, scene_ids);
+        typename Manager::Raycaster rc = sap->getRayCaster();
+        u32 wrong_hits = 0, wrong_order = 0, wrong_stopped = 0, hits_count = 0;
+        RayHits hits, expected;
+        for (u32 r=0; r<CHECK_QUERIES; ++r) {
+            getBruteForceHits<Manager, AXES>(*sap, box_ids, &origins[r*AXES], &dirs[r*AXES], NULL, expected);
+            hits_count += u32(expected.size());
+            rc.setRay(&origins[r*AXES], &dirs[r*AXES]);
+            hits.clear();
+            rc.getHits([&](u32 box_id, f32 t) {
+                if (!hits.empty() && t < hits.back().second)
+                    ++wrong_order;
+                hits.push_back(std::make_pair(scene_ids[box_id], t));
+                return true;
+            });
+            // duplicates make sizes differ
+            if (!sameHits(hits, expected))
+                ++wrong_hits;
+
+            u32 reported = 0;
+            f32 t_last = 0.0f;
+            rc.getHits([&](u32, f32 t) {
+                t_last = t;
+                return ++reported < STOP_AFTER;
+            });
+            std::sort(expected.begin(), expected.end(), hitsCloser);
+            if (reported != std::min(u32(expected.size()), STOP_AFTER) || (reported && std::fabs(t_last - expected[reported-1].second) > 1e-4f))
+                ++wrong_stopped;
+        }
+        u32 errors = 0;
+        if (wrong_hits || wrong_order || wrong_stopped || !hits_count) {
+            std::cerr << "ray hits: " << wrong_hits << " rays with wrong hits, " << wrong_order << " hits out of order, "
+                      << wrong_stopped << " wrong stopped queries (" << hits_count << " hits)" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    // swept boxes (both overloads) vs brute force of their min corners against boxes grown by extents,
+    // ray set before sweeping must be kept
+    template <typename Manager, u32 AXES>
+    static u32 checkSweepBox() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 17);
+        fast_vector<Index> box_ids;
+        Manager* sap = createRayScene<Manager, AXES>(scene, box_ids);
+        fast_vector<f32> origins, move_vecs;
+        randomRays(scene, CHECK_QUERIES, origins, move_vecs);
+
+        fast_vector<u32> scene_ids;
+        mapInnerIds<Manager>(box_ids, scene_ids);
+        typename Manager::Raycaster rc = sap->getRayCaster();
+        typename Manager::Raycaster::Scratch scratch;
+        Random& rnd = scene.accRandom();
+        u32 wrong_hits = 0, wrong_order = 0, wrong_ray = 0, hits_count = 0;
+        RayHits hits[2], expected;
+        f32 bounds[AXES*2], extents[AXES];
+        for (u32 q=0; q<CHECK_QUERIES; ++q) {
+            const f32* origin = &origins[q*AXES];
+            for (u32 a=0; a<AXES; ++a) {
+                extents[a] = rnd.get(0.0f, 2*BOX_SIZE_MAX);
+                bounds[a] = origin[a];
+                bounds[AXES+a] = origin[a] + extents[a];
+            }
+            getBruteForceHits<Manager, AXES>(*sap, box_ids, origin, &move_vecs[q*AXES], extents, expected);
+            hits_count += u32(expected.size());
+            for (u32 i=0; i<2; ++i) {
+                hits[i].clear();
+                auto cb = [&](u32 box_id, f32 t) {
+                    if (!hits[i].empty() && t < hits[i].back().second)
+                        ++wrong_order;
+                    hits[i].push_back(std::make_pair(scene_ids[box_id], t));
+                    return true;
+                };
+                if (i == 0) {
+                    rc.setRay(&origins[q*AXES], &move_vecs[((q+1)%CHECK_QUERIES)*AXES]);
+                    rc.sweepBox(bounds, &move_vecs[q*AXES], cb);
+                }
+                else {
+                    rc.sweepBox(bounds, &move_vecs[q*AXES], scratch, cb);
+                }
+                if (!sameHits(hits[i], expected))
+                    ++wrong_hits;
+            }
+
+            RayHits ray_hits, ray_expected;
+            getBruteForceHits<Manager, AXES>(*sap, box_ids, origin, &move_vecs[((q+1)%CHECK_QUERIES)*AXES], NULL, ray_expected);
+            rc.getHits([&](u32 box_id, f32 t) {
+                ray_hits.push_back(std::make_pair(scene_ids[box_id], t));
+                return true;
+            });
+            if (!sameHits(ray_hits, ray_expected))
+                ++wrong_ray;
+        }
+        u32 errors = 0;
+        if (wrong_hits || wrong_order || wrong_ray || !hits_count) {
+            std::cerr << "sweep box: " << wrong_hits << " sweeps with wrong hits, " << wrong_order << " hits out of order, "
+                      << wrong_ray << " rays changed by sweep (" << hits_count << " hits)" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    // const closest & any hit queries with scratch per thread (huge boxes are tested once per query)
+    template <typename Manager, u32 AXES>
+    static u32 checkConstHits() {
+        static const u32 THREADS = 4;
+        Scene<AXES> scene(stMixed, CHECK_BOXES, 18);
+        fast_vector<Index> box_ids;
+        Manager* sap = createRayScene<Manager, AXES>(scene, box_ids);
+        fast_vector<f32> origins, dirs;
+        randomRays(scene, CHECK_QUERIES, origins, dirs);
+
+        const typename Manager::Raycaster rc = sap->getRayCaster();
+        std::vector<u32> closest_ids(CHECK_QUERIES, u32(InvalidId())), any_ids(CHECK_QUERIES, u32(InvalidId()));
+        std::vector<f32> closest_ts(CHECK_QUERIES);
+        std::vector<std::thread> threads;
+        for (u32 th=0; th<THREADS; ++th) {
+            threads.emplace_back([&, th]() {
+                typename Manager::Raycaster::Scratch scratch;
+                for (u32 r=th; r<CHECK_QUERIES; r+=THREADS) {
+                    rc.getClosestHit(&origins[r*AXES], &dirs[r*AXES], scratch, closest_ids[r], closest_ts[r]);
+                    rc.anyHit(&origins[r*AXES], &dirs[r*AXES], scratch, &any_ids[r]);
+                }
+            });
+        }
+        for (u32 th=0; th<THREADS; ++th) {
+            threads[th].join();
+        }
+
+        fast_vector<u32> scene_ids;
+        mapInnerIds<Manager>(box_ids, scene_ids);
+        u32 wrong_closest = 0, wrong_any = 0, hit_rays = 0;
+        RayHits expected;
+        for (u32 r=0; r<CHECK_QUERIES; ++r) {
+            getBruteForceHits<Manager, AXES>(*sap, box_ids, &origins[r*AXES], &dirs[r*AXES], NULL, expected);
+            bool closest = closest_ids[r] != InvalidId();
+            if (!rightClosestHit(expected, closest, closest?scene_ids[closest_ids[r]]:0, closest_ts[r]))
+                ++wrong_closest;
+            bool any = any_ids[r] != InvalidId();
+            if (!rightAnyHit(expected, any, any?scene_ids[any_ids[r]]:0))
+                ++wrong_any;
+            hit_rays += u32(!expected.empty());
+        }
+        u32 errors = 0;
+        if (wrong_closest || wrong_any || !hit_rays) {
+            std::cerr << "const hits: " << wrong_closest << " wrong closest, " << wrong_any << " wrong any hits ("
+                      << hit_rays << " rays hit)" << std::endl;
+            ++errors;
+        }
+        delete sap;
+        return errors;
+    }
+
+    // random aabb, ray & sweep queries around scene boxes
+    template <u32 AXES>
+    struct Queries {
+        Queries(Scene<AXES>& scene, u32 boxes_count, Random& rnd) {
+            for (u32 q=0; q<CHECK_QUERIES; ++q) {
+                const f32* b = scene.getBounds(rnd.next()%boxes_count);
+                for (u32 a=0; a<AXES; ++a) {
+                    f32 enlarge = rnd.get(0, 4*BOX_SIZE_MAX);
+                    aabbs[q*AXES*2 + a] = b[a] - enlarge;
+                    aabbs[q*AXES*2 + AXES+a] = b[AXES+a] + enlarge;
+                    origins[q*AXES + a] = (b[a] + b[AXES+a])/2;
+                    dirs[q*AXES + a] = rnd.get(-8*BOX_SIZE_MAX, 8*BOX_SIZE_MAX);
+                    sweeps[q*AXES*2 + a] = b[a];
+                    sweeps[q*AXES*2 + AXES+a] = b[AXES+a];
+                    move_vecs[q*AXES + a] = rnd.get(-4*BOX_SIZE_MAX, 4*BOX_SIZE_MAX);
+                }
+            }
+        }
+
+        f32 aabbs[CHECK_QUERIES*AXES*2];
+        f32 origins[CHECK_QUERIES*AXES];
+        f32 dirs[CHECK_QUERIES*AXES];
+        f32 sweeps[CHECK_QUERIES*AXES*2];
+        f32 move_vecs[CHECK_QUERIES*AXES];
+    };
+
+    // scene ids (with t for ray & sweep hits) sorted, per query: aabbs, rays, sweeps
+    typedef std::vector<std::pair<u32, f32> > QueryResult;
+
+    template <typename Manager, u32 AXES>
+    static void runLiveQueries(const Manager& sap, const fast_vector<u32>& scene_ids, const Queries<AXES>& qs, std::vector<QueryResult>& results_out) {
+        results_out.assign(3*CHECK_QUERIES, QueryResult());
+        typename Manager::Raycaster rc = sap.getRayCaster();
+        typename Manager::Raycaster::Scratch scratch;
+        for (u32 q=0; q<CHECK_QUERIES; ++q) {
+            QueryResult* r = &results_out[q];
+            sap.queryAABB(&qs.aabbs[q*AXES*2], [&](Index id) { r->push_back(std::make_pair(scene_ids[id.getIndex()], 0.0f)); });
+            r = &results_out[CHECK_QUERIES + q];
+            rc.raycast(&qs.origins[q*AXES], &qs.dirs[q*AXES], scratch, [&](u32 box_id, f32 t) {
+                r->push_back(std::make_pair(scene_ids[box_id], t));
+                return true;
+            });
+            r = &results_out[2*CHECK_QUERIES + q];
+            rc.sweepBox(&qs.sweeps[q*AXES*2], &qs.move_vecs[q*AXES], scratch, [&](u32 box_id, f32 t) {
+                r->push_back(std::make_pair(scene_ids[box_id], t));
+                return true;
+            });
+        }
+        for (u32 i=0; i<results_out.size(); ++i) {
+            std::sort(results_out[i].begin(), results_out[i].end());
+        }
+    }
+
+    template <typename View, u32 AXES>
+    static void runViewQueries(const View& view, const fast_vector<u32>& scene_ids, const Queries<AXES>& qs, std::vector<QueryResult>& results_out) {
+        results_out.assign(3*CHECK_QUERIES, QueryResult());
+        typename View::Scratch scratch;
+        for (u32 q=0; q<CHECK_QUERIES; ++q) {
+            QueryResult* r = &results_out[q];
+            view.queryAABB(&qs.aabbs[q*AXES*2], [&](Index id) { r->push_back(std::make_pair(scene_ids[id.getIndex()], 0.0f)); });
+            r = &results_out[CHECK_QUERIES + q];
+            view.raycast(&qs.origins[q*AXES], &qs.dirs[q*AXES], scratch, [&](Index id, f32 t) {
+                r->push_back(std::make_pair(scene_ids[id.getIndex()], t));
+                return true;
+            });
+            r = &results_out[2*CHECK_QUERIES + q];
+            view.sweepBox(&qs.sweeps[q*AXES*2], &qs.move_vecs[q*AXES], scratch, [&](Index id, f32 t) {
+                r->push_back(std::make_pair(scene_ids[id.getIndex()], t));
+                return true;
+            });
+        }
+        for (u32 i=0; i<results_out.size(); ++i) {
+            std::sort(results_out[i].begin(), results_out[i].end());
+        }
+    }
+
+    // same boxes with t up to rounding (view & live queries are inlined differently, fast-math can round them differently)
+    static bool sameResults(const std::vector<QueryResult>& results, const std::vector<QueryResult>& expected) {
+        if (results.size() != expected.size())
+            return false;
+        for (u32 i=0; i<results.size(); ++i) {
+            if (results[i].size() != expected[i].size())
+                return false;
+            for (u32 j=0; j<results[i].size(); ++j) {
+                if (results[i][j].first != expected[i][j].first || std::fabs(results[i][j].second - expected[i][j].second) > 1e-4f)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // published view queried from other thread while manager is modified must give results of live queries
+    // at publish time, old view kept by reader stays unchanged by following publishes
+    template <typename Manager, u32 AXES>
+    static u32 checkReadView() {
+        Scene<AXES> scene(stUniform, CHECK_BOXES, 13);
+        Manager* sap = new Manager();
+        fast_vector<Index> box_ids(CHECK_BOXES);
+        fast_vector<typename Manager::BoxDataT> boxes_data(CHECK_BOXES);
+        sap->setFatMargin(1.0f);
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), CHECK_BOXES, box_ids.data());
+        for (u32 i=0; i<CHECK_BOXES/20; ++i) {
+            sap->sleepBox(box_ids[scene.accRandom().next()%CHECK_BOXES]);
+        }
+
+        u32 errors = 0;
+        std::shared_ptr<const typename Manager::ReadView> first_view;
+        std::vector<QueryResult> first_expected;
+        Queries<AXES>* first_queries = NULL;
+        fast_vector<u32> first_scene_ids;
+        for (u32 f=0; f<CHECK_FRAMES; ++f) {
+            sap->publishReadView();
+            std::shared_ptr<const typename Manager::ReadView> view = sap->getReadView();
+            if (view->getVersion() != f+1 || view->getBoxesCount() != sap->getBoxesCount()) {
+                std::cerr << "read view: version " << view->getVersion() << " with " << view->getBoxesCount() << " boxes" << std::endl;
+                ++errors;
+            }
+            fast_vector<u32> scene_ids;
+            mapInnerIds<Manager>(box_ids, scene_ids);
+            Queries<AXES>* qs = new Queries<AXES>(scene, CHECK_BOXES, scene.accRandom());
+            std::vector<QueryResult> expected;
+            runLiveQueries<Manager, AXES>(*sap, scene_ids, *qs, expected);
+
+            u32 reader_errors = 0;
+            std::thread reader([&view, &scene_ids, qs, &expected, &reader_errors]() {
+                std::vector<QueryResult> results;
+                for (u32 r=0; r<3; ++r) {
+                    runViewQueries<typename Manager::ReadView, AXES>(*view, scene_ids, *qs, results);
+                    if (!sameResults(results, expected))
+                        ++reader_errors;
+                }
+            });
+            churnSome(*sap, box_ids, boxes_data, scene);
+            moveAll(*sap, box_ids, scene, f);
+            reader.join();
+            if (reader_errors) {
+                std::cerr << "read view: " << reader_errors << " query rounds differ from live queries at publish" << std::endl;
+                ++errors;
+            }
+
+            if (f == 0) {
+                first_view = view;
+                first_expected = expected;
+                first_queries = qs;
+                first_scene_ids = scene_ids;
+            }
+            else {
+                delete qs;
+            }
+        }
+
+        std::vector<QueryResult> results;
+        runViewQueries<typename Manager::ReadView, AXES>(*first_view, first_scene_ids, *first_queries, results);
+        if (!sameResults(results, first_expected) || first_view->getVersion() != 1) {
+            std::cerr << "read view: view kept by reader changed after following publishes" << std::endl;
+            ++errors;
+        }
+        delete first_queries;
+        sap->validate();
+        delete sap;
+        return errors;
+    }
+
+    template <typename Manager, u32 AXES>
+    static Result runScenario(ScenarioType type, u32 boxes_count, const Options& o) {
+        Scene<AXES> scene(type, boxes_count, o.seed);
+        Manager* sap = new Manager();
+        sap->setWorkersCount(o.workers);
+        fast_vector<Index> box_ids(boxes_count);
+        fast_vector<typename Manager::BoxDataT> boxes_data(boxes_count);
+        Result rslt;
+
+        Clock::time_point t0 = Clock::now();
+        sap->addBoxes(scene.getBounds(0), boxes_data.data(), boxes_count, box_ids.data());
+        rslt.create_ms = Ms(Clock::now()-t0).count();
+        rslt.check_errors = 0;
+        if (o.check)
+            rslt.check_errors += checkBulkLoad<Manager, AXES>(*sap, box_ids, scene, boxes_data, o.seed,
+                                                                 // huge box added to already split tree would be in too many segments
+                                                                 type != stMixed);
+        sap->resetStats();
+
+        u32 teleported_count = (type == stTeleport)?u32(boxes_count*TELEPORTED_PART):0;
+        u32 churn_count = (type == stChurn)?u32(boxes_count*CHURN_PART):0;
+        fast_vector<f32> move_vecs(o.batch?boxes_count*AXES:0);
+        fast_vector<u32> picked;
+        rslt.update_ns = 0;
+        rslt.moved = 0;
+        rslt.pairs_sum = 0;
+        SAP::Stats stats;
+        for (u32 f=0; f<o.frames; ++f) {
+            // random picks are not timed
+            picked.clear();
+            for (u32 i=0; i<teleported_count+churn_count; ++i) {
+                u32 id = scene.accRandom().next()%boxes_count;
+                picked.push_back(id);
+                scene.spawn(id);
+            }
+
+            Clock::time_point t = Clock::now();
+            for (u32 i=0; i<churn_count; ++i) {
+                u32 id = picked[i];
+                sap->removeBox(box_ids[id]);
+                sap->addBox(box_ids[id], (f32*)scene.getBounds(id), boxes_data[id]);
+            }
+            for (u32 i=churn_count; i<picked.size(); ++i) {
+                u32 id = picked[i];
+                sap->updateBox(box_ids[id], (f32*)scene.getBounds(id));
+            }
+            if (o.batch) {
+                for (u32 i=0; i<boxes_count; ++i) {
+                    memcpy(&move_vecs[i*AXES], scene.getMove(i), AXES*sizeof(f32));
+                }
+                sap->moveBoxes(box_ids.data(), move_vecs.data(), boxes_count);
+            }
+            else {
+                for (u32 i=0; i<boxes_count; ++i) {
+                    sap->moveBox(box_ids[i], (f32*)scene.getMove(i));
+                }
+            }
+            rslt.update_ns += Ns(Clock::now()-t).count();
+            rslt.moved += boxes_count + teleported_count;
+            rslt.pairs_sum += sap->getOverlapsCount();
+
+            // per frame as in game loop
+            stats.add(sap->getStats());
+            sap->resetStats();
+        }
+        rslt.pairs = sap->getOverlapsCount();
+        if (o.check) {
+            sap->validate();
+            rslt.check_errors += checkPairs<Manager, AXES>(*sap, box_ids, SCENARIO_NAMES[type]);
+        }
+        rslt.stats = sap->getStats();
+        rslt.stats.add(stats);
+        delete sap;
+        return rslt;
+    }
+
+    static void printResult(ScenarioType type, u32 dims, const char* layout, u32 boxes_count, const Options& o, const Result& r) {
+        f64 update_s = r.update_ns*1e-9;
+        u64 swaps = r.stats.endpoint_swaps[0] + r.stats.endpoint_swaps[1] + r.stats.endpoint_swaps[2];
+        std::cout << "{\"scenario\":\"" << SCENARIO_NAMES[type] << "\""
+                  << ",\"dims\":" << dims
+                  << ",\"layout\":\"" << layout << "\""
+                  << ",\"boxes\":" << boxes_count
+                  << ",\"frames\":" << o.frames
+                  << ",\"batch\":" << (o.batch?"true":"false")
+                  << ",\"workers\":" << o.workers
+                  << ",\"create_ms\":" << r.create_ms
+                  << ",\"ns_per_moved_box\":" << (r.moved?r.update_ns/r.moved:0.0)
+                  << ",\"pairs_per_s\":" << (update_s>0?r.pairs_sum/update_s:0.0)
+                  << ",\"pairs\":" << r.pairs
+                  << ",\"bytes\":" << r.stats.bytes_allocated
+                  << ",\"splits\":" << r.stats.splits
+                  << ",\"merges\":" << r.stats.merges
+                  << ",\"crossings\":" << r.stats.crossings
+                  << ",\"endpoint_swaps\":" << swaps
+                  << ",\"leafs\":" << r.stats.leafs_count
+                  << ",\"depth\":" << r.stats.tree_depth
+                  << ",\"max_leaf_boxes\":" << r.stats.max_leaf_boxes;
+        if (o.check)
+            std::cout << ",\"check_errors\":" << r.check_errors;
+        std::cout << "}" << std::endl;
+    }
+
+    static u32 printCheck(const char* name, u32 dims, const char* layout, u32 errors) {
+        std::cout << "{\"check\":\"" << name << "\""
+                  << ",\"dims\":" << dims
+                  << ",\"layout\":\"" << layout << "\""
+                  << ",\"check_errors\":" << errors << "}" << std::endl;
+        return errors;
+    }
+
+    // feature checks independent of scenarios
+    template <typename Manager, u32 AXES>
+    static u32 runChecks(const char* layout) {
+        u32 errors = 0;
+        errors += printCheck("events", AXES, layout, checkEvents<Manager, AXES>());
+        errors += printCheck("adjacency", AXES, layout, checkAdjacency<Manager, AXES>());
+        errors += printCheck("pair_data_hook", AXES, layout, checkPairDataHook<Manager, AXES>());
+        errors += printCheck("filters", AXES, layout, checkFilters<Manager, AXES>());
+        errors += printCheck("degenerate", AXES, layout, checkDegenerate<Manager, AXES>());
+        errors += printCheck("fat_margin", AXES, layout, checkFatMargin<Manager, AXES>());
+        errors += printCheck("sleeping", AXES, layout, checkSleeping<Manager, AXES>());
+        errors += printCheck("deferred_maintenance", AXES, layout, checkDeferredMaintenance<Manager, AXES>());
+        errors += printCheck("trace", AXES, layout, checkTrace<Manager, AXES>());
+        errors += printCheck("snapshot", AXES, layout, checkSnapshot<Manager, AXES>());
+        errors += printCheck("packet_raycast", AXES, layout, checkPacketRaycast<Manager, AXES>());
+        errors += printCheck("closest_any_hit", AXES, layout, checkClosestAnyHit<Manager, AXES>());
+        errors += printCheck("ray_hits", AXES, layout, checkRayHits<Manager, AXES>());
+        errors += printCheck("sweep_box", AXES, layout, checkSweepBox<Manager, AXES>());
+        errors += printCheck("const_hits", AXES, layout, checkConstHits<Manager, AXES>());
+        errors += printCheck("read_view", AXES, layout, checkReadView<Manager, AXES>());
+        return errors;
+    }
+
+    // returns number of failed checks
+    template <typename Layout>
+    static u32 runAll(const char* layout, const Options& o) {
+        u32 errors = 0;
+        if (o.check) {
+            if (o.dims != 3)
+                errors += runChecks<SAPManagerSimple2D<SAPDomain2D<int, DummyType, Layout> >, 2>(layout);
+            if (o.dims != 2)
+                errors += runChecks<SAPManagerSimple3D<SAPDomain3D<int, DummyType, Layout> >, 3>(layout);
+        }
+        for (u32 s=0; s<stCount; ++s) {
+            if (o.scenario != stCount && o.scenario != s)
+                continue;
+            for (u32 i=0; i<o.sizes.size(); ++i) {
+                ScenarioType type = (ScenarioType)s;
+                if (o.dims != 3) {
+                    Result r = runScenario<SAPManagerSimple2D<SAPDomain2D<int, DummyType, Layout> >, 2>(type, o.sizes[i], o);
+                    printResult(type, 2, layout, o.sizes[i], o, r);
+                    errors += r.check_errors;
+                }
+                if (o.dims != 2) {
+                    Result r = runScenario<SAPManagerSimple3D<SAPDomain3D<int, DummyType, Layout> >, 3>(type, o.sizes[i], o);
+                    printResult(type, 3, layout, o.sizes[i], o, r);
+                    errors += r.check_errors;
+                }
+            }
+        }
+        return errors;
+    }
+
+    static bool parseOptions(int argc, char* argv[], Options& o) {
+        for (int i=1; i<argc; ++i) {
+            std::string arg = argv[i];
+            bool has_val = (i+1 < argc);
+            if (arg == "--sizes" && has_val) {
+                o.sizes.clear();
+                for (char* tok = strtok(argv[++i], ","); tok; tok = strtok(NULL, ",")) {
+                    o.sizes.push_back(u32(atoi(tok)));
+                }
+            }
+            else if (arg == "--frames" && has_val) {
+                o.frames = u32(atoi(argv[++i]));
+            }
+            else if (arg == "--seed" && has_val) {
+                o.seed = u32(atoi(argv[++i]));
+            }
+            else if (arg == "--dims" && has_val) {
+                o.dims = u32(atoi(argv[++i]));
+            }
+            else if (arg == "--workers" && has_val) {
+                o.workers = u32(atoi(argv[++i]));
+            }
+            else if (arg == "--batch") {
+                o.batch = true;
+            }
+            else if (arg == "--check") {
+                o.check = true;
+            }
+            else if (arg == "--layout" && has_val) {
+                std::string l = argv[++i];
+                o.aos = (l == "aos" || l == "both");
+                o.soa = (l == "soa" || l == "both");
+            }
+            else if (arg == "--scenario" && has_val) {
+                std::string name = argv[++i];
+                for (o.scenario=0; o.scenario<stCount; ++o.scenario) {
+                    if (name == SCENARIO_NAMES[o.scenario])
+                        break;
+                }
+                if (o.scenario == stCount)
+                    return false;
+            }
+            else {
+                return false;
+            }
+        }
+        if (o.sizes.empty()) {
+            o.sizes = {1000, 10000, 100000};
+        }
+        return true;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options o;
+    if (!parseOptions(argc, argv, o)) {
+        std::cerr << "usage: sap_bench [--sizes 1000,10000,100000,1000000] [--frames n] [--seed n] [--dims 2|3]"
+                  << " [--scenario uniform|clustered|mixed|teleport|churn] [--layout aos|soa|both] [--batch] [--workers n] [--check]" << std::endl;
+        return 1;
+    }
+    u32 errors = 0;
+    if (o.aos)
+        errors += runAll<SAP::PointsAoS>("aos", o);
+    if (o.soa)
+        errors += runAll<SAP::PointsSoA>("soa", o);
+    return errors?2:0;
+}
@@ -0,0 +1,133 @@
+// replays trace recorded with SAPManagerBase::startRecording() on fresh manager at full speed,
+// prints one JSON object per frame and summary at the end:
+//   sap_replay trace_file [--layout aos|soa] [--workers n] [--summary]
+
+#include "base.h"
+using namespace grynca;
+#include "SAP.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+namespace {
+
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::duration<f64, std::milli> Ms;
+
+    struct Options {
+        Options() : path(NULL), soa(false), workers(1), summary_only(false) {}
+
+        const char* path;
+        bool soa;
+        u32 workers;
+        bool summary_only;
+    };
+
+    template <typename Manager>
+    static bool replay(SAPTraceReader& trace, const Options& o) {
+        Manager* sap = new Manager();
+        sap->setWorkersCount(o.workers);
+
+        u32 frames = 0;
+        u64 ops_total = 0;
+        f64 total_ms = 0, max_ms = 0;
+        u32 ops;
+        for (;;) {
+            Clock::time_point t = Clock::now();
+            if (!trace.replayFrame(*sap, &ops))
+                break;
+            f64 ms = Ms(Clock::now()-t).count();
+            total_ms += ms;
+            if (ms > max_ms)
+                max_ms = ms;
+            ops_total += ops;
+            if (!o.summary_only) {
+                std::cout << "{\"frame\":" << frames
+                          << ",\"ops\":" << ops
+                          << ",\"ms\":" << ms
+                          << ",\"boxes\":" << sap->getBoxesCount()
+                          << ",\"pairs\":" << sap->getOverlapsCount()
+                          << "}" << std::endl;
+            }
+            ++frames;
+        }
+
+        SAP::Stats stats = sap->getStats();
+        std::cout << "{\"trace\":\"" << o.path << "\""
+                  << ",\"dims\":" << trace.getAxesCount()
+                  << ",\"layout\":\"" << (o.soa?"soa":"aos") << "\""
+                  << ",\"workers\":" << o.workers
+                  << ",\"complete\":" << (trace.isComplete()?"true":"false")
+                  << ",\"frames\":" << frames
+                  << ",\"ops\":" << ops_total
+                  << ",\"total_ms\":" << total_ms
+                  << ",\"avg_frame_ms\":" << (frames?total_ms/frames:0.0)
+                  << ",\"max_frame_ms\":" << max_ms
+                  << ",\"boxes\":" << sap->getBoxesCount()
+                  << ",\"pairs\":" << sap->getOverlapsCount()
+                  << ",\"splits\":" << stats.splits
+                  << ",\"merges\":" << stats.merges
+                  << ",\"leafs\":" << stats.leafs_count
+                  << ",\"depth\":" << stats.tree_depth
+                  << "}" << std::endl;
+        delete sap;
+        return trace.isComplete();
+    }
+
+    template <typename Layout>
+    static bool replayWithLayout(SAPTraceReader& trace, const Options& o) {
+        if (trace.getAxesCount() == 2)
+            return replay<SAPManagerSimple2D<SAPDomain2D<int, DummyType, Layout> > >(trace, o);
+        return replay<SAPManagerSimple3D<SAPDomain3D<int, DummyType, Layout> > >(trace, o);
+    }
+
+    static bool parseOptions(int argc, char* argv[], Options& o) {
+        for (int i=1; i<argc; ++i) {
+            std::string arg = argv[i];
+            bool has_val = (i+1 < argc);
+            if (arg == "--workers" && has_val) {
+                o.workers = u32(atoi(argv[++i]));
+            }
+            else if (arg == "--summary") {
+                o.summary_only = true;
+            }
+            else if (arg == "--layout" && has_val) {
+                std::string l = argv[++i];
+                if (l != "aos" && l != "soa")
+                    return false;
+                o.soa = (l == "soa");
+            }
+            else if (!o.path && arg[0] != '-') {
+                o.path = argv[i];
+            }
+            else {
+                return false;
+            }
+        }
+        return o.path != NULL;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    Options o;
+    if (!parseOptions(argc, argv, o)) {
+        std::cerr << "usage: sap_replay trace_file [--layout aos|soa] [--workers n] [--summary]" << std::endl;
+        return 1;
+    }
+    SAPTraceReader trace;
+    if (!trace.open(o.path)) {
+        std::cerr << "can't read trace " << o.path << std::endl;
+        return 1;
+    }
+    if (trace.getAxesCount() != 2 && trace.getAxesCount() != 3) {
+        std::cerr << "unsupported axes count " << trace.getAxesCount() << std::endl;
+        return 1;
+    }
+    bool ok = o.soa ? replayWithLayout<SAP::PointsSoA>(trace, o) : replayWithLayout<SAP::PointsAoS>(trace, o);
+    if (!ok) {
+        std::cerr << "trace is truncated or corrupted" << std::endl;
+        return 2;
+    }
+    return 0;
+}